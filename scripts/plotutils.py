@@ -4,6 +4,9 @@ plotutils.py
 Utility functions used by pulsplot, respplot, logplot, etc
 Keep in same directory with those scripts
 """
+import os
+import sys
+import numpy as np
 
 ID_PREFIX = "s_"    # prefix for study directory
 ID_SUFFIX = ""      # suffix for study directory
@@ -31,6 +34,95 @@ def read_study_id_file(path):
             sys.exit(0)
     return sorted(study_list)
 
+# cohort rate store written by ampd --store, see src/ratestore.h
+RSTORE_NAME = "cohort.ars"
+RSTORE_HEADER = np.dtype([("magic","S8"),("rec_size","<u4"),("reserved","<u4")])
+RSTORE_REC = np.dtype([("study","S24"),("channel","S8"),("run","<u8"),
+                       ("batch","<u4"),("start","<u4"),
+                       ("batch_length","<f4"),("sampling_rate","<f4"),
+                       ("rate","<f4"),("lambda","<i4"),
+                       ("mean_pk_dist","<f4"),("stdev_pk_dist","<f4"),
+                       ("n_peaks","<i4"),("reserved","<u4")])
+
+def read_rate_store(path):
+    """ Return {(study, channel): records} with the newest run of each study
+    and channel sorted by batch, as queried by ampdstat"""
+    path = full_path(path)
+    if os.path.isdir(path):
+        path = os.path.join(path, RSTORE_NAME)
+    if not os.path.isfile(path):
+        print("Wrong path for rate store: '"+str(path)+"'")
+        sys.exit(0)
+    hdr = np.fromfile(path, dtype=RSTORE_HEADER, count=1)
+    if (len(hdr) == 0 or hdr[0]["magic"] != b"AMPDRST1" or
+            hdr[0]["rec_size"] != RSTORE_REC.itemsize):
+        print("ERROR: "+str(path)+" is not a rate store")
+        sys.exit(0)
+    rec = np.fromfile(path, dtype=RSTORE_REC, offset=RSTORE_HEADER.itemsize)
+    store = {}
+    for study, channel in set(zip(rec["study"], rec["channel"])):
+        r = rec[(rec["study"] == study) & (rec["channel"] == channel)]
+        r = r[r["run"] == r["run"].max()]
+        store[(study.decode(), channel.decode())] = np.sort(r, order="batch")
+    return store
+
+def rate_store_studies(store):
+    """ Return sorted study IDs of the store without the directory prefix"""
+    ids = set()
+    for study, channel in store:
+        if study.startswith(ID_PREFIX):
+            study = study[len(ID_PREFIX):]
+        ids.add(study)
+    return sorted(ids)
+
+def rate_store_get(store, study, channel):
+    """ Return records of a study and channel or None. The study is matched
+    on the end of the store ID with the directory prefix removed, so
+    's_2020040501' finds runs stored as '2020040501' as well."""
+    if study.startswith(ID_PREFIX):
+        study = study[len(ID_PREFIX):]
+    for (s, c), r in sorted(store.items()):
+        if c == channel and s.endswith(study):
+            return r
+    return None
+
+# min/max pyramid written by ampd --output-lod, see src/lod.h
+LOD_MAX_LEVELS = 16
+LOD_HEADER = np.dtype([("magic","S8"),("factor","<u4"),("levels","<u4"),
+                       ("datalen","<u4"),("reserved","<u4"),
+                       ("sampling_rate","<f8"),
+                       ("count","<u8",LOD_MAX_LEVELS),
+                       ("offset","<u8",LOD_MAX_LEVELS)])
+
+def read_lod(path):
+    """ Return header and list of memory mapped (bins, 2) min/max levels"""
+    hdr = np.fromfile(path, dtype=LOD_HEADER, count=1)[0]
+    if hdr["magic"] != b"AMPDLOD1":
+        print("ERROR: "+str(path)+" is not a level of detail file")
+        sys.exit(0)
+    levels = []
+    for k in range(hdr["levels"]):
+        levels.append(np.memmap(path, dtype="<f4", mode="r",
+                                offset=int(hdr["offset"][k]),
+                                shape=(int(hdr["count"][k]), 2)))
+    return hdr, levels
+
+def lod_view(hdr, levels, t0, t1, bins=2000):
+    """ Return time, min, max of the coarsest level with at least 'bins' bins
+    between t0 and t1 seconds. Only that part of the file is read."""
+    fs = hdr["sampling_rate"]
+    n = max(int((t1 - t0) * fs), 1)
+    k = 0
+    while (k+1 < len(levels) and
+           n / (hdr["factor"] ** (k+2)) >= bins):
+        k += 1
+    size = hdr["factor"] ** (k+1)    # samples per bin
+    i0 = max(int(t0 * fs) // size, 0)
+    i1 = min(int(t1 * fs) // size + 1, len(levels[k]))
+    lv = np.asarray(levels[k][i0:i1])
+    t = (np.arange(i0, i1) * size + size / 2) / fs
+    return t, lv[:,0], lv[:,1]
+
 def full_path(path):
     """ check path syntax and return full path"""
     if path[0] == "~":
@@ -14,10 +14,11 @@ from pathlib import Path    # Python > 3.5
 import csv
 
 from jkfetch import fetch_study_log
+from plotutils import read_rate_store, rate_store_studies, rate_store_get
 
 # User setup; modify as needed
 #--------------------------------------------------------------
-# datatype to plot. Files are searched wirh names DTYPE[i].rate
+# datatype to plot, channel names in the rate store
 DTYPE = ["resp","puls"]
 DTYPE_THRESH = [(30,150),(100,500)]
 AUTO_EXCLUDE = 1     # exlude where data is not within bounds
@@ -27,7 +28,6 @@ EXCLUDE_FILE = "exclude_id"
 ID_PREFIX = "s_"    # prefix for study directory
 ID_SUFFIX = ""      # suffix for study directory
 NUM = len(DTYPE)    # number of data type, plots
-HEADER_LENGTH = 2   # maximum number of header lines in .rate files
 
 JK_PATH = "~/work/jk2020aug.csv"        # sequence log file
 JK_HEADER_PATH = "~/work/csv_headers"   # header for sequence log
@@ -50,9 +50,9 @@ def usage():
 
     Plot multiple respiration, pulse, etc rates on each other.
 
-    Input directory should contain the study directories named 's_[YYYYMMDDNN]',
-    eg: s_2020050201. Study directories are searched for ampd output files with
-    the suffix 'rate', eg: resp.rate. These are the main source of the plots.
+    Input directory should contain the cohort rate store 'cohort.ars' written
+    by saiproc (ampd --store). The newest run of each study and channel in the
+    store is the source of the plots, see also ampdstat.
 
     The optional arguments start and stop should have the following syntax:
     - 2 numbers: (eg '--start=01 --stop=06') means the ID on the last day
@@ -128,52 +128,41 @@ def main():
 
     log_headers = read_csv_headers(JK_HEADER_PATH)
 
-    #---------- gather files to plot-------------------------------------------
-    pattern = ID_PREFIX + "*"+ID_SUFFIX
+    #---------- gather studies to plot-----------------------------------------
+    store = read_rate_store(indir)
     study_dir_list = []
     exclude_study_list = []
-    data_files = [[] for i in range( NUM )]
     count = 1 if stop == None else 0
 
-    for studydir in sorted(glob.glob(indir+"/"+pattern), reverse=True):
+    for study in rate_store_studies(store)[::-1]:
 
         if count == 0:
-            if studydir.endswith(stop): # start counting back from stop
+            if study.endswith(stop): # start counting back from stop
                 count = 1
             else:
                 continue
         # check for excluded
-        if studydir.endswith(tuple(exclude_list)):
-            exclude_study_list.append(studydir)
+        if study.endswith(tuple(exclude_list)):
+            exclude_study_list.append(study)
             continue
-        study_dir_list.append(studydir)
-        # search files
-        for path in Path(studydir).rglob('*.rate'):
-            for i in range(NUM):
-                if DTYPE[i] in str(path.name):
-                    data_files[i].append(path)
+        if all(rate_store_get(store, study, d) is not None for d in DTYPE):
+            study_dir_list.append(study)
 
         if start is not None:
-            if studydir.endswith(start):# stop counting once 'start' is encountered
+            if study.endswith(start):# stop counting once 'start' is encountered
                 break
 
-    # --------------------read files-------------------------------------------
+    # --------------------read store-------------------------------------------
     data_arr = [[] for i in range(NUM)]
     batch_lengths = []
     sampling_rates = []
-    for ind, data_file in enumerate(data_files):
-        for f in data_file:
-            with open(f,'r') as openf:
-                data = openf.read().split('\n')
-                for item in data[:HEADER_LENGTH]:
-                    if "batch_length" in item:
-                        batch_length = int(float(item.split('=')[-1]))
-                        batch_lengths.append(batch_length)
-                    if "sampling_rate" in item:
-                        val = int(float(item.split('=')[-1]))
-                        sampling_rates.append(val)
-                data = np.array([int(x) for x in data[:-1] if not x[0] == "#"])
-                data_arr[ind].append(data)
+    for ind in range(NUM):
+        for study in study_dir_list:
+            rec = rate_store_get(store, study, DTYPE[ind])
+            batch_length = int(rec["batch_length"][0])
+            batch_lengths.append(batch_length)
+            sampling_rates.append(int(rec["sampling_rate"][0]))
+            data_arr[ind].append(np.rint(rec["rate"]).astype(int))
     print(log_headers)
 
 
@@ -13,10 +13,12 @@ import os
 import glob
 from pathlib import Path    # Python > 3.5 
 import csv
+from plotutils import read_rate_store, rate_store_get
 
 # USER SETUP
 #------------------------------------------------------------------------------
-# Directory to contain processed physiological data for each study.
+# Directory to contain processed physiological data for each study and the
+# cohort rate store cohort.ars written by saiproc.
 STUDY_ROOT_DIR="/home/david/work/proc"
 #STUDY_ROOT_DIR="/home/david/work/scop/proc"
 # Experiment log file
@@ -45,7 +47,6 @@ ID_SUFFIX = ""      # suffix for study directory
 DTYPE = ["resp","puls"]
 DTYPE_THRESH = [(30,150),(100,500)]
 NUM = len(DTYPE)    # number of data type, plots
-HEADER_LENGTH = 2   # maximum number of header lines in .rate files
 
 # Log file processing
 # -------------------
@@ -56,39 +57,20 @@ TIMESTEP = 60       # pick points
 def read_rate_files(study_list):
     """Return  data array, and metadata as batch length, sampling rates"""
 
-    indir = full_path(STUDY_ROOT_DIR)
-    #---------- gather files to plot-------------------------------------------
-    pattern = ID_PREFIX + "*"+ID_SUFFIX
-    study_dir_list = []
-    data_files = [[] for i in range( NUM )]
-
-    for studydir in sorted(glob.glob(indir+"/"+pattern)):
-
-        if os.path.basename(studydir) in study_list:
-            study_dir_list.append(studydir)
-            # search files
-            for path in Path(studydir).rglob('*.rate'):
-                for i in range(NUM):
-                    if DTYPE[i] in str(path.name):
-                        data_files[i].append(path)
-
-    # --------------------read files-------------------------------------------
+    store = read_rate_store(STUDY_ROOT_DIR)
+    # --------------------read store-------------------------------------------
     data_arr = [[] for i in range(NUM)]
     batch_lengths = []
     sampling_rates = []
-    for ind, data_file in enumerate(data_files):
-        for f in data_file:
-            with open(f,'r') as openf:
-                data = openf.read().split('\n')
-                for item in data[:HEADER_LENGTH]:
-                    if "batch_length" in item:
-                        batch_length = int(float(item.split('=')[-1]))
-                        batch_lengths.append(batch_length)
-                    if "sampling_rate" in item:
-                        val = int(float(item.split('=')[-1]))
-                        sampling_rates.append(val)
-                data = np.array([int(x) for x in data[:-1] if not x[0] == "#"])
-                data_arr[ind].append(data)
+    for ind in range(NUM):
+        for study in study_list:
+            rec = rate_store_get(store, study, DTYPE[ind])
+            if rec is None:
+                print("WARNING: no "+DTYPE[ind]+" rates for "+study)
+                continue
+            batch_lengths.append(int(rec["batch_length"][0]))
+            sampling_rates.append(int(rec["sampling_rate"][0]))
+            data_arr[ind].append(np.rint(rec["rate"]).astype(int))
 
     # check for samebatch lengts and sampling rates
     bl = batch_lengths[0]
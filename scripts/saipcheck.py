@@ -9,6 +9,8 @@ import getopt
 import os
 import sys
 
+from plotutils import read_lod, lod_view
+
 def usage():
     txt="""
 Check the results of ampd and saiproc.py by plotting the raw data with the peaks.
@@ -19,6 +21,9 @@ Usage:
 Optional:
     --save      save png image to study direcotry
 
+If ampd was run with --output-lod, the min/max envelope in [d].ampd.out/[d].lod
+is plotted instead of the raw text data, which is much faster for full sessions.
+
 The input directory should have the same layout as created by saiproc.py:
 
 [input_dir]/resp.txt
@@ -39,6 +44,7 @@ PEAKS_OFFSET = 2
 NUM = 2                     # currently used number of plots
 SAMPLING_RATE = 100         # samples per seconds
 RESOLUTION = 1              # only include every nth point to speed up plotting
+LOD_BINS = 4000             # envelope bins to plot if a .lod file is found
 def main():
 
     optstr = "hvi:"
@@ -65,6 +71,12 @@ def main():
     for i, d in enumerate(dtype):
         raw = indir +"/"+d + ".txt"
         peaks = indir+"/"+d+".ampd.out/"+d+".peaks"
+        lod = indir+"/"+d+".ampd.out/"+d+".lod"
+        if os.path.isfile(lod):
+            lod_time = plot_lod(axes[i], lod, peaks)
+            if d == dtype[0]:
+                max_time = lod_time
+            continue
         #raw_data = np.loadtxt(raw, offset=RAW_OFFSET)
         #peaks_data = np.fromfile(peaks, dtype=np.int, offset=PEAKS_OFFSET)
         raw_data = np.array(read_csv(raw,dtype=float))
@@ -88,6 +100,21 @@ def main():
     plt.tight_layout()
     plt.show()
 
+def plot_lod(ax, lod, peaks):
+    """ Plot min/max envelope of the full session, peaks are marked at the
+    maximum of their finest level bin. Return the session length in s"""
+    hdr, levels = read_lod(lod)
+    max_time = hdr["datalen"] / hdr["sampling_rate"]
+    t, mn, mx = lod_view(hdr, levels, 0, max_time, LOD_BINS)
+    ax.fill_between(t, mn, mx, linewidth=0.5)
+    peaks_x = np.array(read_csv(peaks, dtype=int)).flatten()
+    peaks_x = peaks_x[peaks_x<hdr["datalen"]]
+    peaks_y = np.asarray(levels[0][peaks_x // hdr["factor"], 1])
+    ax.scatter(peaks_x / hdr["sampling_rate"], peaks_y, c='r',s=1.5, zorder=9)
+    ax.set_aspect('auto')
+    ax.set_xlim(left=0,right=max_time)
+    return max_time
+
 
 if __name__ == "__main__":
     main()
@@ -70,8 +70,10 @@ SUFFIX = ""
 RESP_COL = 1    # position of respiration data in raw sai data file, 
 PULS_COL = 2    # position of pulsoxy data 
 ECG_COL = 3     # ecg data column
+ECG_RATE = 1000 # ecg sampling rate in Hz
 # ampd options
 LENGTH = 60     # batch-length
+STORE = True    # append batch results to [outdir]/cohort.ars, see ampdstat
 #saiproc defaults
 VERBOSE_DEF = False
 
@@ -94,6 +96,7 @@ def params():
     par = dict()
     par["resp_col"] = RESP_COL
     par["puls_col"] = PULS_COL
+    par["ecg_col"] = ECG_COL
     par["length"] = LENGTH
     par["verbose"] = VERBOSE_DEF
     par["prefix"] = PREFIX
@@ -233,6 +236,10 @@ def main():
         # puls
         cmd = "colextract"+" -f "+f +" -o "+puls_data + " -n "+str(par["puls_col"]) 
         os.system(cmd)
+        # ecg
+        if ECG:
+            cmd = "colextract"+" -f "+f +" -o "+ecg_data + " -n "+str(par["ecg_col"])
+            os.system(cmd)
 
         # prepare ampd output
         resp_ampd_out = outdir_study + "/resp.ampd.out"
@@ -243,25 +250,30 @@ def main():
         ecg_ampd_aux = outdir_study + "/ecg.ampd.aux"
 
         # run ampd
+        store_opt = ""
+        if STORE:
+            store_opt = " --store "+outdir+"/cohort.ars --study "+str(study_id)
         if RESP:
             infile = resp_data
             cmd = "ampd"+" -f "+infile+" -o "+resp_ampd_out+" -t resp "+" -l 60 --autoflip"
             if RESP_AUX:
                 cmd = cmd+" -a "+resp_ampd_aux +" --output-all"
-            os.system(cmd)
+            os.system(cmd+store_opt)
         if PULS:
             infile = puls_data
             cmd = "ampd"+" -f "+infile+" -o "+puls_ampd_out+" -t puls "+" -l 60 \
                     --lambda-max="+str(PULS_LAMBDA_MAX)
             if PULS_AUX:
                 cmd = cmd+" -a "+puls_ampd_aux+" --output-all"
-            os.system(cmd)
+            os.system(cmd+store_opt)
         if ECG:
             infile = ecg_data
-            cmd = "ampd"+" -f "+infile+" -o "+ecg_ampd_out+" -t ecg "+" -l 60"
+            # batch length and scale bounds are set by the ecg preset
+            cmd = "ampd"+" -f "+infile+" -o "+ecg_ampd_out+" -t ecg "+" -r "+\
+                    str(ECG_RATE)
             if ECG_AUX:
                 cmd = cmd+" -a "+ecg_ampd_aux+" --output-all"
-            os.system(cmd)
+            os.system(cmd+store_opt)
 
     
 
@@ -22,6 +22,27 @@
 #define ARG_RATE_MIN 11
 #define ARG_RATE_MAX 12
 #define ARG_LAMBDA_MAX 13
+#define ARG_MAX_MEM 14
+#define ARG_THREADS 15
+#define ARG_TROUGHS 16
+#define ARG_KERNEL 17
+#define ARG_LANES 18
+#define ARG_INT16 19
+#define ARG_NO_INDEX 20
+#define ARG_STORE 21
+#define ARG_STUDY 22
+#define ARG_OUTPUT_LOD 23
+#define ARG_APPROX 24
+#define ARG_APPROX_CHECK 25
+#define ARG_REFINE 26
+#define ARG_ADAPTIVE 27
+#define ARG_DETERMINISTIC 28
+#define ARG_STREAM 29
+#define ARG_SHM 30
+#define ARG_CHANNEL 31
+#define ARG_CACHE 32
+
+#define FBUF 32         // input line buffer
 
 int verbose;
 int output_all = DEF_OUTPUT_ALL;   // output all intermediary data except LMS
@@ -29,6 +50,9 @@ int output_lms = DEF_OUTPUT_LMS;   // output local maxima scalogram, HUGE!
 int output_rate = DEF_OUTPUT_RATE;  // output peaks per min
 int output_peaks = DEF_OUTPUT_PEAKS; // output peak indices
 int output_meta = DEF_OUTPUT_META;
+int output_index = DEF_OUTPUT_INDEX; // binary peak index for ampdquery
+int output_lod = DEF_OUTPUT_LOD; // min/max pyramid for plotting
+int output_troughs = DEF_OUTPUT_TROUGHS; // detect and output troughs as well
 int output_img = DEF_OUTPUT_IMG; // save plot image in all batches for inspection
 int preproc = DEF_PREPROC; 
 int autoflip = DEF_AUTOFLIP;
@@ -46,8 +70,8 @@ static struct option long_options[] =
     {"preproc", no_argument, NULL, ARG_PREPROC},
     {"hpfilt", required_argument, NULL, ARG_HPFILT},
     {"lpfilt", required_argument, NULL, ARG_LPFILT},
-    {"rate-min", required_argument, NULL, ARG_RATE_MIN}, // unused
-    {"rate-max", required_argument, NULL, ARG_RATE_MAX}, // unused
+    {"rate-min", required_argument, NULL, ARG_RATE_MIN},
+    {"rate-max", required_argument, NULL, ARG_RATE_MAX},
     {"lambda-max", required_argument, NULL, ARG_LAMBDA_MAX},
     {"output-all", no_argument, NULL, ARG_OUTPUT_ALL},
     {"output-lms", no_argument, NULL, ARG_OUTPUT_LMS},
@@ -55,6 +79,25 @@ static struct option long_options[] =
     {"output-peaks", no_argument, NULL, ARG_OUTPUT_PEAKS},
     {"output-img", no_argument, NULL, ARG_OUTPUT_IMG}, //TODO
     {"autoflip", no_argument, NULL, ARG_AUTOFLIP},
+    {"max-mem", required_argument, NULL, ARG_MAX_MEM},
+    {"threads", required_argument, NULL, ARG_THREADS},
+    {"troughs", no_argument, NULL, ARG_TROUGHS},
+    {"kernel", required_argument, NULL, ARG_KERNEL},
+    {"lanes", required_argument, NULL, ARG_LANES},
+    {"int16", no_argument, NULL, ARG_INT16},
+    {"no-index", no_argument, NULL, ARG_NO_INDEX},
+    {"store", required_argument, NULL, ARG_STORE},
+    {"study", required_argument, NULL, ARG_STUDY},
+    {"output-lod", no_argument, NULL, ARG_OUTPUT_LOD},
+    {"approx", no_argument, NULL, ARG_APPROX},
+    {"approx-check", required_argument, NULL, ARG_APPROX_CHECK},
+    {"refine", no_argument, NULL, ARG_REFINE},
+    {"adaptive", no_argument, NULL, ARG_ADAPTIVE},
+    {"deterministic", no_argument, NULL, ARG_DETERMINISTIC},
+    {"stream", no_argument, NULL, ARG_STREAM},
+    {"shm", required_argument, NULL, ARG_SHM},
+    {"channel", required_argument, NULL, ARG_CHANNEL},
+    {"cache", no_argument, NULL, ARG_CACHE},
     {NULL, 0, NULL, 0}
 };
 static char optstring[] = "hvf:o:a:l:r:t:";
@@ -89,10 +132,13 @@ void printf_help(){
     "-o --outdir:           output dir, defaults to [cwd]/ampd.out\n"
     "-v --verbose:          verbose\n"
     "-h --help:             print help\n"
-    "-r --samplig-rate:     sampling rate input data in Hz, default is 100\n"
-    "-l --batch-length:     data window length in seconds, default is 60 sec\n"
-    "--rate-min:            UNUSED\n"
-    "--rate-max:            UNUSED\n"
+    "-t --datatype:         preset for resp, puls or ecg\n"
+    "-r --samplig-rate:     sampling rate input data in Hz, default is 100,\n"
+    "                       1000 for ecg\n"
+    "-l --batch-length:     data window length in seconds, default is 60 sec,\n"
+    "                       20 sec for ecg\n"
+    "--rate-min:            plausible minimum peaks per min, for --refine\n"
+    "--rate-max:            plausible maximum peaks per min, for --refine\n"
     "--lambda-max:          threshold lambda, choose empirically"
     "--preproc:             call ampdpreproc on data first\n"
     "--lpfilt:              apply lowpass filter in Hz\n"
@@ -102,6 +148,37 @@ void printf_help(){
     "--output-lms:          output local maxima scalogram (high disk space usage)\n"
     "--output-rate:         output peak-per-min\n"
     "--output-peaks         output peak indices\n"
+    "--max-mem:             memory budget in MB, default is half of RAM\n"
+    "--threads:             number of worker threads, default is all cores\n"
+    "--troughs:             output trough indices as well, autoflip is ignored\n"
+    "--kernel:              LMS kernel: dense, bitpack, matfree, lanes, i16 or\n"
+    "                       approx\n"
+    "--lanes:               batches per lanes kernel call, default is 8\n"
+    "--int16:               read fixed point input as int16, use int16 kernel\n"
+    "--no-index:            do not output the binary peak index (.pkx)\n"
+    "--store:               append batch results to cohort rate store file\n"
+    "--study:               study ID in the store, default is found in path\n"
+    "--output-lod:          output min/max pyramid of raw data for plotting\n"
+    "--approx:              approximate kernel, faster, error is in .meta\n"
+    "--approx-check:        check every nth batch with exact kernel, default\n"
+    "                       is 10, 0 is off\n"
+    "--refine:              recompute implausible batches and neighbours with\n"
+    "                       alternative settings, keep the best result\n"
+    "--adaptive:            window length from the estimated peak period, up\n"
+    "                       to the batch length, .rate stays on batch grid,\n"
+    "                       default for ecg\n"
+    "--deterministic:       bitwise same results for any number of threads,\n"
+    "                       sums in a fixed order\n"
+    "--stream:              read the input as it comes, eg: from a FIFO, and\n"
+    "                       write the peaks of each batch when it is full.\n"
+    "                       Implied by -f -, stdin. With -o - peaks go to\n"
+    "                       stdout only\n"
+    "--shm:                 stream from a shared memory sample ring, eg: /ampd,\n"
+    "                       made by the acquisition process, see ampdshmwrite\n"
+    "--channel:             channel of the ring, label or index, default is 0\n"
+    "--cache:               keep the parsed input in [infile].ampdc and map it\n"
+    "                       on later runs instead of parsing, made again if\n"
+    "                       the input changed\n"
     "\n"
         );
 }
@@ -123,47 +200,72 @@ int main(int argc, char **argv){
     char outfile_peaks[MAX_PATH_LEN] = {0}; // main output file with indices of peaks
     char outfile_rate[MAX_PATH_LEN] = {0};  // rate per min for each batch
     char outfile_meta[MAX_PATH_LEN] = {0}; // metadata
+    char outfile_troughs[MAX_PATH_LEN] = {0}; // trough indices
+    char outfile_index[MAX_PATH_LEN] = {0}; // binary peak index
+    char outfile_lod[MAX_PATH_LEN] = {0}; // min/max pyramid
     FILE *fp_out;        // main output file containing the peak indices
+    FILE *fp_out_troughs = NULL;
     FILE *fp_out_rate;
     FILE *fp_out_meta;
+    struct pkx_writer *pkx = NULL;
+    char store[MAX_PATH_LEN] = {0};     // cohort rate store
+    char study[RSTORE_ID_LEN+1] = {0};
+    struct rstore_rec *srec = NULL;
+    uint64_t run_stamp = 0;
     char cwd[MAX_PATH_LEN]; // current directory
-    /*
-     * aux output files
-     */
-    char raw_path[MAX_PATH_LEN];
-    char detrend_path[MAX_PATH_LEN];
-    char lms_path[MAX_PATH_LEN];
-    char rlms_path[MAX_PATH_LEN];
-    char gamma_path[MAX_PATH_LEN];
-    char sigma_path[MAX_PATH_LEN];
-    char peaks_path[MAX_PATH_LEN];
-    char preproc_path[MAX_PATH_LEN];
-    char param_path[MAX_PATH_LEN];
-    char batch_param_path[MAX_PATH_LEN];
 
     /* load data for preproc*/
     float *full_data;
 
     /* data flipping for is respiration events are minima*/
-    int *bins;
     int n_bins;
-    double cmass;
     int autoflip;
     /*
      * batch processing
      */
-    float *data;        //  timeseries
     int n;              // number of elements in timeseries, in a batch, dynamic
-    int ind;            // index of next batch
-    int n_zpad = DEF_N_ZPAD; // zeropad data to help detect peaks on edges
     int data_buf;
     int datalen;        // full data length
     double batch_length = -1;
     int cycles;         // number of data batches
     int sum_n_peaks;    // summed peak number from all batches
-    int *sum_peaks;      // concatenated vector from peak indices
-    double peaks_per_min;
+    int sum_n_troughs;
     struct batch_param *bparam; // only for outputting batch utility parameters
+    struct batch_ctx ctx;       // shared between worker threads
+    struct batch_result *res;
+    /*
+     * execution planning
+     */
+    struct ampd_plan plan;
+    double max_mem_mb = DEF_MAX_MEM;
+    int threads = DEF_THREADS;
+    int kernel = -1;
+    int lanes = AMPD_LANES;
+    int int16 = DEF_INT16;
+    int approx = DEF_APPROX;
+    int approx_check = DEF_APPROX_CHECK;
+    int refine = DEF_REFINE;
+    int adaptive = -1;          // -1 is the datatype default
+    int deterministic = DEF_DETERMINISTIC;
+    int pipeline;               // read, compute and write at the same time
+    int stream = 0;             // process the input as it arrives
+    int to_stdout = 0;          // stream peaks to stdout, nothing else
+    struct stream_src src;      // stream input, text or shared memory
+    struct shm_ring shm;
+    char shm_name[MAX_PATH_LEN] = {0};
+    char channel[SHM_LABEL_LEN] = "0";
+    int cache = 0;              // parsed input sidecar
+    struct txc txc;
+    float *cached = NULL;       // mapped input column
+    int rate_cell;              // batch grid cell of an adaptive window
+    double rate_len;            // seconds
+    int *grid_peaks = NULL;     // adaptive .rate, peaks in each grid cell
+    double sum_window_length;
+    struct pk_stats ipi;        // peak distances of the recording
+    int last_peak = -1;         // of the previous window, for the distance
+    struct meta_param rstat;    // refinement counts, copied to meta
+    int16_t *full_q = NULL;     // full data as fixed point
+    double q_scale = -1;
 
     /* 
      * filtering
@@ -178,14 +280,9 @@ int main(int argc, char **argv){
     struct ampd_param *param;
     double sampling_rate = -1;
     int l;
-    struct fmtx *lms;
-    double *gamma;
-    double *sigma;
-    int *peaks;
-    int n_peaks;        // main output, number of peaks
     // helper ampd parameters
-    double peak_rate_min = 0.0;    // UNUSED 
-    double peak_rate_max = 0.0;    // UNUSED
+    double peak_rate_min = -1;     // plausible rate bounds for refinement
+    double peak_rate_max = -1;
     int lambda_max = 0;            // hard threshold lambda, ignore if 0
 
     // main output file base
@@ -196,7 +293,6 @@ int main(int argc, char **argv){
 
     // aux output paths
     char aux_dir[MAX_PATH_LEN] = {0};
-    char batch_dir[MAX_PATH_LEN] = {0};
     char aux_dir_def[] = "ampd.aux"; // full default is cwd plus this
     if(argc == 1){
         printf_help();
@@ -208,7 +304,7 @@ int main(int argc, char **argv){
     param = malloc(sizeof(struct ampd_param));
     bparam = malloc(sizeof(struct batch_param));
     pparam = malloc(sizeof(struct preproc_param)); // filtering params
-    memset(bparam, 0, sizeof(bparam));
+    memset(bparam, 0, sizeof(struct batch_param));
     memset(conf, 0, sizeof(struct ampd_config));
 
     //TODO
@@ -216,7 +312,6 @@ int main(int argc, char **argv){
 
     // data flipping
     n_bins = DEF_N_BINS;
-    bins = malloc(sizeof(int) * n_bins);
     autoflip = DEF_AUTOFLIP;
 
     // parse options
@@ -280,14 +375,76 @@ int main(int argc, char **argv){
                 autoflip = 1;
                 break;
             case ARG_RATE_MIN:
-                //peak_rate_min = atof(optarg);
+                peak_rate_min = atof(optarg);
                 break;
             case ARG_RATE_MAX:
-                //peak_rate_max = atof(optarg);
+                peak_rate_max = atof(optarg);
                 break;
             case ARG_LAMBDA_MAX:
                 lambda_max = atoi(optarg);
                 break;
+            case ARG_MAX_MEM:
+                max_mem_mb = atof(optarg);
+                break;
+            case ARG_THREADS:
+                threads = atoi(optarg);
+                break;
+            case ARG_TROUGHS:
+                output_troughs = 1;
+                break;
+            case ARG_LANES:
+                lanes = atoi(optarg);
+                break;
+            case ARG_INT16:
+                int16 = 1;
+                break;
+            case ARG_NO_INDEX:
+                output_index = 0;
+                break;
+            case ARG_STORE:
+                strcpy(store, optarg);
+                break;
+            case ARG_STUDY:
+                strncpy(study, optarg, RSTORE_ID_LEN);
+                break;
+            case ARG_OUTPUT_LOD:
+                output_lod = 1;
+                break;
+            case ARG_APPROX:
+                approx = 1;
+                break;
+            case ARG_APPROX_CHECK:
+                approx_check = atoi(optarg);
+                break;
+            case ARG_REFINE:
+                refine = 1;
+                break;
+            case ARG_ADAPTIVE:
+                adaptive = 1;
+                break;
+            case ARG_DETERMINISTIC:
+                deterministic = 1;
+                break;
+            case ARG_STREAM:
+                stream = 1;
+                break;
+            case ARG_SHM:
+                strncpy(shm_name, optarg, sizeof(shm_name) - 1);
+                stream = 1;
+                break;
+            case ARG_CHANNEL:
+                strncpy(channel, optarg, sizeof(channel) - 1);
+                break;
+            case ARG_CACHE:
+                cache = 1;
+                break;
+            case ARG_KERNEL:
+                kernel = plan_kernel_from_name(optarg);
+                if(kernel == -1){
+                    fprintf(stderr, "unknown kernel %s\n",optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
         }
     }
     /* Setting up output paths.
@@ -300,12 +457,52 @@ int main(int argc, char **argv){
      */
     begin = clock();
     getcwd(cwd, sizeof(cwd));
+    memset(&src, 0, sizeof(src));
+    // the ring is the input, sampling rate from the writer unless given
+    if(strcmp(shm_name,"")!=0){
+        if(shm_ring_attach(&shm, shm_name) != 0)
+            exit(EXIT_FAILURE);
+        src.shm = &shm;
+        src.channel = shm_ring_channel(&shm, channel);
+        if(src.channel < 0){
+            fprintf(stderr, "ampd: no channel %s in %s\n",channel,shm_name);
+            exit(EXIT_FAILURE);
+        }
+        if(sampling_rate == -1)
+            sampling_rate = shm.hdr->sampling_rate;
+        strcpy(infile, shm_name);
+    }
     if(strcmp(infile,"")==0){
         fprintf(stderr, "No input file specified.\n");
         //free_conf_malloc_onerr();
         exit(EXIT_FAILURE);
     }
-    extract_raw_filename(infile, infile_basename, sizeof(infile_basename));
+    if(strcmp(infile,"-")==0){
+        stream = 1;
+        strcpy(infile_basename, "stream");
+    }
+    else if(src.shm != NULL)
+        snprintf(infile_basename, sizeof(infile_basename), "%s_%.*s",
+                 shm_name + (shm_name[0] == '/'), SHM_LABEL_LEN,
+                 (shm.hdr->label[src.channel][0] != '\0') ?
+                 shm.hdr->label[src.channel] : channel);
+    else
+        extract_raw_filename(infile, infile_basename, sizeof(infile_basename));
+    if(stream == 1 && (adaptive == 1 || refine == 1 || output_troughs == 1 ||
+       int16 == 1 || output_all == 1 || output_lms == 1 || output_lod == 1 ||
+       strcmp(store,"")!=0)){
+        fprintf(stderr, "ampd: --stream is not available with --adaptive, "
+                "--refine, --troughs, --int16, --output-all, --output-lms, "
+                "--output-lod or --store\n");
+        exit(EXIT_FAILURE);
+    }
+    // peaks only, to stdout
+    if(stream == 1 && strcmp(outdir,"-")==0){
+        to_stdout = 1;
+        output_rate = 0;
+        output_meta = 0;
+        output_index = 0;
+    }
     if(strcmp(datatype,"")==0){
         strcpy(datatype,"def");
         //strcpy(conf->datatype,datatype);
@@ -327,37 +524,133 @@ int main(int argc, char **argv){
     }
     //TODO fix
     if(sampling_rate == -1)
-        sampling_rate = DEF_SAMPLING_RATE;
-    if(batch_length == -1)
-        batch_length = DEF_BATCH_LENGTH;
+        sampling_rate = param->sampling_rate;
+    if(batch_length == -1){
+        batch_length = (strcmp(datatype, "ecg")==0) ? ECG_BATCH_LENGTH :
+                       DEF_BATCH_LENGTH;
+    }
+    // ecg defaults to adaptive windows, unless it is not available
+    if(adaptive == -1){
+        adaptive = (strcmp(datatype, "ecg")==0 && output_troughs == 0 &&
+                    refine == 0 && output_lms == 0 && stream == 0 &&
+                    kernel != AMPD_KERNEL_DENSE &&
+                    kernel != AMPD_KERNEL_BITPACK &&
+                    kernel != AMPD_KERNEL_LANES) ? ECG_ADAPTIVE : DEF_ADAPTIVE;
+    }
 
     param->sampling_rate = sampling_rate;
-    param->peak_rate_min = peak_rate_min;
-    param->peak_rate_max = peak_rate_max;
+    if(peak_rate_min != -1)
+        param->peak_rate_min = peak_rate_min;
+    if(peak_rate_max != -1)
+        param->peak_rate_max = peak_rate_max;
     param->lambda_max = lambda_max;
+    // scale bounds, the longest plausible period in samples
+    if(param->rows_periods > 0 && param->peak_rate_min > 0){
+        j = (int)ceil(60.0 / param->peak_rate_min * param->sampling_rate);
+        if(param->lambda_max == 0)
+            param->lambda_max = j;
+        param->l_max = (int)ceil(param->rows_periods * j);
+    }
     // setting outptu files
     snprintf(outfile_peaks,sizeof(outfile_peaks),"%s/%s.peaks",outdir,infile_basename);
     snprintf(outfile_rate,sizeof(outfile_rate),"%s/%s.rate",outdir,infile_basename);
     snprintf(outfile_meta,sizeof(outfile_meta),"%s/%s.meta",outdir,infile_basename);
+    snprintf(outfile_troughs,sizeof(outfile_troughs),"%s/%s.troughs",
+             outdir,infile_basename);
+    snprintf(outfile_index,sizeof(outfile_index),"%s/%s.pkx",
+             outdir,infile_basename);
+    snprintf(outfile_lod,sizeof(outfile_lod),"%s/%s.lod",
+             outdir,infile_basename);
     // setting available param
     // set available config
     // setting remaining variables for processing
     sum_n_peaks = 0;
-    datalen = count_char(infile, '\n');
-    data_buf = (int)(batch_length * param->sampling_rate);
-    cycles = (int) (ceil(datalen / (double) (data_buf)));
+    sum_n_troughs = 0;
+    sum_window_length = 0;
+    pks_init(&ipi);
+    // the stream length is not known, plan for a single batch
+    if(stream == 1)
+        datalen = (int)(batch_length * param->sampling_rate);
+    else if(cache == 1 && int16 == 0 && txc_open(infile, &txc) == 0){
+        cached = txc_column(&txc, 0);
+        datalen = (int)txc.hdr->rows;
+    }
+    else
+        datalen = txc_count_rows(infile);
+    if(datalen < 0){
+        fprintf(stderr, "cannot open file %s\n",infile);
+        exit(EXIT_FAILURE);
+    }
+    if(int16 == 1){
+        full_q = malloc(sizeof(int16_t) * datalen);
+        q_scale = load_from_file_i16(infile, full_q, datalen);
+        if(q_scale < 0){
+            fprintf(stderr, "ampd: %s is not int16 fixed point data, "
+                    "reading floats\n",infile);
+            free(full_q);
+            full_q = NULL;
+        }
+    }
+
+    if(adaptive == 1 && (output_troughs == 1 || refine == 1)){
+        fprintf(stderr, "ampd: --adaptive is not available with --troughs "
+                "or --refine\n");
+        exit(EXIT_FAILURE);
+    }
+    /* plan kernel, batch length and threads within the memory budget */
+    memset(&plan, 0, sizeof(plan));
+    plan.max_mem = max_mem_mb * 1e6;
+    plan.threads_req = threads;
+    plan.force_dense = output_lms;
+    plan.dual = output_troughs;
+    plan.kernel_req = kernel;
+    plan.lanes = lanes;
+    plan.int16 = int16;
+    plan.int16_input = (full_q != NULL);
+    plan.approx = approx;
+    plan.adaptive = adaptive;
+    plan.datalen = datalen;
+    plan.sampling_rate = param->sampling_rate;
+    plan.batch_length_req = batch_length;
+    if(make_plan(&plan) != 0)
+        exit(EXIT_FAILURE);
+    if(plan.batch_length != batch_length)
+        fprintf(stderr, "ampd: batch length adjusted to %lf s\n",
+                plan.batch_length);
+    batch_length = plan.batch_length;
+    param->kernel = plan.kernel;
+    // precompute LMS row sums once, all batches have the same length,
+    // adaptive windows use the worker caches instead
+    param->deterministic = deterministic;
+    param->rowsum = lms_rowsum(plan.n, param);
+    param->rowsum_n = plan.n;
+    data_buf = plan.n;
+    cycles = plan.cycles;
 
     /* fill batch param */
     bparam->cycles = cycles;
     bparam->batch_length = batch_length;
     bparam->sampling_rate = sampling_rate;
 
-    // preload data and apply filters
-    full_data = malloc(sizeof(float) * datalen);
-    load_from_file(infile, full_data, datalen);
+    // preload data, unless the pipeline reads it batch by batch while
+    // batches are computed, the level of detail needs all of it
+    pipeline = (full_q == NULL && adaptive == 0 && refine == 0 &&
+                stream == 0 && cached == NULL && output_lod == 0);
+    full_data = NULL;
+    // mapped read only, nothing writes the full data
+    if(cached != NULL)
+        full_data = cached;
+    else if(stream == 1)
+        full_data = malloc(sizeof(float) * 2 * plan.n);
+    else if(full_q == NULL && pipeline == 0){
+        full_data = malloc(sizeof(float) * datalen);
+        load_from_file(infile, full_data, datalen);
+    }
     // make path
     // opening main output files
-    if(output_peaks == 1){
+    if(output_peaks == 1 && to_stdout == 1)
+        fp_out = stdout;
+    else if(output_peaks == 1){
         mkpath(outfile_peaks, 0777);
         fp_out = fopen(outfile_peaks, "w+");
         if(fp_out == NULL){
@@ -376,7 +669,24 @@ int main(int argc, char **argv){
         fprintf(fp_out_rate,"# sampling_rate=%lf\n",param->sampling_rate);
 
     }
-    if(verbose > 0){
+    if(output_troughs == 1){
+        mkpath(outfile_troughs, 0777);
+        fp_out_troughs = fopen(outfile_troughs, "w+");
+        if(fp_out_troughs == NULL){
+            fprintf(stderr, "cannot open file for writing %s\n",
+                    outfile_troughs);
+            exit(EXIT_FAILURE);
+        }
+        if(autoflip == 1 && verbose > 0)
+            printf("troughs are detected, autoflip is ignored\n");
+    }
+    if(output_index == 1){
+        mkpath(outfile_index, 0777);
+        // the length of a stream is known at the end
+        pkx = pkx_open(outfile_index, param->sampling_rate,
+                       (stream == 1) ? 0 : datalen);
+    }
+    if(verbose > 0 && to_stdout == 0){
         printf("ampd input\n-----------------\n");
         printf("verbose: %d\n",verbose);
         printf("infile: %s\n", infile);
@@ -394,166 +704,1385 @@ int main(int argc, char **argv){
         printf("cycles: %d\n", cycles);
         printf("output-lms: %d\n",output_lms);
         printf("output-rate: %d\n",output_rate);
+        fprintf_plan(stdout, &plan);
 
     }
 
-    // malloc
     n = (int)data_buf;
-    l = (int)ceil(n/2)-1;
+    l = lms_rows(n, param);
     bparam->n = n;
     bparam->l = l;
-    lms = malloc_fmtx(l, n);
-    data = malloc(sizeof(float)*n);
-    gamma = malloc(sizeof(double)*l);
-    sigma = malloc(sizeof(double)*n);
-    peaks = malloc(sizeof(int)*n);
 
     /*
      * Processing
-     *
+     * Batches are independent, they are shared between worker threads, then
+     * the results are written in order. In the pipeline, the input is parsed
+     * on a reader thread into a few batch buffers, and each result is written
+     * as soon as it and the ones before it are computed.
      */
-    for( i=0; i<cycles; i++){
-        if(TESTING == 1){
-            if(i>0)
-                break;
-        }
-
-        // settings aux output paths
-        snprintf(batch_dir, sizeof(batch_dir),"%s/batch_%d",aux_dir,i);
-        snprintf(detrend_path,sizeof(detrend_path),"%s/detrend.dat",batch_dir);
-        snprintf(raw_path,sizeof(raw_path),"%s/raw.dat",batch_dir);
-        snprintf(lms_path,sizeof(lms_path),"%s/lms.dat",batch_dir);
-        snprintf(rlms_path,sizeof(lms_path),"%s/rlms.dat",batch_dir);
-        snprintf(gamma_path, sizeof(gamma_path),"%s/gamma.dat",batch_dir);
-        snprintf(sigma_path, sizeof(sigma_path),"%s/sigma.dat",batch_dir);
-        snprintf(peaks_path, sizeof(peaks_path),"%s/peaks.dat",batch_dir);
-        snprintf(preproc_path, sizeof(preproc_path),"%s/smoothed.dat",batch_dir);
-        snprintf(param_path, sizeof(param_path),"%s/param.txt",batch_dir);
-        snprintf(batch_param_path, sizeof(batch_param_path),"%s/bparam.txt",batch_dir);
-
-        ind = i * data_buf;
-        bparam->ind = ind;
-
-        if(verbose > 1){
-            printf("\nfetchig data:\n");
-            printf("infile=%s\n",infile);
-            printf("data=%p\n",data);
-            printf("n=%d, ind=%d\n",n,ind);
-        }
-        // load data batch
-        fetch_data_buff(full_data, datalen, data, n, ind, n_zpad);
-        if(output_all == 1)
-            save_data(data, n, raw_path,"float"); // save raw data
-
-        // check if flipping is needed
-        if(autoflip == 1){
-            histogram(data, n, bins, n_bins);
-            cmass = centre_of_mass(bins, n_bins);
-            if(cmass > (double)n_bins / 2)
-                flip_data(data, n);
-        }
-        // preproc
-        linear_fit(data, n, param);
-        linear_detrend(data, n, param);
-        if(output_all == 1)
-            save_data(data, n, preproc_path,"float"); // save detrend data
-        if(pparam->preproc == 1){
-            if(pparam->hpfilt > 0){
-                tdhpfilt(data, n, param->sampling_rate, pparam->hpfilt);
-            }
-            if(pparam->lpfilt > 0){
-                tdlpfilt(data, n, param->sampling_rate, pparam->lpfilt);
-            }
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.full_data = full_data;
+    ctx.full_q = full_q;
+    ctx.q_scale = q_scale;
+    ctx.datalen = datalen;
+    ctx.n = n;
+    ctx.cycles = (TESTING == 1) ? 1 : cycles;
+    ctx.threads = plan.threads;
+    ctx.lanes = (plan.kernel == AMPD_KERNEL_LANES) ? plan.lanes : 1;
+    ctx.scalar_kernel = plan.scalar_kernel;
+    ctx.autoflip = autoflip;
+    ctx.troughs = output_troughs;
+    ctx.approx_check = (plan.kernel == AMPD_KERNEL_APPROX) ? approx_check : 0;
+    ctx.n_bins = n_bins;
+    ctx.aux_dir = aux_dir;
+    ctx.param = param;
+    ctx.bparam = bparam;
+    ctx.pparam = pparam;
+    ctx.adaptive = adaptive;
+    ctx.deterministic = deterministic;
+    ctx.pipeline = pipeline;
+    ctx.infile = infile;
+    if(adaptive == 1){
+        ctx.min_n = (int)(ADAPTIVE_MIN_LENGTH * param->sampling_rate);
+        if(ctx.min_n > n / 2)
+            ctx.min_n = n / 2;
+        if(ctx.min_n < 8)
+            ctx.min_n = 8;
+        j = init_segments(&ctx);
+        if(j < 0){
+            fprintf(stderr, "ampd: cannot allocate segments\n");
+            exit(EXIT_FAILURE);
+        }
+        ctx.res = calloc(j, sizeof(struct batch_result));
+        grid_peaks = calloc(cycles, sizeof(int));
+    }
+    else
+        ctx.res = calloc(ctx.cycles, sizeof(struct batch_result));
+    if(stream == 1){
+        ctx.datalen = 2 * n;
+        if(src.shm == NULL)
+            src.fp = (strcmp(infile,"-")==0) ? stdin : fopen(infile, "r");
+        if(src.shm == NULL && src.fp == NULL){
+            fprintf(stderr, "cannot open file %s\n",infile);
+            exit(EXIT_FAILURE);
+        }
+        datalen = stream_batches(&ctx, &src, (output_peaks == 1) ? fp_out :
+                                 NULL, (output_rate == 1) ? fp_out_rate : NULL,
+                                 (output_index == 1) ? pkx : NULL, &ipi,
+                                 &cycles, &sum_n_peaks);
+        if(datalen < 0){
+            fprintf(stderr, "ampd: stream processing failed\n");
+            exit(EXIT_FAILURE);
+        }
+        if(src.fp != NULL && src.fp != stdin)
+            fclose(src.fp);
+        if(src.shm != NULL && shm.lost > 0)
+            fprintf(stderr, "ampd: %llu samples were overwritten in %s before "
+                    "they were read\n",(unsigned long long)shm.lost,shm_name);
+        if(src.shm != NULL)
+            shm_ring_free(&shm);
+        // written already
+        ctx.cycles = 0;
+    }
+    else if((pipeline == 1 && start_pipeline(&ctx) != 0) ||
+       (pipeline == 0 && run_batches(&ctx) != 0)){
+        fprintf(stderr, "ampd: batch processing failed\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(&rstat, 0, sizeof(rstat));
+    if(refine == 1 && output_troughs == 1){
+        fprintf(stderr, "ampd: --refine is not available with --troughs\n");
+    }
+    else if(refine == 1){
+        rstat.refine = 1;
+        if(refine_batches(&ctx, &rstat) != 0){
+            fprintf(stderr, "ampd: batch refinement failed\n");
+            exit(EXIT_FAILURE);
+        }
+        if(verbose > 0)
+            printf("refine: flagged=%d, recomputed=%d, improved=%d\n",
+                   rstat.refine_flagged, rstat.refine_recomputed,
+                   rstat.refine_improved);
+    }
+    if(strcmp(store,"")!=0){
+        srec = calloc(ctx.cycles, sizeof(struct rstore_rec));
+        if(strcmp(study,"")==0)
+            extract_study_id(infile, outdir, study, sizeof(study));
+        run_stamp = rstore_run_stamp();
+    }
+    for( i=0; i<ctx.cycles; i++){
+        if(pipeline == 1 && wait_batch(&ctx, i) != 0){
+            finish_pipeline(&ctx);
+            if(ctx.read_len < 0)
+                fprintf(stderr, "cannot open file %s\n",infile);
+            else
+                fprintf(stderr, "ampd: %s ended after %d samples\n",infile,
+                        ctx.read_len);
+            exit(EXIT_FAILURE);
+        }
+        res = &ctx.res[i];
+        sum_n_peaks += res->n_peaks;
+        if(strcmp(store,"")!=0){
+            strncpy(srec[i].study, study, RSTORE_ID_LEN);
+            strncpy(srec[i].channel, datatype, RSTORE_CH_LEN);
+            srec[i].run = run_stamp;
+            srec[i].batch = i;
+            srec[i].start = res->ind;
+            srec[i].batch_length = res->n / param->sampling_rate;
+            srec[i].sampling_rate = param->sampling_rate;
+            srec[i].rate = res->peaks_per_min;
+            srec[i].lambda = res->lambda;
+            srec[i].mean_pk_dist = res->mean_pk_dist;
+            srec[i].stdev_pk_dist = res->stdev_pk_dist;
+            srec[i].n_peaks = res->n_peaks;
         }
-
-        // main ampd routine, contains malloc
-        n_peaks = ampdcpu(data, n, param, lms, gamma, sigma, peaks);
-
-        //catch_false_pks(peaks, &n_peaks, ts, thresh);
-        sum_n_peaks += (int)(n_peaks );
         if(verbose > 0){
             printf("batch=%d/%d, n=%d, sum=%d, "
-                    "mean_dst=%.3lf s, stdev_dst=%.3lf s\n",
-                    i,cycles, n_peaks,sum_n_peaks,
-                    param->mean_pk_dist, param->stdev_pk_dist);
+                    "mean_dst=%.3lf s, stdev_dst=%.3lf s, length=%.1lf s\n",
+                    i,ctx.cycles, res->n_peaks,sum_n_peaks,
+                    res->mean_pk_dist, res->stdev_pk_dist,
+                    res->n / param->sampling_rate);
         }
-        // calc peak rate
-        bparam->n_peaks = n_peaks;
-        peaks_per_min = (double)n_peaks / batch_length * 60.0;
-        bparam->peaks_per_min = peaks_per_min; 
-
-        //concat_peaks(sum_peaks, peaks, ind);
-        //TODO
-        // save aux
-        //
-
-        if(output_rate == 1){
-            fprintf(fp_out_rate,"%d\n",(int)peaks_per_min);
+        sum_window_length += res->n / param->sampling_rate;
+        // windows are merged in order, so the moments do not depend on
+        // which worker computed them
+        if(res->n_peaks > 0 && last_peak >= 0)
+            pks_add(&ipi, (double)(res->peaks[0] + res->ind - last_peak) /
+                    param->sampling_rate);
+        if(res->n_peaks > 0)
+            last_peak = res->peaks[res->n_peaks-1] + res->ind;
+        if(res->ipi != NULL)
+            pks_merge(&ipi, res->ipi);
+        free(res->ipi);
+        res->ipi = NULL;
+        if(output_rate == 1 && adaptive == 0){
+            fprintf(fp_out_rate,"%d\n",(int)res->peaks_per_min);
+        }
+        // adaptive windows are counted on the fixed batch grid instead
+        for(j=0; j<res->n_peaks && adaptive == 1; j++){
+            rate_cell = (res->peaks[j] + res->ind) / n;
+            if(rate_cell < cycles)
+                grid_peaks[rate_cell]++;
         }
         if(output_peaks == 1){
-            //save_peaks(peaks_path);
-            for(int j=0;j<n_peaks;j++){
-                fprintf(fp_out,"%d\n",peaks[j]+ind);
+            for(j=0;j<res->n_peaks;j++){
+                fprintf(fp_out,"%d\n",res->peaks[j]+res->ind);
+            }
+        }
+        if(output_index == 1){
+            for(j=0;j<res->n_peaks;j++){
+                if(pkx_add(pkx, res->peaks[j]+res->ind) != 0){
+                    fprintf(stderr, "ampd: cannot build peak index\n");
+                    exit(EXIT_FAILURE);
+                }
             }
         }
-        if(output_all == 1){
-            //save_data(data, n, raw_path); // save raw data
-            save_data(data, n, detrend_path,"float"); // save detrended data
-            save_data(sigma, n, sigma_path, "double");
-            save_data(gamma, l, gamma_path, "double");
-            save_data(peaks, n_peaks, peaks_path, "int"); // save peak indices
-            save_ampd_param(param, param_path);
-            save_batch_param(bparam, batch_param_path);
+        if(output_troughs == 1){
+            sum_n_troughs += res->n_troughs;
+            for(j=0;j<res->n_troughs;j++){
+                fprintf(fp_out_troughs,"%d\n",res->troughs[j]+res->ind);
+            }
+            free(res->troughs);
         }
-        if(output_lms == 1){
-            save_fmtx(lms, lms_path);
+        free(res->peaks);
+    }
+    if(output_rate == 1 && adaptive == 1){
+        for(i=0; i<cycles; i++){
+            // last cell may be shorter
+            rate_len = ((i+1) * n > datalen) ? datalen - i * n : n;
+            rate_len /= param->sampling_rate;
+            fprintf(fp_out_rate,"%d\n",(int)(grid_peaks[i] / rate_len * 60.0));
         }
     }
-    if(output_peaks == 1)
+    if(ctx.pipeline == 1)
+        finish_pipeline(&ctx);
+    // all data is in memory by now
+    if(output_lod == 1){
+        mkpath(outfile_lod, 0777);
+        if(save_lod(outfile_lod, full_data, full_q, q_scale, datalen,
+                    param->sampling_rate) != 0)
+            fprintf(stderr, "ampd: cannot write %s\n",outfile_lod);
+    }
+    if(output_peaks == 1 && to_stdout == 0)
         fclose(fp_out);
     if(output_rate == 1)
         fclose(fp_out_rate);
+    if(output_troughs == 1)
+        fclose(fp_out_troughs);
+    if(output_index == 1)
+        pkx->hdr.datalen = (uint32_t)datalen;
+    if(output_index == 1 && pkx_close(pkx) != 0)
+        fprintf(stderr, "ampd: cannot write %s\n",outfile_index);
+    if(strcmp(store,"")!=0){
+        if(rstore_append(store, srec, ctx.cycles) != 0)
+            fprintf(stderr, "ampd: cannot append to store %s\n",store);
+        free(srec);
+    }
     // save some metadata to file
     if(output_meta == 1){
         mparam = malloc(sizeof(struct meta_param));
-        memset(mparam, 0, sizeof(mparam));
+        memset(mparam, 0, sizeof(struct meta_param));
         strcpy(mparam->infile, infile);
         strcpy(mparam->basename, infile_basename);
         strcpy(mparam->datatype, datatype);
         mparam->sampling_rate = bparam->sampling_rate;
         mparam->batch_length = bparam->batch_length;
         mparam->total_peaks = sum_n_peaks;
+        mparam->total_troughs = (output_troughs == 1) ? sum_n_troughs : -1;
         mparam->total_batches = cycles;
-        save_meta(mparam, pparam,  outfile_meta);
+        mparam->refine = rstat.refine;
+        mparam->refine_flagged = rstat.refine_flagged;
+        mparam->refine_recomputed = rstat.refine_recomputed;
+        mparam->refine_improved = rstat.refine_improved;
+        mparam->adaptive = adaptive;
+        mparam->deterministic = deterministic;
+        mparam->ipi = &ipi;
+        mparam->res = ctx.res;
+        mparam->n_res = ctx.cycles;
+        if(ctx.cycles > 0)
+            mparam->mean_window_length = sum_window_length / ctx.cycles;
+        if(adaptive == 1)
+            mparam->total_batches = ctx.cycles;
+        mparam->approx = (plan.kernel == AMPD_KERNEL_APPROX);
+        for(i=0; i<ctx.cycles && mparam->approx == 1; i++){
+            res = &ctx.res[i];
+            mparam->approx_lambda_err += res->lambda_err / (double)ctx.cycles;
+            if(res->exact_n_peaks < 0)
+                continue;
+            mparam->approx_checked++;
+            mparam->approx_exact_peaks += res->exact_n_peaks;
+            mparam->approx_peak_delta += res->exact_n_peaks - res->n_peaks;
+            j = abs(res->exact_lambda - res->lambda);
+            if(j > mparam->approx_lambda_delta_max)
+                mparam->approx_lambda_delta_max = j;
+        }
+        save_meta(mparam, pparam, &plan, outfile_meta);
         free(mparam);
     }
-    // free ampd data arrays
-    free(data);
-    free(sigma);
-    free(gamma);
-    free(peaks);
-    for(j=0; j<l; j++)
-        free(lms->data[j]);
-    free(lms->data);
-    free(lms);
 
     // free parameters and stuff
+    free(ctx.res);
+    free(ctx.seg_start);
+    free(ctx.seg_base);
+    free(ctx.seg_count);
+    free(grid_peaks);
+    free(param->rowsum);
     free(param);
     free(bparam);
     free(pparam);
     free(conf);
-    free(full_data);
+    if(cached != NULL)
+        txc_close(&txc);
+    else
+        free(full_data);
+    free(full_q);
 
-    free(bins);
     // finalize
     end = clock();
     time_spent = (double)(end - begin) / CLOCKS_PER_SEC; 
-    if(verbose > 0)
+    if(verbose > 0 && to_stdout == 0)
         printf("runtime = %lf sec\n",time_spent);
-    fprintf(stdout, "%d\n",sum_n_peaks);
+    if(to_stdout == 0)
+        fprintf(stdout, "%d\n",sum_n_peaks);
     return sum_n_peaks;
 }
 
+/**
+ * Allocate the workspace of a worker thread, according to the LMS kernel.
+ * Return 0 on success, -1 on malloc failure.
+ */
+int init_worker(struct ampd_worker *w, struct batch_ctx *ctx, int id){
+
+    int i;
+    int n = ctx->n;
+    int l = (int)ceil(n/2)-1;
+    memset(w, 0, sizeof(struct ampd_worker));
+    w->id = id;
+    w->ctx = ctx;
+    memcpy(&w->param, ctx->param, sizeof(struct ampd_param));
+    w->param.kernel = ctx->scalar_kernel;
+    memcpy(&w->bparam, ctx->bparam, sizeof(struct batch_param));
+    w->data = malloc(sizeof(float)*n);
+    w->gamma = malloc(sizeof(double)*l);
+    w->sigma = malloc(sizeof(double)*n);
+    w->peaks = malloc(sizeof(int)*n);
+    w->bins = malloc(sizeof(int)*ctx->n_bins);
+    if(w->param.kernel == AMPD_KERNEL_DENSE)
+        w->lms = malloc_fmtx(l, n);
+    else if(w->param.kernel == AMPD_KERNEL_BITPACK)
+        w->blms = malloc_bmtx(l, n);
+    else if(w->param.kernel == AMPD_KERNEL_I16){
+        w->qdata = malloc(sizeof(int16_t) * n);
+        if(w->qdata == NULL){
+            fprintf(stderr, "init_worker: cannot allocate workspace\n");
+            return -1;
+        }
+    }
+    w->lanes = ctx->lanes;
+    if(w->lanes > 1){
+        w->ldata = malloc(sizeof(float) * n * w->lanes);
+        w->data_il = malloc(sizeof(float) * n * w->lanes);
+        w->lparam = malloc(sizeof(struct ampd_param) * w->lanes);
+        w->lgamma = malloc(sizeof(double) * l * w->lanes);
+        w->lsigma = malloc(sizeof(double) * n * w->lanes);
+        w->lpks = malloc(sizeof(int *) * w->lanes);
+        w->ln_pks = malloc(sizeof(int) * w->lanes);
+        if(w->ldata == NULL || w->data_il == NULL || w->lparam == NULL ||
+           w->lgamma == NULL || w->lsigma == NULL || w->lpks == NULL ||
+           w->ln_pks == NULL){
+            fprintf(stderr, "init_worker: cannot allocate workspace\n");
+            return -1;
+        }
+        for(i=0; i<w->lanes; i++){
+            w->lpks[i] = malloc(sizeof(int) * n);
+            if(w->lpks[i] == NULL){
+                fprintf(stderr, "init_worker: cannot allocate workspace\n");
+                return -1;
+            }
+        }
+    }
+    if(ctx->troughs == 1){
+        memcpy(&w->tparam, ctx->param, sizeof(struct ampd_param));
+        w->tgamma = malloc(sizeof(double)*l);
+        w->tsigma = malloc(sizeof(double)*n);
+        w->troughs = malloc(sizeof(int)*n);
+        if(w->param.kernel == AMPD_KERNEL_BITPACK)
+            w->tblms = malloc_bmtx(l, n);
+        if(w->tgamma == NULL || w->tsigma == NULL || w->troughs == NULL ||
+           (w->param.kernel == AMPD_KERNEL_BITPACK && w->tblms == NULL)){
+            fprintf(stderr, "init_worker: cannot allocate workspace\n");
+            return -1;
+        }
+    }
+    if(w->data == NULL || w->gamma == NULL || w->sigma == NULL ||
+       w->peaks == NULL || w->bins == NULL ||
+       (w->param.kernel == AMPD_KERNEL_DENSE && w->lms == NULL) ||
+       (w->param.kernel == AMPD_KERNEL_BITPACK && w->blms == NULL)){
+        fprintf(stderr, "init_worker: cannot allocate workspace\n");
+        return -1;
+    }
+    return 0;
+}
+
+void free_worker(struct ampd_worker *w){
+
+    int i;
+    free(w->data);
+    free(w->gamma);
+    free(w->sigma);
+    free(w->peaks);
+    free(w->bins);
+    free_fmtx(w->lms);
+    free_bmtx(w->blms);
+    free(w->qdata);
+    for(i=0; i<ADAPTIVE_ROWSUMS; i++)
+        free(w->rowsum[i]);
+    free(w->tgamma);
+    free(w->tsigma);
+    free(w->troughs);
+    free_bmtx(w->tblms);
+    if(w->lpks != NULL){
+        for(i=0; i<w->lanes; i++)
+            free(w->lpks[i]);
+    }
+    free(w->lpks);
+    free(w->ln_pks);
+    free(w->ldata);
+    free(w->data_il);
+    free(w->lparam);
+    free(w->lgamma);
+    free(w->lsigma);
+}
+
+/**
+ * Prepare batch i for the ampd kernels: fetch, flip, detrend, filter. The
+ * linear fit is saved into param. Raw and detrended data are saved to the aux
+ * dir if needed.
+ */
+void prep_batch(struct ampd_worker *w, int i, float *data,
+                struct ampd_param *param){
+
+    prep_window(w, i, i * w->ctx->n, w->ctx->n, data, param);
+}
+
+/**
+ * Same as prep_batch for a window of n samples from ind, aux files are saved
+ * as batch i.
+ */
+void prep_window(struct ampd_worker *w, int i, int ind, int n, float *data,
+                 struct ampd_param *param){
+
+    struct batch_ctx *ctx = w->ctx;
+    struct preproc_param *pparam = ctx->pparam;
+    double cmass;
+    char path[MAX_PATH_LEN];
+
+    if(verbose > 1){
+        printf("\nfetchig data:\n");
+        printf("data=%p\n",data);
+        printf("n=%d, ind=%d\n",n,ind);
+    }
+    // load data batch
+    if(ctx->full_q != NULL)
+        fetch_data_buff_i16(ctx->full_q, ctx->datalen, ctx->q_scale, data, n,
+                            ind);
+    else if(ctx->pool != NULL)
+        memcpy(data, pipe_data(ctx, i), sizeof(float) * n);
+    else
+        fetch_data_buff(ctx->full_data, ctx->datalen, data, n, ind, DEF_N_ZPAD);
+    if(output_all == 1){
+        snprintf(path,sizeof(path),"%s/batch_%d/raw.dat",ctx->aux_dir,i);
+        save_data(data, n, path,"float"); // save raw data
+    }
+
+    // check if flipping is needed, not if troughs are detected anyway
+    if(ctx->autoflip == 1 && ctx->troughs == 0){
+        memset(w->bins, 0, sizeof(int) * ctx->n_bins);
+        histogram(data, n, w->bins, ctx->n_bins);
+        cmass = centre_of_mass(w->bins, ctx->n_bins);
+        if(cmass > (double)ctx->n_bins / 2)
+            flip_data(data, n);
+    }
+    // preproc
+    linear_fit(data, n, param);
+    linear_detrend(data, n, param);
+    if(output_all == 1){
+        snprintf(path,sizeof(path),"%s/batch_%d/smoothed.dat",ctx->aux_dir,i);
+        save_data(data, n, path,"float"); // save detrend data
+    }
+    if(pparam->preproc == 1){
+        if(pparam->hpfilt > 0){
+            tdhpfilt(data, n, param->sampling_rate, pparam->hpfilt);
+        }
+        if(pparam->lpfilt > 0){
+            tdlpfilt(data, n, param->sampling_rate, pparam->lpfilt);
+        }
+    }
+}
+
+/**
+ * Copy the kernel output of batch i into its batch result, save aux files
+ * if needed. Troughs are taken from the worker.
+ */
+void store_batch(struct ampd_worker *w, int i, float *data,
+                 struct ampd_param *param, double *gamma, double *sigma,
+                 int *peaks, int n_peaks, int n_troughs){
+
+    struct batch_ctx *ctx = w->ctx;
+    int len;
+    int ind = batch_overlap(ctx, i, peaks, &n_peaks, &len);
+    if(ctx->troughs == 1)
+        batch_overlap(ctx, i, w->troughs, &n_troughs, &len);
+    store_window(w, i, ind, ctx->n, data, param, gamma, sigma, peaks, n_peaks,
+                 n_troughs);
+    // rate of the samples after the batch before
+    if(len < ctx->n){
+        w->bparam.peaks_per_min = n_peaks / (len / param->sampling_rate) * 60.0;
+        ctx->res[i].peaks_per_min = w->bparam.peaks_per_min;
+    }
+}
+
+/**
+ * The last batch is fetched from datalen - n if the data ends before it is
+ * full (see fetch_data_buff), so it overlaps the batch before. Return the
+ * start of the window of batch i, drop the indices in pks that belong to the
+ * batch before and set *count to the ones kept, shifted to the window start.
+ * The samples of batch i itself are set in *len.
+ */
+int batch_overlap(struct batch_ctx *ctx, int i, int *pks, int *count, int *len){
+
+    int j, k, ind, skip;
+    ind = i * ctx->n;
+    *len = ctx->n;
+    if(ind + ctx->n <= ctx->datalen || ctx->datalen < ctx->n)
+        return ind;
+    *len = ctx->datalen - ind;
+    skip = ctx->n - *len;
+    for(j=0, k=0; j<*count; j++){
+        if(pks[j] >= skip)
+            pks[k++] = pks[j];
+    }
+    *count = k;
+    return ctx->datalen - ctx->n;
+}
+
+/**
+ * Peak distance sketch and quantiles of the window in res, from its peaks.
+ * The sketch is left for the writer to merge, it stays NULL if out of memory.
+ */
+void window_pk_stats(struct batch_result *res, double fs){
+
+    if(res->ipi == NULL)
+        res->ipi = malloc(sizeof(struct pk_stats));
+    if(res->ipi == NULL)
+        return;
+    pks_init(res->ipi);
+    pks_add_peaks(res->ipi, res->peaks, res->n_peaks, fs);
+    pks_summary(res->ipi, res->pk_dist_q);
+}
+
+/**
+ * Same as store_batch for a window of n samples from ind, into result i.
+ */
+void store_window(struct ampd_worker *w, int i, int ind, int n, float *data,
+                  struct ampd_param *param, double *gamma, double *sigma,
+                  int *peaks, int n_peaks, int n_troughs){
+
+    struct batch_ctx *ctx = w->ctx;
+    struct batch_param *bparam = &w->bparam;
+    struct batch_result *res = &ctx->res[i];
+    int l = lms_rows(n, param);
+    double length;      // seconds
+    char batch_dir[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+
+    // calc peak rate
+    length = (n == ctx->n) ? bparam->batch_length : n / param->sampling_rate;
+    bparam->ind = ind;
+    bparam->n = n;
+    bparam->l = l;
+    bparam->n_peaks = n_peaks;
+    bparam->peaks_per_min = (double)n_peaks / length * 60.0;
+
+    res->ind = ind;
+    res->n = n;
+    res->n_peaks = n_peaks;
+    res->peaks_per_min = bparam->peaks_per_min;
+    res->lambda = param->lambda;
+    res->mean_pk_dist = param->mean_pk_dist;
+    res->stdev_pk_dist = param->stdev_pk_dist;
+    res->lambda_err = param->lambda_err;
+    res->exact_n_peaks = -1;
+    res->refined = 0;
+    res->peaks = malloc(sizeof(int) * (n_peaks > 0 ? n_peaks : 1));
+    memcpy(res->peaks, peaks, sizeof(int) * n_peaks);
+    window_pk_stats(res, param->sampling_rate);
+    if(ctx->troughs == 1){
+        res->n_troughs = n_troughs;
+        res->trough_lambda = w->tparam.lambda;
+        res->troughs = malloc(sizeof(int) * (n_troughs > 0 ? n_troughs : 1));
+        memcpy(res->troughs, w->troughs, sizeof(int) * n_troughs);
+    }
+
+    snprintf(batch_dir, sizeof(batch_dir),"%s/batch_%d",ctx->aux_dir,i);
+    if(output_all == 1){
+        snprintf(path,sizeof(path),"%s/detrend.dat",batch_dir);
+        save_data(data, n, path,"float"); // save detrended data
+        snprintf(path,sizeof(path),"%s/sigma.dat",batch_dir);
+        save_data(sigma, n, path, "double");
+        snprintf(path,sizeof(path),"%s/gamma.dat",batch_dir);
+        save_data(gamma, l, path, "double");
+        snprintf(path,sizeof(path),"%s/peaks.dat",batch_dir);
+        save_data(peaks, n_peaks, path, "int"); // save peak indices
+        snprintf(path,sizeof(path),"%s/param.txt",batch_dir);
+        save_ampd_param(param, path);
+        snprintf(path,sizeof(path),"%s/bparam.txt",batch_dir);
+        save_batch_param(bparam, path);
+        if(ctx->troughs == 1){
+            snprintf(path,sizeof(path),"%s/tsigma.dat",batch_dir);
+            save_data(w->tsigma, n, path, "double");
+            snprintf(path,sizeof(path),"%s/tgamma.dat",batch_dir);
+            save_data(w->tgamma, l, path, "double");
+            snprintf(path,sizeof(path),"%s/troughs.dat",batch_dir);
+            save_data(w->troughs, n_troughs, path, "int");
+        }
+    }
+    if(output_lms == 1){
+        snprintf(path,sizeof(path),"%s/lms.dat",batch_dir);
+        save_fmtx(w->lms, path);
+    }
+}
+
+/**
+ * Process a single batch with the single window kernel chosen by the
+ * planner.
+ */
+void process_batch(struct ampd_worker *w, int i){
+
+    struct batch_ctx *ctx = w->ctx;
+    struct ampd_param *param = &w->param;
+    float *data = w->data;
+    int n = ctx->n;
+    int n_peaks, off;
+    int n_troughs = 0;
+    struct bmtx *dlms[2] = {w->blms, w->tblms};
+    double *dgamma[2] = {w->gamma, w->tgamma};
+    double *dsigma[2] = {w->sigma, w->tsigma};
+    int *dpks[2] = {w->peaks, w->troughs};
+
+    prep_batch(w, i, data, param);
+    // main ampd routine
+    if(ctx->troughs == 1){
+        memcpy(&w->tparam, param, sizeof(struct ampd_param));
+        n_peaks = ampdcpu_dual(data, n, param, &w->tparam, dlms, dgamma,
+                               dsigma, dpks, &n_troughs);
+    }
+    else
+        n_peaks = run_kernel(w, data, n, param);
+    store_batch(w, i, data, param, w->gamma, w->sigma, w->peaks, n_peaks,
+                n_troughs);
+    // the last batch may overlap the one before
+    off = i * n - ctx->res[i].ind;
+    check_approx(w, i, data, n, param, off, n - off);
+}
+
+/**
+ * Run the single polarity kernel of param on data, into the worker buffers.
+ * Return the number of peaks.
+ */
+int run_kernel(struct ampd_worker *w, float *data, int n,
+               struct ampd_param *param){
+
+    int n_peaks;
+    if(param->kernel == AMPD_KERNEL_BITPACK)
+        n_peaks = ampdcpu_bp(data, n, param, w->blms, w->gamma, w->sigma,
+                             w->peaks);
+    else if(param->kernel == AMPD_KERNEL_DENSE)
+        n_peaks = ampdcpu(data, n, param, w->lms, w->gamma, w->sigma,
+                          w->peaks);
+    else if(param->kernel == AMPD_KERNEL_I16){
+        quantize_i16(data, n, w->qdata);
+        n_peaks = ampdcpu_i16(w->qdata, n, param, w->gamma, w->sigma,
+                              w->peaks);
+    }
+    else if(param->kernel == AMPD_KERNEL_APPROX)
+        n_peaks = ampdcpu_approx(data, n, param, w->gamma, w->sigma,
+                                 w->peaks);
+    else
+        n_peaks = ampdcpu_mf(data, n, param, w->gamma, w->sigma, w->peaks);
+    return n_peaks;
+}
+
+/**
+ * Sampled error estimate of the approx kernel: every ctx->approx_check-th
+ * result is computed again with matfree, after it was stored. Only the exact
+ * peaks within [off, off+core) of the window are counted.
+ */
+void check_approx(struct ampd_worker *w, int i, float *data, int n,
+                  struct ampd_param *param, int off, int core){
+
+    int j, n_peaks;
+    struct batch_ctx *ctx = w->ctx;
+    if(param->kernel == AMPD_KERNEL_APPROX && ctx->approx_check > 0 &&
+       i % ctx->approx_check == 0){
+        memcpy(&w->tparam, param, sizeof(struct ampd_param));
+        n_peaks = ampdcpu_mf(data, n, &w->tparam, w->gamma, w->sigma,
+                             w->peaks);
+        ctx->res[i].exact_n_peaks = 0;
+        for(j=0; j<n_peaks; j++){
+            if(w->peaks[j] >= off && w->peaks[j] < off + core)
+                ctx->res[i].exact_n_peaks++;
+        }
+        ctx->res[i].exact_lambda = w->tparam.lambda;
+    }
+}
+
+/**
+ * Process batches i0 ... i0+lanes-1 together with the lanes kernel. Batches
+ * are prepared one by one, then interleaved sample by sample.
+ */
+void process_lanes(struct ampd_worker *w, int i0){
+
+    int j, i;
+    int n = w->ctx->n;
+    int l = lms_rows(n, &w->param);
+    int lanes = w->lanes;
+
+    for(j=0; j<lanes; j++){
+        memcpy(&w->lparam[j], &w->param, sizeof(struct ampd_param));
+        prep_batch(w, i0+j, w->ldata + (size_t)j * n, &w->lparam[j]);
+    }
+    for(i=0; i<n; i++){
+        for(j=0; j<lanes; j++)
+            w->data_il[(size_t)i * lanes + j] = w->ldata[(size_t)j * n + i];
+    }
+    ampdcpu_lanes(w->data_il, n, lanes, w->lparam, w->lgamma, w->lsigma,
+                  w->lpks, w->ln_pks);
+    for(j=0; j<lanes; j++){
+        store_batch(w, i0+j, w->ldata + (size_t)j * n, &w->lparam[j],
+                    w->lgamma + (size_t)j * l, w->lsigma + (size_t)j * n,
+                    w->lpks[j], w->ln_pks[j], 0);
+    }
+}
+
+/**
+ * Work items are the full groups of ctx->lanes batches for the lanes kernel,
+ * then the batches after the last full group, one by one.
+ */
+void init_items(struct batch_ctx *ctx){
+
+    ctx->groups = 0;
+    if(ctx->lanes > 1)
+        ctx->groups = ctx->cycles / ctx->lanes;
+    ctx->items = ctx->groups + ctx->cycles - ctx->groups * ctx->lanes;
+}
+/**
+ * First batch of item j, the number of batches is set in count.
+ */
+int item_batches(struct batch_ctx *ctx, int j, int *count){
+
+    if(j < ctx->groups){
+        *count = ctx->lanes;
+        return j * ctx->lanes;
+    }
+    *count = 1;
+    return ctx->groups * ctx->lanes + j - ctx->groups;
+}
+
+void process_item(struct ampd_worker *w, int j){
+
+    int count;
+    int i = item_batches(w->ctx, j, &count);
+    if(j < w->ctx->groups)
+        process_lanes(w, i);
+    else
+        process_batch(w, i);
+}
+
+/**
+ * Thread entry, worker i takes items i, i+threads, i+2*threads, ...
+ * Lane groups are processed with the lanes kernel, the rest with the single
+ * window kernel.
+ */
+void *batch_worker(void *arg){
+
+    struct ampd_worker *w = (struct ampd_worker *)arg;
+    int j;
+    for(j=w->id; j<w->ctx->items; j+=w->ctx->threads)
+        process_item(w, j);
+    return NULL;
+}
+
+/**
+ * Reader stage of the pipeline. Parse the input file into a free input
+ * buffer, one item at a time, and queue each item to its worker as soon as
+ * its samples are in. The last batch holds the last n samples, as in
+ * fetch_data_buff, the ones before it are kept from the batch before. Each
+ * worker gets -1 at the end.
+ */
+void *read_worker(void *arg){
+
+    struct batch_ctx *ctx = (struct batch_ctx *)arg;
+    FILE *fp;
+    char buf[FBUF];
+    float *d;
+    float *prev;
+    int n = ctx->n;
+    int i = 0;
+    int j = 0;
+    int t, k, first, count, need;
+    ctx->read_len = -1;
+    prev = malloc(sizeof(float) * n);
+    fp = (prev == NULL) ? NULL : fopen(ctx->infile, "r");
+    while(fp != NULL && j < ctx->items){
+        first = item_batches(ctx, j, &count);
+        ctx->item_slot[j] = spsc_pop_wait(&ctx->free_slots);
+        d = ctx->pool + (size_t)ctx->item_slot[j] * ctx->lanes * n;
+        for(k=0; k<count && i == (first + k) * n; k++, d+=n){
+            need = ctx->datalen - i;
+            if(need > n)
+                need = n;
+            while(i < (first + k) * n + need &&
+                  txc_next_row(buf, FBUF, fp) != NULL){
+                sscanf(buf, "%f\n",d + i - (first + k) * n);
+                i++;
+            }
+            if(i < (first + k) * n + need)
+                break;
+            if(need < n){
+                memmove(d + n - need, d, sizeof(float) * need);
+                memcpy(d, prev + need, sizeof(float) * (n - need));
+            }
+            else if(first + k == ctx->cycles - 2)
+                memcpy(prev, d, sizeof(float) * n);
+        }
+        if(k < count)
+            break;
+        spsc_push_wait(&ctx->todo[j % ctx->threads], j);
+        j++;
+    }
+    if(fp != NULL){
+        fclose(fp);
+        ctx->read_len = i;
+    }
+    free(prev);
+    // the writer reports the error
+    for(t=0; t<ctx->threads; t++)
+        spsc_push_wait(&ctx->todo[t], (j < ctx->items) ? PIPE_FAILED :
+                       PIPE_END);
+    return NULL;
+}
+
+/**
+ * Samples of batch i in the input buffer of its item.
+ */
+float *pipe_data(struct batch_ctx *ctx, int i){
+
+    int j, count, first;
+    if(i < ctx->groups * ctx->lanes)
+        j = i / ctx->lanes;
+    else
+        j = ctx->groups + i - ctx->groups * ctx->lanes;
+    first = item_batches(ctx, j, &count);
+    return ctx->pool + ((size_t)ctx->item_slot[j] * ctx->lanes + i - first) *
+           ctx->n;
+}
+
+/**
+ * Compute stage of the pipeline, items come from the reader and are passed
+ * on to the writer in the same order.
+ */
+void *pipeline_worker(void *arg){
+
+    struct ampd_worker *w = (struct ampd_worker *)arg;
+    struct batch_ctx *ctx = w->ctx;
+    int j;
+    while((j = spsc_pop_wait(&ctx->todo[w->id])) >= 0){
+        process_item(w, j);
+        spsc_push_wait(&ctx->done[w->id], j);
+    }
+    if(j == PIPE_FAILED)
+        spsc_push_wait(&ctx->done[w->id], j);
+    return NULL;
+}
+
+/**
+ * Start the reader and the workers, the calling thread is the writer: it
+ * takes the results in order with wait_batch, then calls finish_pipeline.
+ * The input buffers give back-pressure, the reader waits for the writer to
+ * give one back once PIPE_SLOTS items per worker are read ahead. Memory
+ * does not grow with the input. Return 0 on success.
+ */
+int start_pipeline(struct batch_ctx *ctx){
+
+    int t;
+    int slots = PIPE_SLOTS * ctx->threads + 1;
+    init_items(ctx);
+    ctx->next_item = 0;
+    ctx->done_upto = 0;
+    ctx->w = malloc(sizeof(struct ampd_worker) * ctx->threads);
+    ctx->tid = malloc(sizeof(pthread_t) * (ctx->threads + 1));
+    ctx->todo = malloc(sizeof(struct spsc_ring) * ctx->threads);
+    ctx->done = malloc(sizeof(struct spsc_ring) * ctx->threads);
+    ctx->pool = malloc(sizeof(float) * slots * ctx->lanes * ctx->n);
+    ctx->item_slot = malloc(sizeof(int) * ctx->items);
+    if(ctx->w == NULL || ctx->tid == NULL || ctx->todo == NULL ||
+       ctx->done == NULL || ctx->pool == NULL || ctx->item_slot == NULL ||
+       spsc_init(&ctx->free_slots, slots) != 0)
+        return -1;
+    for(t=0; t<slots; t++)
+        spsc_push(&ctx->free_slots, t);
+    for(t=0; t<ctx->threads; t++){
+        if(init_worker(&ctx->w[t], ctx, t) != 0 ||
+           spsc_init(&ctx->todo[t], PIPE_RING) != 0 ||
+           spsc_init(&ctx->done[t], PIPE_RING) != 0)
+            return -1;
+    }
+    for(t=0; t<ctx->threads; t++){
+        if(pthread_create(&ctx->tid[t], NULL, pipeline_worker, &ctx->w[t])
+                != 0){
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    if(pthread_create(&ctx->tid[ctx->threads], NULL, read_worker, ctx) != 0){
+        perror("pthread_create");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writer side of the pipeline: return when batch i and every batch before
+ * it are computed. Batches must be asked for in order. Return -1 if the
+ * reader failed before batch i, every thread ends then.
+ */
+int wait_batch(struct batch_ctx *ctx, int i){
+
+    int first, count;
+    while(ctx->done_upto <= i && ctx->next_item < ctx->items){
+        if(spsc_pop_wait(&ctx->done[ctx->next_item % ctx->threads]) < 0)
+            return -1;
+        spsc_push(&ctx->free_slots, ctx->item_slot[ctx->next_item]);
+        first = item_batches(ctx, ctx->next_item, &count);
+        ctx->done_upto = first + count;
+        ctx->next_item++;
+    }
+    return 0;
+}
+
+void finish_pipeline(struct batch_ctx *ctx){
+
+    int t;
+    for(t=0; t<=ctx->threads; t++)
+        pthread_join(ctx->tid[t], NULL);
+    for(t=0; t<ctx->threads; t++){
+        free_worker(&ctx->w[t]);
+        spsc_free(&ctx->todo[t]);
+        spsc_free(&ctx->done[t]);
+    }
+    free(ctx->w);
+    free(ctx->tid);
+    free(ctx->todo);
+    free(ctx->done);
+    spsc_free(&ctx->free_slots);
+    free(ctx->pool);
+    free(ctx->item_slot);
+    ctx->pool = NULL;
+}
+
+/**
+ * Stream mode: read samples from in until it ends, and process each batch as
+ * soon as it is full, on the calling thread. ctx->full_data holds the last
+ * full batch, then the one being read, ctx->datalen is 2 * ctx->n. Peaks are
+ * written with their index in the stream and flushed after each batch, so
+ * they can be followed live. The rest at the end is processed in a window
+ * with the samples before it, only its own peaks are kept. Output files may
+ * be NULL. Return the number of samples, -1 on malloc failure. The number of
+ * batches and peaks are set in *batches and *n_peaks.
+ */
+int stream_batches(struct batch_ctx *ctx, struct stream_src *src,
+                   FILE *fp_peaks, FILE *fp_rate, struct pkx_writer *pkx,
+                   struct pk_stats *ipi, int *batches, int *n_peaks){
+
+    struct ampd_worker w;
+    struct batch_result *res = &ctx->res[0];
+    int n = ctx->n;
+    int r = 0;          // samples of the batch being read
+    int total = 0;
+    int eof = 0;
+    int j, k, off, len, keep;
+    int last = -1;      // last peak written
+    double fs = ctx->param->sampling_rate;
+    if(init_worker(&w, ctx, 0) != 0)
+        return -1;
+    *batches = 0;
+    *n_peaks = 0;
+    while(eof == 0){
+        k = stream_read(src, ctx->full_data + n + r, n - r);
+        r += k;
+        total += k;
+        if(k == 0)
+            eof = 1;
+        else if(r < n)
+            continue;
+        // full batch, or the rest after the samples before it
+        off = n;
+        len = r;
+        keep = 0;
+        if(r < n && total >= n){
+            off = r;
+            len = n;
+            keep = n - r;
+        }
+        if(r == 0 || len < 8)
+            break;
+        prep_window(&w, 0, off, len, w.data, &w.param);
+        k = run_kernel(&w, w.data, len, &w.param);
+        store_window(&w, 0, total - len, len, w.data, &w.param, w.gamma,
+                     w.sigma, w.peaks, k, 0);
+        for(j=0, k=0; j<res->n_peaks; j++){
+            if(res->peaks[j] < keep)
+                continue;
+            k++;
+            if(last >= 0)
+                pks_add(ipi, (double)(res->peaks[j] + res->ind - last) / fs);
+            last = res->peaks[j] + res->ind;
+            if(fp_peaks != NULL)
+                fprintf(fp_peaks, "%d\n",res->peaks[j] + res->ind);
+            if(pkx != NULL && pkx_add(pkx, res->peaks[j] + res->ind) != 0){
+                free(res->peaks);
+                free_worker(&w);
+                return -1;
+            }
+        }
+        free(res->peaks);
+        free(res->ipi);
+        res->ipi = NULL;
+        if(fp_rate != NULL){
+            fprintf(fp_rate, "%d\n",(int)(k / ((len - keep) / fs) * 60.0));
+            fflush(fp_rate);
+        }
+        if(fp_peaks != NULL)
+            fflush(fp_peaks);
+        *n_peaks += k;
+        (*batches)++;
+        memcpy(ctx->full_data, ctx->full_data + n, sizeof(float) * n);
+        r = 0;
+    }
+    free_worker(&w);
+    return total;
+}
+
+/**
+ * Read up to max samples of the stream into dst, waiting for at least one.
+ * Text is parsed line by line, ring samples are converted in one pass.
+ * Return the count, 0 at the end of the input.
+ */
+int stream_read(struct stream_src *src, float *dst, int max){
+
+    char buf[FBUF];
+    int i = 0;
+    if(src->shm != NULL)
+        return shm_ring_read(src->shm, src->channel, dst, max);
+    while(i < max && txc_next_row(buf, FBUF, src->fp) != NULL){
+        sscanf(buf, "%f\n",dst + i);
+        i++;
+    }
+    return i;
+}
+
+/**
+ * Split the data into one segment for each worker, at batch boundaries, and
+ * reserve room in ctx->res for the shortest windows: with the margins taken
+ * off and the segment end split in two, a core is at least ctx->min_n / 4.
+ * The windows depend on where the segments start, so deterministic runs use
+ * DET_SEGMENTS segments whatever the thread count.
+ * Return the number of results to allocate, -1 on malloc failure.
+ */
+int init_segments(struct batch_ctx *ctx){
+
+    int t, len;
+    int total = 0;
+    ctx->segments = ctx->threads;
+    if(ctx->deterministic == 1)
+        ctx->segments = (ctx->cycles < DET_SEGMENTS) ? ctx->cycles :
+                        DET_SEGMENTS;
+    if(ctx->segments < 1)
+        ctx->segments = 1;
+    ctx->seg_start = malloc(sizeof(int) * (ctx->segments + 1));
+    ctx->seg_base = malloc(sizeof(int) * ctx->segments);
+    ctx->seg_count = calloc(ctx->segments, sizeof(int));
+    if(ctx->seg_start == NULL || ctx->seg_base == NULL ||
+       ctx->seg_count == NULL)
+        return -1;
+    for(t=0; t<=ctx->segments; t++){
+        ctx->seg_start[t] = (int)((long)ctx->cycles * t / ctx->segments) *
+                            ctx->n;
+        if(ctx->seg_start[t] > ctx->datalen || t == ctx->segments)
+            ctx->seg_start[t] = ctx->datalen;
+    }
+    for(t=0; t<ctx->segments; t++){
+        len = ctx->seg_start[t+1] - ctx->seg_start[t];
+        ctx->seg_base[t] = total;
+        total += len / (ctx->min_n / 4) + 1;
+    }
+    return total;
+}
+
+/**
+ * Core length of the next window from the mean peak distance of the last
+ * one, rem samples are left in the segment. The margin on both sides of the
+ * core is set in *margin, core and margins fit in ctx->n. The rest of the
+ * segment is not left shorter than half a core, it is added to this core or
+ * split in two.
+ */
+int next_window_length(struct batch_ctx *ctx, double mean_pk_dist, int rem,
+                       int *margin){
+
+    int n, m;
+    double fs = ctx->param->sampling_rate;
+    if(mean_pk_dist > 0){
+        n = (int)(ceil(ADAPTIVE_PERIODS * mean_pk_dist) * fs);
+        m = (int)ceil(ADAPTIVE_MARGIN * mean_pk_dist * fs);
+    }
+    else{
+        n = ctx->n;
+        m = ctx->n / 8;
+    }
+    if(n < ctx->min_n)
+        n = ctx->min_n;
+    if(n > ctx->n)
+        n = ctx->n;
+    if(m > n / 4)
+        m = n / 4;
+    n -= 2 * m;
+    if(rem - n < n / 2)
+        n = (rem + 2 * m <= ctx->n) ? rem : rem / 2;
+    *margin = m;
+    return n;
+}
+
+/**
+ * Set the LMS row sums of window length n in param, from the worker cache.
+ */
+static void use_rowsum(struct ampd_worker *w, int n, struct ampd_param *param){
+
+    int j;
+    for(j=0; j<ADAPTIVE_ROWSUMS; j++){
+        if(w->rowsum[j] != NULL && w->rowsum_n[j] == n)
+            break;
+    }
+    if(j == ADAPTIVE_ROWSUMS){
+        j = w->rowsum_next;
+        w->rowsum_next = (j + 1) % ADAPTIVE_ROWSUMS;
+        free(w->rowsum[j]);
+        w->rowsum[j] = lms_rowsum(n, param);
+        w->rowsum_n[j] = n;
+    }
+    param->rowsum = w->rowsum[j];
+    param->rowsum_n = n;
+}
+
+/**
+ * Go through segment t of the data window by window, each window is
+ * ADAPTIVE_PERIODS peak periods long as estimated in the previous one. The
+ * margins may reach into the neighbouring segments, only the peaks of the
+ * core are stored. Aux files are saved by window number within the segment,
+ * offset by the segment base.
+ */
+static void adaptive_segment(struct ampd_worker *w, int t){
+
+    struct batch_ctx *ctx = w->ctx;
+    struct ampd_param *param = &w->param;
+    int ind = ctx->seg_start[t];
+    int end = ctx->seg_start[t+1];
+    int i = ctx->seg_base[t];
+    int j, k, n, m, lo, hi, off, n_peaks;
+    double mean_pk_dist = 0;
+    while(ind < end){
+        n = next_window_length(ctx, mean_pk_dist, end - ind, &m);
+        lo = (ind - m > 0) ? ind - m : 0;
+        hi = (ind + n + m < ctx->datalen) ? ind + n + m : ctx->datalen;
+        off = ind - lo;
+        use_rowsum(w, hi - lo, param);
+        prep_window(w, i, lo, hi - lo, w->data, param);
+        n_peaks = run_kernel(w, w->data, hi - lo, param);
+        mean_pk_dist = (n_peaks > 1) ? param->mean_pk_dist : 0;
+        for(j=0, k=0; j<n_peaks; j++){
+            if(w->peaks[j] >= off && w->peaks[j] < off + n)
+                w->peaks[k++] = w->peaks[j] - off;
+        }
+        store_window(w, i, ind, n, w->data + off, param, w->gamma,
+                     w->sigma + off, w->peaks, k, 0);
+        check_approx(w, i, w->data, hi - lo, param, off, n);
+        ind += n;
+        i++;
+    }
+    ctx->seg_count[t] = i - ctx->seg_base[t];
+}
+
+/**
+ * Thread entry with adaptive window length, worker i takes segments i,
+ * i+threads, i+2*threads, ...
+ */
+void *adaptive_worker(void *arg){
+
+    struct ampd_worker *w = (struct ampd_worker *)arg;
+    int t;
+    for(t=w->id; t<w->ctx->segments; t+=w->ctx->threads)
+        adaptive_segment(w, t);
+    return NULL;
+}
+
+/**
+ * Score of a batch result for refinement, lower is better. Batches without
+ * peaks or lambda are the worst, then rates out of the datatype bounds are
+ * penalized, otherwise it is the stdev/mean of peak distances.
+ */
+double batch_score(struct batch_result *res, struct ampd_param *p){
+
+    double s;
+    if(res->n_peaks < 2 || res->lambda <= 1)
+        return REFINE_SCORE_MAX;
+    s = (res->mean_pk_dist > 0) ? res->stdev_pk_dist / res->mean_pk_dist : 1.0;
+    if(p->peak_rate_min > 0 && res->peaks_per_min < p->peak_rate_min)
+        s += 10.0;
+    if(p->peak_rate_max > 0 && res->peaks_per_min > p->peak_rate_max)
+        s += 10.0;
+    return s;
+}
+
+/* alternative settings tried on suspicious batches */
+#define REFINE_FLIP 1       // opposite polarity
+#define REFINE_SIGMA 2      // double sigma threshold
+#define REFINE_LOWPASS 3    // lowpass at twice the maximum plausible rate
+#define REFINE_SPLIT 4      // two windows of half length
+#define REFINE_ALTS 4
+
+/**
+ * Run batch i with alternative alt into the worker buffers and fill out,
+ * peaks are left in w->peaks. Half windows use the LMS row sums in
+ * half_rowsum. Return -1 if the alternative does not apply.
+ */
+static int refine_candidate(struct ampd_worker *w, int i, int alt,
+                            double *half_rowsum, struct batch_result *out){
+
+    struct ampd_param p, p2;
+    int n = w->ctx->n;
+    int h = n / 2;
+    int j, k, n1, n2, len;
+    int ind_thresh;
+    double length;      // seconds
+    memcpy(&p, &w->param, sizeof(struct ampd_param));
+    if(alt == REFINE_LOWPASS && p.peak_rate_max <= 0)
+        return -1;
+    prep_batch(w, i, w->data, &p);
+    if(alt == REFINE_FLIP)
+        flip_data(w->data, n);
+    else if(alt == REFINE_SIGMA)
+        p.sigma_thresh *= 2.0;
+    else if(alt == REFINE_LOWPASS)
+        tdlpfilt(w->data, n, p.sampling_rate, 2.0 * p.peak_rate_max / 60.0);
+    if(alt == REFINE_SPLIT){
+        p.rowsum = half_rowsum;
+        p.rowsum_n = h;
+        memcpy(&p2, &p, sizeof(struct ampd_param));
+        n1 = ampdcpu_mf(w->data, h, &p, w->gamma, w->sigma, w->peaks);
+        n2 = ampdcpu_mf(w->data + h, n - h, &p2, w->gamma, w->sigma,
+                        w->peaks + n1);
+        // drop peaks of the second half too close to the first half
+        ind_thresh = (int)(p.peak_thresh * p.sampling_rate);
+        for(j=0, k=n1; j<n2; j++){
+            w->peaks[k] = w->peaks[n1+j] + h;
+            if(k == 0 || w->peaks[k] - w->peaks[k-1] > ind_thresh)
+                k++;
+        }
+        out->n_peaks = k;
+        out->lambda = (p.lambda < p2.lambda) ? p.lambda : p2.lambda;
+        peak_dist_stats(w->peaks, k, &p);
+    } else {
+        out->n_peaks = ampdcpu_mf(w->data, n, &p, w->gamma, w->sigma,
+                                  w->peaks);
+        out->lambda = p.lambda;
+    }
+    batch_overlap(w->ctx, i, w->peaks, &out->n_peaks, &len);
+    length = (len < n) ? len / p.sampling_rate : w->bparam.batch_length;
+    out->peaks_per_min = (double)out->n_peaks / length * 60.0;
+    out->mean_pk_dist = p.mean_pk_dist;
+    out->stdev_pk_dist = p.stdev_pk_dist;
+    return 0;
+}
+
+/**
+ * Lazy refinement. Batches with implausible results (see batch_score) and
+ * their neighbours are run again with each alternative of REFINE_*, and the
+ * best scoring result replaces the original if it is better, by at least
+ * REFINE_MIN_GAIN for the neighbours. Counts are put into mp.
+ * Return 0 on success, -1 on malloc failure.
+ */
+int refine_batches(struct batch_ctx *ctx, struct meta_param *mp){
+
+    struct ampd_worker w;
+    struct batch_result cand, best, *res;
+    struct ampd_param *param = ctx->param;
+    char *todo;                 // 1 for neighbours, 2 for suspicious batches
+    int *best_pks;
+    double *half_rowsum;
+    int i, j, alt;
+    double s, best_s;
+
+    todo = calloc(ctx->cycles, 1);
+    if(todo == NULL)
+        return -1;
+    for(i=0; i<ctx->cycles; i++){
+        if(batch_score(&ctx->res[i], param) <= REFINE_MAX_CV)
+            continue;
+        mp->refine_flagged++;
+        for(j=i-1; j<=i+1; j++){
+            if(j >= 0 && j < ctx->cycles && todo[j] == 0)
+                todo[j] = 1;
+        }
+        todo[i] = 2;
+    }
+    if(mp->refine_flagged == 0){
+        free(todo);
+        return 0;
+    }
+    if(init_worker(&w, ctx, 0) != 0){
+        free(todo);
+        return -1;
+    }
+    best_pks = malloc(sizeof(int) * ctx->n);
+    half_rowsum = lms_rowsum(ctx->n / 2, param);
+    for(i=0; i<ctx->cycles; i++){
+        if(todo[i] == 0)
+            continue;
+        mp->refine_recomputed++;
+        res = &ctx->res[i];
+        best_s = batch_score(res, param);
+        if(todo[i] == 1)
+            best_s -= REFINE_MIN_GAIN;
+        best = *res;
+        best.refined = 0;
+        for(alt=1; alt<=REFINE_ALTS; alt++){
+            if(refine_candidate(&w, i, alt, half_rowsum, &cand) != 0)
+                continue;
+            s = batch_score(&cand, param);
+            if(s < best_s){
+                best_s = s;
+                best = cand;
+                best.refined = alt;
+                memcpy(best_pks, w.peaks, sizeof(int) * cand.n_peaks);
+            }
+        }
+        if(best.refined == 0)
+            continue;
+        if(verbose > 0)
+            printf("refine: batch=%d, alt=%d, score %.3lf -> %.3lf\n",i,
+                   best.refined, batch_score(res, param), best_s);
+        mp->refine_improved++;
+        free(res->peaks);
+        res->peaks = malloc(sizeof(int) * (best.n_peaks > 0 ? best.n_peaks:1));
+        memcpy(res->peaks, best_pks, sizeof(int) * best.n_peaks);
+        res->n_peaks = best.n_peaks;
+        res->peaks_per_min = best.peaks_per_min;
+        res->lambda = best.lambda;
+        res->mean_pk_dist = best.mean_pk_dist;
+        res->stdev_pk_dist = best.stdev_pk_dist;
+        res->refined = best.refined;
+        window_pk_stats(res, param->sampling_rate);
+    }
+    free(best_pks);
+    free(half_rowsum);
+    free_worker(&w);
+    free(todo);
+    return 0;
+}
+
+/**
+ * Run all batches on ctx->threads worker threads. The first worker runs on
+ * the calling thread. Return 0 on success, -1 on error.
+ */
+int run_batches(struct batch_ctx *ctx){
+
+    int t;
+    int ret = 0;
+    struct ampd_worker *w;
+    pthread_t *tid;
+    void *(*entry)(void *);
+    entry = (ctx->adaptive == 1) ? adaptive_worker : batch_worker;
+    init_items(ctx);
+    w = malloc(sizeof(struct ampd_worker) * ctx->threads);
+    tid = malloc(sizeof(pthread_t) * ctx->threads);
+    for(t=0; t<ctx->threads; t++){
+        if(init_worker(&w[t], ctx, t) != 0)
+            return -1;
+    }
+    for(t=1; t<ctx->threads; t++){
+        if(pthread_create(&tid[t], NULL, entry, &w[t]) != 0){
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    entry(&w[0]);
+    for(t=1; t<ctx->threads; t++)
+        pthread_join(tid[t], NULL);
+    // adaptive: move the windows of all segments together, in data order
+    if(ctx->adaptive == 1){
+        ctx->cycles = 0;
+        for(t=0; t<ctx->segments; t++){
+            memmove(&ctx->res[ctx->cycles], &ctx->res[ctx->seg_base[t]],
+                    sizeof(struct batch_result) * ctx->seg_count[t]);
+            ctx->cycles += ctx->seg_count[t];
+        }
+    }
+    for(t=0; t<ctx->threads; t++)
+        free_worker(&w[t]);
+    free(w);
+    free(tid);
+    return ret;
+}
 
 /**
  * Set data specific hard defined defaults.
@@ -565,19 +2094,37 @@ void set_ampd_param(struct ampd_param *p, char *type){
     p->a = DEF_A;
     p->rnd_factor = DEF_RND_FACTOR;
     p->sampling_rate = DEF_SAMPLING_RATE;
-    p->peak_rate_min = 0;
-    p->peak_rate_max = 0;
+    p->peak_rate_min = DEF_RATE_MIN;
+    p->peak_rate_max = DEF_RATE_MAX;
     p->lambda_max = 0;
+    p->l_max = 0;
+    p->rows_periods = 0;
+    p->kernel = AMPD_KERNEL_DENSE;
+    p->rowsum = NULL;
+    p->rowsum_n = 0;
     if(strcmp(type, "resp")==0){
         // respiration optimized
         p->sigma_thresh = RESP_SIGMA_THRESHOLD;
         p->peak_thresh = RESP_PEAK_THRESHOLD;
+        p->peak_rate_min = RESP_RATE_MIN;
+        p->peak_rate_max = RESP_RATE_MAX;
 
     }
     else if(strcmp(type, "puls")==0){
         // pulsoxy optimized
         p->sigma_thresh = PULS_SIGMA_THRESHOLD;
         p->peak_thresh = PULS_PEAK_THRESHOLD;
+        p->peak_rate_min = PULS_RATE_MIN;
+        p->peak_rate_max = PULS_RATE_MAX;
+    }
+    else if(strcmp(type, "ecg")==0){
+        // R peaks at kHz sampling, scale bounds from the heart rate
+        p->sampling_rate = ECG_SAMPLING_RATE;
+        p->sigma_thresh = ECG_SIGMA_THRESHOLD;
+        p->peak_thresh = ECG_PEAK_THRESHOLD;
+        p->peak_rate_min = ECG_RATE_MIN;
+        p->peak_rate_max = ECG_RATE_MAX;
+        p->rows_periods = ECG_ROWS_PERIODS;
     }
     else {
         // default
@@ -632,6 +2179,32 @@ void extract_raw_filename(char *path, char *bname, int buf){
     return;
 }
 
+/**
+ * Find the study ID for the rate store: the last directory named like
+ * s_[YYYYMMDDNN] in the input path, then in the output path. Fall back to the
+ * input file name.
+ */
+void extract_study_id(char *infile, char *outdir, char *study, int bufsize){
+
+    char buf[MAX_PATH_LEN];
+    char *paths[2] = {infile, outdir};
+    char *tok;
+    int i;
+    memset(study, 0, bufsize);
+    for(i=0; i<2 && study[0] == '\0'; i++){
+        strncpy(buf, paths[i], sizeof(buf)-1);
+        buf[sizeof(buf)-1] = '\0';
+        tok = strtok(buf, "/");
+        while(tok != NULL){
+            if(strncmp(tok, "s_", 2) == 0)
+                strncpy(study, tok, bufsize-1);
+            tok = strtok(NULL, "/");
+        }
+    }
+    if(study[0] == '\0')
+        extract_raw_filename(infile, study, bufsize);
+}
+
 /**
  * Function: mkpath
  * ----------------
@@ -776,7 +2349,37 @@ void save_batch_param(struct batch_param *p, char *path){
     //fprintf(fp, "stdev_pk_dist=%.3lf\n",p->stdev_pk_dist);
     fclose(fp);
 }
-void save_meta(struct meta_param *p, struct preproc_param *pp, char *path){
+/**
+ * Peak distance statistics of the recording, then median, IQR and the 5th
+ * and 95th percentiles of each window, in seconds.
+ */
+void fprintf_pk_stats(FILE *fp, struct meta_param *p){
+
+    int i;
+    double q[PKS_NQ];
+    double *wq;
+    pks_summary(p->ipi, q);
+    fprintf(fp,"pk_dist_count=%ld\n",p->ipi->n);
+    fprintf(fp,"pk_dist_mean=%.3lf\n",p->ipi->mean);
+    fprintf(fp,"pk_dist_stdev=%.3lf\n",pks_stdev(p->ipi));
+    fprintf(fp,"pk_dist_min=%.3lf\n",p->ipi->min);
+    fprintf(fp,"pk_dist_p05=%.3lf\n",q[0]);
+    fprintf(fp,"pk_dist_p25=%.3lf\n",q[1]);
+    fprintf(fp,"pk_dist_median=%.3lf\n",q[2]);
+    fprintf(fp,"pk_dist_p75=%.3lf\n",q[3]);
+    fprintf(fp,"pk_dist_p95=%.3lf\n",q[4]);
+    fprintf(fp,"pk_dist_iqr=%.3lf\n",q[3] - q[1]);
+    fprintf(fp,"pk_dist_max=%.3lf\n",p->ipi->max);
+    if(p->n_res > 0)
+        fprintf(fp,"window_pk_dist=start median iqr p05 p95\n");
+    for(i=0; i<p->n_res; i++){
+        wq = p->res[i].pk_dist_q;
+        fprintf(fp,"window_pk_dist=%d %.3lf %.3lf %.3lf %.3lf\n",
+                p->res[i].ind, wq[2], wq[3] - wq[1], wq[0], wq[4]);
+    }
+}
+void save_meta(struct meta_param *p, struct preproc_param *pp,
+               struct ampd_plan *plan, char *path){
 
     FILE *fp;
     mkpath(path, 0777);
@@ -795,13 +2398,35 @@ void save_meta(struct meta_param *p, struct preproc_param *pp, char *path){
     fprintf(fp,"batch_length=%lf\n",p->batch_length);
     fprintf(fp,"total_batches=%d\n",p->total_batches);
     fprintf(fp,"total_peaks=%d\n",p->total_peaks);
+    if(p->total_troughs >= 0)
+        fprintf(fp,"total_troughs=%d\n",p->total_troughs);
+    if(p->approx == 1){
+        fprintf(fp,"approx_lambda_err=%.3lf\n",p->approx_lambda_err);
+        fprintf(fp,"approx_checked_batches=%d\n",p->approx_checked);
+        fprintf(fp,"approx_lambda_delta_max=%d\n",p->approx_lambda_delta_max);
+        fprintf(fp,"approx_peak_delta=%d\n",p->approx_peak_delta);
+        fprintf(fp,"approx_peak_delta_rel=%.5lf\n",
+                (p->approx_exact_peaks > 0) ?
+                (double)p->approx_peak_delta / p->approx_exact_peaks : 0.0);
+    }
+    if(p->adaptive == 1)
+        fprintf(fp,"mean_window_length=%lf\n",p->mean_window_length);
+    if(p->deterministic == 1)
+        fprintf(fp,"deterministic=1\n");
+    if(p->ipi != NULL)
+        fprintf_pk_stats(fp, p);
+    if(p->refine == 1){
+        fprintf(fp,"refine_flagged=%d\n",p->refine_flagged);
+        fprintf(fp,"refine_recomputed=%d\n",p->refine_recomputed);
+        fprintf(fp,"refine_improved=%d\n",p->refine_improved);
+    }
+    fprintf_plan(fp, plan);
     fclose(fp);
 }
 /**
  * Load a part of the full timeseries data into memory from file.
  * File should only contain one float value on each line.
  */
-#define FBUF 32
 int fetch_data(char *path, float *data, int n, int ind, int n_zpad){
 
     FILE *fp;
@@ -857,7 +2482,90 @@ int fetch_data_buff(float *fdata,int len, float *data, int n, int ind, int n_zpa
 
 }
 /**
- * Load data from file into memory
+ * Same as fetch_data_buff, from int16 fixed point data scaled by scale.
+ */
+int fetch_data_buff_i16(int16_t *q, int len, double scale, float *data, int n,
+                        int ind){
+
+    int i;
+    if(ind + n >= len)
+        ind = len - n;
+    for(i=0; i<n; i++)
+        data[i] = (float)(q[i+ind] / scale);
+    return 0;
+}
+/**
+ * Load fixed point text data straight into int16, one value each line, eg:
+ * SA exports such as " 2.060". Values are scaled by 10^(number of decimals
+ * in the first value). Return the scale, or -1 if a line is not a fixed point
+ * number with at most that many decimals, or it does not fit into int16.
+ */
+double load_from_file_i16(char *path, int16_t *q, int datalen){
+
+    FILE *fp;
+    char buf[FBUF];
+    char *c;
+    int i = 0;
+    int dec = -1;       // decimals, set from the first value
+    int fd;             // decimals of current value
+    int digits;
+    int sign;
+    long v;
+    long scale = 1;
+    fp = fopen(path, "r");
+    if(fp == NULL){
+        fprintf(stderr, "cannot open file %s\n",path);
+        exit(EXIT_FAILURE);
+    }
+    while(i < datalen && txc_next_row(buf, FBUF, fp) != NULL){
+        c = buf;
+        while(*c == ' ' || *c == '\t')
+            c++;
+        sign = 1;
+        if(*c == '-' || *c == '+'){
+            sign = (*c == '-') ? -1 : 1;
+            c++;
+        }
+        v = 0; fd = -1; digits = 0;
+        for(; *c != '\0' && *c != '\n' && *c != '\r'; c++){
+            if(*c == '.' && fd == -1){
+                fd = 0;
+                continue;
+            }
+            if(*c < '0' || *c > '9' || v > 100000)
+                break;
+            v = v * 10 + (*c - '0');
+            digits++;
+            if(fd >= 0)
+                fd++;
+        }
+        if(fd == -1)
+            fd = 0;
+        if(digits == 0 || (*c != '\0' && *c != '\n' && *c != '\r'))
+            break;
+        if(dec == -1){
+            dec = fd;
+            while(scale < 10000 && fd-- > 0)
+                scale *= 10;
+            fd = dec;
+        }
+        if(fd > dec)
+            break;
+        for(; fd < dec; fd++)
+            v *= 10;
+        if(v > 32767)
+            break;
+        q[i] = (int16_t)(sign * v);
+        i++;
+    }
+    fclose(fp);
+    if(i < datalen || dec > 4)
+        return -1;
+    return (double)scale;
+}
+/**
+ * Load the data rows of the file into memory, comment and empty lines are
+ * skipped
  */
 void load_from_file(char *path, float *fdata, int datalen){
 
@@ -869,7 +2577,7 @@ void load_from_file(char *path, float *fdata, int datalen){
         fprintf(stderr, "cannot open file %s\n",path);
         exit(EXIT_FAILURE);
     }
-    while(fgets(buf, FBUF, fp) != NULL){
+    while(i < datalen && txc_next_row(buf, FBUF, fp) != NULL){
         sscanf(buf, "%f\n",fdata+i);
         i++;
     }
@@ -918,6 +2626,11 @@ void set_preproc_param(struct preproc_param *p, char *type){
         p->hpfilt = PULS_HPFILT;
         p->lpfilt = PULS_LPFILT;
     }
+    else if(strcmp(type, "ecg")==0){
+        p->preproc = ECG_PREPROC;
+        p->hpfilt = ECG_HPFILT;
+        p->lpfilt = ECG_LPFILT;
+    }
     else{
         p->preproc = DEF_PREPROC;
         p->hpfilt = DEF_HPFILT;
@@ -30,9 +30,18 @@
 #include <sys/types.h>
 #include <math.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "ampdr.h"
 #include "filters.h"
+#include "plan.h"
+#include "pkindex.h"
+#include "ratestore.h"
+#include "lod.h"
+#include "spsc.h"
+#include "pkstats.h"
+#include "shmring.h"
+#include "txtcache.h"
 
 /*
  * Default AMPD parameters.
@@ -64,16 +73,67 @@
 #define DEF_N_BINS 50       // histogram bins for data flipping
 #define DEF_AUTOFLIP 0      // flip batch data along y axis if events
                             // are minima
+#define DEF_MAX_MEM 0       // memory budget in MB, 0 means half of RAM
+#define DEF_THREADS 0       // worker threads, 0 means number of cores
+#define DEF_INT16 0         // parse fixed point input to int16, int16 kernel
+#define DEF_APPROX 0        // approximate kernel for fast triage runs
+#define DEF_APPROX_CHECK 10 // check every nth approx batch with exact kernel
+#define DEF_REFINE 0        // recompute implausible batches with alternatives
+#define DEF_RATE_MIN 0      // plausible peak rate bounds per min, 0 is unset
+#define DEF_RATE_MAX 0
+/* refinement: a batch is suspicious if it has no peaks, no lambda, a rate
+ * out of the bounds or a peak distance stdev/mean above this */
+#define REFINE_MAX_CV 0.5
+#define REFINE_MIN_GAIN 0.05    // score gain needed to replace a neighbour
+#define REFINE_SCORE_MAX 1e9
+#define DEF_ADAPTIVE 0      // window length from the estimated peak period
+/* adaptive windows: the next window is this many mean peak distances long,
+ * in whole seconds, at least ADAPTIVE_MIN_LENGTH s and at most the batch
+ * length, which is also the length of the first window. Peaks are only kept
+ * from the core of the window, ADAPTIVE_MARGIN periods from both ends, as
+ * AMPD misses peaks close to the window ends */
+#define ADAPTIVE_PERIODS 12
+#define ADAPTIVE_MARGIN 2
+#define ADAPTIVE_MIN_LENGTH 4
+#define ADAPTIVE_ROWSUMS 8  // LMS row sums cached by each worker
+#define DEF_DETERMINISTIC 0 // same results for any thread count and SIMD
+/* deterministic adaptive runs: the data is split into this many segments,
+ * instead of one for each thread, as segment starts change the windows */
+#define DET_SEGMENTS 16
+/* pipeline: batches or lane groups queued to and from each worker */
+#define PIPE_RING 4
+/* input buffers of one item each, per worker. With one more for the reader
+ * these bound the memory and how far reading runs ahead of writing */
+#define PIPE_SLOTS 2
+#define PIPE_END -1         // pushed after the last item
+#define PIPE_FAILED -2      // pushed instead if the input cannot be read
 
 // Default AMPD parameters for respiration
 #define RESP_SAMPLING_RATE 100
 #define RESP_SIGMA_THRESHOLD 0.01
 #define RESP_PEAK_THRESHOLD 0.1
+#define RESP_RATE_MIN 30
+#define RESP_RATE_MAX 150
 
 // Default AMPD parameters for pulsoxymetry
 #define PULS_SAMPLING_RATE 100
 #define PULS_SIGMA_THRESHOLD 0.03
 #define PULS_PEAK_THRESHOLD 0.05
+#define PULS_RATE_MIN 100
+#define PULS_RATE_MAX 500
+
+// Default AMPD parameters for ECG, R peaks of rat ECG sampled at 1 kHz
+#define ECG_SAMPLING_RATE 1000
+#define ECG_BATCH_LENGTH 20
+#define ECG_SIGMA_THRESHOLD 0.03
+#define ECG_PEAK_THRESHOLD 0.08 // below the period at the highest rate
+#define ECG_RATE_MIN 200
+#define ECG_RATE_MAX 600
+/* lambda is at most the longest plausible period, and only the LMS rows up to
+ * ECG_ROWS_PERIODS times that are evaluated, so the cost of a batch grows
+ * linearly with its length instead of quadratically */
+#define ECG_ROWS_PERIODS 2
+#define ECG_ADAPTIVE 1      // window margins, no peaks lost at batch ends
 /***************************************************************************/
 /* Default preprocess parameters.
  * Preprocess does  the same on the batches as the utility program ampdpreproc
@@ -88,6 +148,11 @@
 #define PULS_HPFILT 2
 #define PULS_LPFILT -1
 
+// band-pass for the QRS complex, removes baseline wander and T waves
+#define ECG_PREPROC 1
+#define ECG_HPFILT 10
+#define ECG_LPFILT 30
+
 #define DEF_PREPROC 1
 #define DEF_HPFILT 0.1
 #define DEF_LPFILT -1
@@ -101,10 +166,16 @@
 #define DEF_OUTPUT_PEAKS 1
 // output metadata to file
 #define DEF_OUTPUT_META 1
+// output binary peak index for ampdquery
+#define DEF_OUTPUT_INDEX 1
+// output min/max level of detail pyramid of the raw data for plotting
+#define DEF_OUTPUT_LOD 0
 // output aux files, useful for troubleshooting
 #define DEF_OUTPUT_ALL 0
 // output local maxima scalogram
 #define DEF_OUTPUT_LMS 0
+// detect troughs as well as peaks, in the same LMS sweep
+#define DEF_OUTPUT_TROUGHS 0
 // TODO output plot images from aux data
 #define DEF_OUTPUT_IMG 0
 
@@ -124,6 +195,27 @@ struct meta_param{
     double batch_length;
     int total_batches;
     int total_peaks;
+    int total_troughs;
+    /* approx kernel error estimates, from batches checked with matfree */
+    int approx;
+    int approx_checked;
+    int approx_peak_delta;      // exact minus approx peaks, summed
+    int approx_exact_peaks;
+    int approx_lambda_delta_max;
+    double approx_lambda_err;   // mean estimated lambda uncertainty
+    /* lazy refinement */
+    int refine;
+    int refine_flagged;         // suspicious batches
+    int refine_recomputed;      // with neighbours
+    int refine_improved;        // replaced by an alternative
+    /* adaptive window length */
+    int adaptive;
+    double mean_window_length;  // seconds
+    int deterministic;
+    /* peak distances of the recording, and the quantiles of each window */
+    struct pk_stats *ipi;
+    struct batch_result *res;
+    int n_res;
 };
 
 // settings for preprocessing: smooothing and filtering
@@ -150,6 +242,123 @@ struct batch_param{
 
 
 };
+// result of a single batch, written to output files in batch order
+struct batch_result{
+
+    int ind;            // index of batch start in full data
+    int n;              // window length, ctx->n unless adaptive
+    int n_peaks;
+    int *peaks;         // peak indices within batch
+    int n_troughs;
+    int *troughs;       // trough indices within batch, if requested
+    int lambda;
+    int trough_lambda;
+    double peaks_per_min;
+    double mean_pk_dist;
+    double stdev_pk_dist;
+    int lambda_err;     // approx kernel lambda uncertainty
+    int exact_n_peaks;  // approx kernel checked with matfree, else -1
+    int exact_lambda;
+    int refined;        // alternative used by refinement, 0 is original
+    /* peak distances of the window, merged into the recording by the writer
+     * and freed, and their quantiles, see pkstats.h */
+    struct pk_stats *ipi;
+    double pk_dist_q[PKS_NQ];
+};
+
+// shared, read-only state of batch processing, except for res
+struct batch_ctx{
+
+    float *full_data;
+    int16_t *full_q;    // full data as fixed point, instead of full_data
+    double q_scale;     // full_q = full_data * q_scale
+    int datalen;
+    int n;              // samples per batch
+    int cycles;
+    int threads;
+    int lanes;          // batches per lane group, 1 means no lanes kernel
+    int scalar_kernel;  // for batches not in a lane group
+    int autoflip;
+    int troughs;        // detect troughs as well
+    int approx_check;   // check every nth approx batch with matfree, 0 is off
+    /* adaptive windows: each worker goes through segments of the data,
+     * their windows are stored in res from seg_base, then compacted */
+    int adaptive;
+    int min_n;          // shortest window
+    int segments;       // threads, or DET_SEGMENTS if deterministic
+    int deterministic;
+    int *seg_start;     // segments+1 sample indices
+    int *seg_base;
+    int *seg_count;
+    /* pipeline: work items are the lane groups, then the single batches.
+     * Item j goes to worker j % threads, reader and writer go in item order*/
+    int pipeline;
+    int groups;             // full lane groups
+    int items;
+    char *infile;           // parsed by the reader stage
+    struct spsc_ring *todo; // reader to each worker, items with their data
+    struct spsc_ring *done; // each worker to the writer, items computed
+    struct spsc_ring free_slots;// writer to the reader, input buffers written
+    float *pool;            // input buffers of lanes * n samples
+    int *item_slot;         // input buffer of each item
+    int next_item;          // writer only
+    int done_upto;          // writer only, batches below are computed
+    int read_len;           // samples parsed, -1 if infile cannot be opened
+    struct ampd_worker *w;
+    pthread_t *tid;
+    int n_bins;
+    char *aux_dir;
+    struct ampd_param *param;       // template, copied to each worker
+    struct batch_param *bparam;
+    struct preproc_param *pparam;
+    struct batch_result *res;       // one for each batch
+};
+
+// stream input, a text file or pipe, or a shared memory ring if shm is set
+struct stream_src{
+
+    FILE *fp;
+    struct shm_ring *shm;
+    int channel;            // of the ring
+
+};
+
+// per thread workspace
+struct ampd_worker{
+
+    int id;
+    struct batch_ctx *ctx;
+    struct ampd_param param;
+    struct batch_param bparam;
+    float *data;
+    struct fmtx *lms;       // dense kernel only
+    struct bmtx *blms;      // bitpack kernel only
+    int16_t *qdata;         // int16 kernel only
+    /* LMS row sums of recent window lengths, adaptive only */
+    double *rowsum[ADAPTIVE_ROWSUMS];
+    int rowsum_n[ADAPTIVE_ROWSUMS];
+    int rowsum_next;        // slot replaced next
+    double *gamma;
+    double *sigma;
+    int *peaks;
+    int *bins;
+    /* same for troughs, if requested */
+    struct ampd_param tparam;
+    struct bmtx *tblms;
+    double *tgamma;
+    double *tsigma;
+    int *troughs;
+    /* lanes kernel: windows are prepared one by one, then interleaved */
+    int lanes;
+    float *ldata;               // planar, lanes * n
+    float *data_il;             // interleaved, lanes * n
+    struct ampd_param *lparam;
+    double *lgamma;
+    double *lsigma;
+    int **lpks;
+    int *ln_pks;
+};
+
 //TODO
 // this is pretty much unused, cleaup or finish needed
 struct ampd_config{
@@ -196,6 +405,10 @@ int fetch_data(char *path, float *data, int n, int ind, int n_zpad);
 int fetch_data_buff(float *full_data, int len,float *data,int n,int ind,int n_zpad);
 /* load data from file to memory*/
 void load_from_file(char *path, float *full_data, int n);
+/* load fixed point data as int16, return scale or -1*/
+double load_from_file_i16(char *path, int16_t *q, int n);
+int fetch_data_buff_i16(int16_t *q, int len, double scale, float *data, int n,
+                        int ind);
 
 /* make histogram to flip the data in case inhales are minima*/
 void histogram(float *data, int n, int *bins, int n_bins);
@@ -208,11 +421,65 @@ void save_data(void *data, int n, char *path, char *type);
 void save_rate(double rate, char *path);
 void save_ampd_param(struct ampd_param *param, char *path);
 void save_batch_param(struct batch_param *p, char *path);
-void save_meta(struct meta_param *p, struct preproc_param *pp, char *path);
+void save_meta(struct meta_param *p, struct preproc_param *pp,
+               struct ampd_plan *plan, char *path);
+void fprintf_pk_stats(FILE *fp, struct meta_param *p);
 
 int count_char(char *path, char cc);
+
+/* batch processing on worker threads*/
+int init_worker(struct ampd_worker *w, struct batch_ctx *ctx, int id);
+void free_worker(struct ampd_worker *w);
+void prep_batch(struct ampd_worker *w, int i, float *data,
+                struct ampd_param *param);
+void store_batch(struct ampd_worker *w, int i, float *data,
+                 struct ampd_param *param, double *gamma, double *sigma,
+                 int *peaks, int n_peaks, int n_troughs);
+/* window start of batch i, peaks of the overlap with the batch before are
+ * dropped from pks*/
+int batch_overlap(struct batch_ctx *ctx, int i, int *pks, int *count, int *len);
+/* same for a window of n samples from ind, stored as result i*/
+void prep_window(struct ampd_worker *w, int i, int ind, int n, float *data,
+                 struct ampd_param *param);
+void store_window(struct ampd_worker *w, int i, int ind, int n, float *data,
+                  struct ampd_param *param, double *gamma, double *sigma,
+                  int *peaks, int n_peaks, int n_troughs);
+void window_pk_stats(struct batch_result *res, double fs);
+int run_kernel(struct ampd_worker *w, float *data, int n,
+               struct ampd_param *param);
+void check_approx(struct ampd_worker *w, int i, float *data, int n,
+                  struct ampd_param *param, int off, int core);
+void process_batch(struct ampd_worker *w, int i);
+void process_lanes(struct ampd_worker *w, int i0);
+void init_items(struct batch_ctx *ctx);
+int item_batches(struct batch_ctx *ctx, int j, int *count);
+void process_item(struct ampd_worker *w, int j);
+void *batch_worker(void *arg);
+/* reader, workers and writer stages connected by SPSC rings*/
+void *read_worker(void *arg);
+float *pipe_data(struct batch_ctx *ctx, int i);
+void *pipeline_worker(void *arg);
+int start_pipeline(struct batch_ctx *ctx);
+int wait_batch(struct batch_ctx *ctx, int i);
+void finish_pipeline(struct batch_ctx *ctx);
+/* read and process the input as it arrives, eg: from a FIFO or stdin*/
+int stream_batches(struct batch_ctx *ctx, struct stream_src *src,
+                   FILE *fp_peaks, FILE *fp_rate, struct pkx_writer *pkx,
+                   struct pk_stats *ipi, int *batches, int *n_peaks);
+int stream_read(struct stream_src *src, float *dst, int max);
+/* adaptive window length, one data segment per worker*/
+int init_segments(struct batch_ctx *ctx);
+int next_window_length(struct batch_ctx *ctx, double mean_pk_dist, int rem,
+                       int *margin);
+void *adaptive_worker(void *arg);
+int run_batches(struct batch_ctx *ctx);
+/* recompute suspicious batches with alternative settings */
+double batch_score(struct batch_result *res, struct ampd_param *p);
+int refine_batches(struct batch_ctx *ctx, struct meta_param *mp);
 /* extract filename from full path and omitting file extension*/
 void extract_raw_filename(char *path, char *filename, int bufsize);
+/* find study ID (s_...) in paths for the rate store*/
+void extract_study_id(char *infile, char *outdir, char *study, int bufsize);
 
 // UNUSED
 /*-----------------------------------------------------------------*/
@@ -3,7 +3,9 @@
 #include <getopt.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "filters.h"
+#include "txtcache.h"
 
 #define V_MIN 9
 #define V_MAJ 0
@@ -12,9 +14,46 @@
 #define DEF_OUTPUT_PATH "ampdprerpoc.out"
 #define DEF_SMOOTH_WINDOW 2
 #define DEF_SAMPLING_RATE 200
+#define DEF_CHUNK 65536     // samples per chunk in streaming mode
+#define QUEUE_LEN 4         // chunks in flight between pipeline stages
+#define LINE_LEN 32
 
 static int verbose_flag;
 static int smooth_only_flag;
+static int stream_flag;
+static int cache_flag;
+
+/* chunk of samples passed between pipeline stages, n=0 is end of data */
+struct chunk{
+
+    float *data;
+    int n;
+
+};
+
+/* bounded FIFO of chunks from one thread to another */
+struct chunk_queue{
+
+    struct chunk slot[QUEUE_LEN];
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+};
+
+/* state shared by the streaming stages */
+struct stream_ctx{
+
+    FILE *in;
+    FILE *out;
+    int chunk;          // samples per chunk
+    int fprec;          // output precision, from the first input line
+    int err;
+    struct chunk_queue raw;     // reader -> filters
+    struct chunk_queue done;    // filters -> writer
+
+};
 
 void printf_version(){
 
@@ -37,13 +76,22 @@ void printf_help(){
            "-s --sampling-rate=[SAMPLING_RATE]\n"
            "-h --highpass-cutoff=[HIGPASS_CUTOFF]\n"
            "-l --lowpass-cutoff=[LOWPASS_CUTOFF]\n"
+           "--stream              process the data in chunks with constant\n"
+           "                      memory, reading, filtering and writing in\n"
+           "                      parallel. Output is the same. '-' as infile\n"
+           "                      or outfile is stdin or stdout, and implies\n"
+           "                      --stream\n"
+           "--chunk=[SAMPLES]     chunk length for --stream, default 65536\n"
+           "--cache               keep the parsed input in [INFILE].ampdc and\n"
+           "                      map it on later runs instead of parsing, made\n"
+           "                      again if the input changed. Not with --stream\n"
            "--verbose\n"
            "--help\n"
            );
 }
-/* Count occurrences of a character ina  file. Useful for counting lines*/
-int count_char(char *path, char cc);
 int get_fprec_from_str(char *str);
+int run_stream(char *infile, char *outfile, int chunk, double sampling_rate,
+               double highpass_cutoff, double lowpass_cutoff, int w);
 
 int main(int argc, char **argv){
 
@@ -64,6 +112,7 @@ int main(int argc, char **argv){
 
     // moving avg
     int w = DEF_SMOOTH_WINDOW;
+    int chunk = DEF_CHUNK;
 
     if(argc == 1){
         printf_help();
@@ -84,6 +133,9 @@ int main(int argc, char **argv){
             {"lowpass-freq", required_argument, 0, 'l'},
             {"highpass-freq", required_argument, 0, 'h'},
             {"smooth-only",no_argument, &smooth_only_flag, 2},
+            {"stream",no_argument, 0, 3},
+            {"chunk",required_argument, 0, 4},
+            {"cache",no_argument, 0, 5},
             {0,0,0,0}
         };
 
@@ -121,6 +173,15 @@ int main(int argc, char **argv){
             case 2:
                 smooth_only_flag = 1;
                 break;
+            case 3:
+                stream_flag = 1;
+                break;
+            case 4:
+                chunk = atoi(optarg);
+                break;
+            case 5:
+                cache_flag = 1;
+                break;
 
         }
     }
@@ -129,6 +190,14 @@ int main(int argc, char **argv){
         fprintf(stderr, "No input file given, exiting...\n");
         exit(1);
     }
+    if(strcmp(infile,"-")==0 || strcmp(outfile,"-")==0){
+        stream_flag = 1;
+        verbose_fs = stderr;
+    }
+    if(stream_flag == 1 && chunk <= w){
+        fprintf(stderr, "chunk should be longer than %d\n",w);
+        exit(1);
+    }
     if(verbose_flag == 1){
         fprintf(verbose_fs, "verbose=%d\n",verbose_flag);
         fprintf(verbose_fs, "sampling_rate=%lf\n",sampling_rate);
@@ -137,10 +206,11 @@ int main(int argc, char **argv){
         fprintf(verbose_fs, "smooth_only=%d\n",smooth_only_flag);
         fprintf(verbose_fs, "infile=%s\n",infile);
         fprintf(verbose_fs, "outfile=%s\n",outfile);
+        fprintf(verbose_fs, "stream=%d\n",stream_flag);
     }
-    /* count data length*/
-    n = count_char(infile, '\n');
-    data = malloc(sizeof(float) * n);
+    if(stream_flag == 1)
+        return run_stream(infile, outfile, chunk, sampling_rate,
+                          highpass_cutoff, lowpass_cutoff, w);
     /* reading input data */
     fp = fopen(infile, "r");
     if(fp == NULL){
@@ -149,13 +219,28 @@ int main(int argc, char **argv){
     }
     char buf[32];
     int i = 0;
-    while(fgets(buf, 32, fp)){
-        if(i==0){
-            // check precision, and use this later for output
+    struct txc txc;
+    if(cache_flag == 1 && txc_open(infile, &txc) == 0){
+        // the data is filtered in place, copy it from the mapped cache
+        n = (int)txc.hdr->rows;
+        data = malloc(sizeof(float) * n);
+        memcpy(data, txc_column(&txc, 0), sizeof(float) * n);
+        txc_close(&txc);
+        // precision from the first row
+        if(txc_next_row(buf, 32, fp))
             fprec = get_fprec_from_str(buf);
+    } else {
+        /* count data length*/
+        n = txc_count_rows(infile);
+        data = malloc(sizeof(float) * n);
+        while(i < n && txc_next_row(buf, 32, fp)){
+            if(i==0){
+                // check precision, and use this later for output
+                fprec = get_fprec_from_str(buf);
+            }
+            sscanf(buf, "%f\n",&data[i]);
+            i++;
         }
-        sscanf(buf, "%f\n",&data[i]);
-        i++;
     }
     fclose(fp);
     /* Apply smoothing*/
@@ -181,25 +266,177 @@ int main(int argc, char **argv){
     return 0;
 }
 
+void queue_init(struct chunk_queue *q){
+
+    memset(q, 0, sizeof(struct chunk_queue));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+}
+
+void queue_destroy(struct chunk_queue *q){
+
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+}
 /**
- * Count occurrences of a character in a file.
- *
+ * Add a chunk to the queue, wait while it is full.
  */
-int count_char(char *path, char cc){
-    int count = 0;
-    FILE *fp;
-    char c;
-    fp = fopen(path, "r");
-    if(fp == NULL){
-        perror("fopen");
-        exit(EXIT_FAILURE);
+void queue_push(struct chunk_queue *q, float *data, int n){
+
+    pthread_mutex_lock(&q->lock);
+    while(q->count == QUEUE_LEN)
+        pthread_cond_wait(&q->cond, &q->lock);
+    q->slot[(q->head + q->count) % QUEUE_LEN].data = data;
+    q->slot[(q->head + q->count) % QUEUE_LEN].n = n;
+    q->count++;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+/**
+ * Take the oldest chunk from the queue, wait while it is empty.
+ */
+struct chunk queue_pop(struct chunk_queue *q){
+
+    struct chunk c;
+    pthread_mutex_lock(&q->lock);
+    while(q->count == 0)
+        pthread_cond_wait(&q->cond, &q->lock);
+    c = q->slot[q->head];
+    q->head = (q->head + 1) % QUEUE_LEN;
+    q->count--;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return c;
+}
+/**
+ * Reader stage: parse lines into chunks. The output precision is taken from
+ * the first line before the first chunk is passed on.
+ */
+void *stream_reader(void *arg){
+
+    struct stream_ctx *ctx = (struct stream_ctx *)arg;
+    char buf[LINE_LEN];
+    float *data;
+    int n = 0;
+    int first = 1;
+    data = malloc(sizeof(float) * ctx->chunk);
+    while(txc_next_row(buf, LINE_LEN, ctx->in)){
+        if(first == 1){
+            ctx->fprec = get_fprec_from_str(buf);
+            first = 0;
+        }
+        sscanf(buf, "%f\n",&data[n]);
+        n++;
+        if(n == ctx->chunk){
+            queue_push(&ctx->raw, data, n);
+            data = malloc(sizeof(float) * ctx->chunk);
+            n = 0;
+        }
     }
-    for (c = getc(fp); c != EOF; c = getc(fp))
-        if(c == cc)
-            count++;
-    fclose(fp);
-    return count;
+    if(n > 0)
+        queue_push(&ctx->raw, data, n);
+    else
+        free(data);
+    queue_push(&ctx->raw, NULL, 0);
+    return NULL;
+}
+/**
+ * Writer stage: format chunks in order until the end of data.
+ */
+void *stream_writer(void *arg){
+
+    struct stream_ctx *ctx = (struct stream_ctx *)arg;
+    struct chunk c;
+    int i;
+    while(1){
+        c = queue_pop(&ctx->done);
+        if(c.n == 0)
+            break;
+        for(i=0; i<c.n; i++)
+            fprintf(ctx->out, "%.*f\n",ctx->fprec, c.data[i]);
+        free(c.data);
+    }
+    return NULL;
+}
+/**
+ * Streaming mode: the reader and writer run on their own threads, smoothing
+ * and filters on the calling thread with their state carried from chunk to
+ * chunk. At most 2*QUEUE_LEN+3 chunks are allocated at a time, whatever the
+ * data length. Return 0 on success.
+ */
+int run_stream(char *infile, char *outfile, int chunk, double sampling_rate,
+               double highpass_cutoff, double lowpass_cutoff, int w){
+
+    struct stream_ctx ctx;
+    struct mavg_state ms;
+    struct rcfilt_state hp, lp;
+    struct chunk c;
+    pthread_t reader, writer;
+    float *out;
+    int m;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.chunk = chunk;
+    ctx.in = (strcmp(infile,"-")==0) ? stdin : fopen(infile, "r");
+    if(ctx.in == NULL){
+        fprintf(stderr, "Cannot open file on path '%s'\n",infile);
+        exit(1);
+    }
+    ctx.out = (strcmp(outfile,"-")==0) ? stdout : fopen(outfile, "w+");
+    if(ctx.out == NULL){
+        fprintf(stderr, "cannot open file for writing '%s'\n",outfile);
+        exit(1);
+    }
+    queue_init(&ctx.raw);
+    queue_init(&ctx.done);
+    if(movingavg_init(&ms, w, chunk) != 0){
+        fprintf(stderr, "cannot allocate smoothing buffer\n");
+        exit(1);
+    }
+    tdhpfilt_init(&hp, sampling_rate, highpass_cutoff);
+    tdlpfilt_init(&lp, sampling_rate, lowpass_cutoff);
+    if(pthread_create(&reader, NULL, stream_reader, &ctx) != 0 ||
+       pthread_create(&writer, NULL, stream_writer, &ctx) != 0){
+        perror("pthread_create");
+        exit(1);
+    }
+    while(1){
+        c = queue_pop(&ctx.raw);
+        out = malloc(sizeof(float) * chunk);
+        if(c.n == 0)
+            m = movingavg_flush(&ms, out);
+        else
+            m = movingavg_chunk(&ms, c.data, c.n, out);
+        if(m < 0){
+            fprintf(stderr, "input is shorter than the smoothing window\n");
+            ctx.err = 1;
+            m = 0;
+        }
+        if(highpass_cutoff != 0.0)
+            tdhpfilt_chunk(&hp, out, m);
+        if(lowpass_cutoff != 0.0)
+            tdlpfilt_chunk(&lp, out, m);
+        if(m > 0)
+            queue_push(&ctx.done, out, m);
+        else
+            free(out);
+        if(c.n == 0)
+            break;
+        free(c.data);
+    }
+    queue_push(&ctx.done, NULL, 0);
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    movingavg_free(&ms);
+    queue_destroy(&ctx.raw);
+    queue_destroy(&ctx.done);
+    if(ctx.in != stdin)
+        fclose(ctx.in);
+    if(ctx.out != stdout)
+        fclose(ctx.out);
+    return ctx.err;
 }
+
 /**
  * count numbers after decimal separator
  * example input: "74.45673", output=5
@@ -0,0 +1,148 @@
+/*
+ * ampdquery.c
+ *
+ * Utility program to answer peak count and rate queries from the binary peak
+ * index (.pkx) written by ampd, without loading the .peaks text file.
+ *
+ * Usage from command line:
+ * ampdquery -i [index] [t0 t1] ...
+ * Optional inputs: -q [file] : read t0 t1 pairs from file, '-' is stdin
+ *                  -w [list] : rate rollups in windows of comma separated
+ *                              seconds, eg: -w 10,60,300
+ *                  -s        : print summary
+ *                  -h        : print help
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "pkindex.h"
+
+#define MAX_LEN 1024
+#define MAX_WINDOWS 16
+
+/**
+ * Print general description of input options.
+ */
+void printf_help(){
+
+    printf(
+    "ampdquery\n"
+    "=========\n"
+    "Command line utility to count peaks and peak rates in time ranges from\n"
+    "the binary peak index written by ampd. Each query takes O(log n) time.\n"
+    "Query results are printed as: t0 t1 peaks peaks_per_min\n"
+    "\n"
+    "Basic usage:\n"
+    "ampdquery -i [index] [t0 t1] ...\n"
+    "\n"
+    "Input options:\n"
+    "-h                 print help\n"
+    "-i [index]         path/to/ampd/output.pkx\n"
+    "-q [file]          read t0 t1 pairs in seconds from file, '-' is stdin\n"
+    "-w [list]          rate rollups in windows of comma separated seconds\n"
+    "-s                 print number of peaks, duration and mean rate\n"
+    );
+}
+
+void printf_query(struct pkx_index *x, double t0, double t1){
+
+    printf("%.3lf\t%.3lf\t%d\t%.3lf\n",t0, t1, pkx_count(x, t0, t1),
+           pkx_rate(x, t0, t1));
+}
+/**
+ * Print peak count and rate in consecutive windows of w seconds.
+ */
+void printf_rollup(struct pkx_index *x, double w){
+
+    int i, n;
+    int *counts;
+    double dur = x->hdr.datalen / x->hdr.sampling_rate;
+    n = pkx_rollup(x, w, NULL, 0);
+    counts = malloc(sizeof(int) * (n + 1));
+    pkx_rollup(x, w, counts, n);
+    printf("# window=%lf\n",w);
+    for(i=0; i<n; i++){
+        // last window may be shorter
+        printf("%.3lf\t%d\t%.3lf\n",i*w, counts[i],
+               counts[i] / (((i+1)*w > dur ? dur - i*w : w)) * 60.0);
+    }
+    free(counts);
+}
+
+int main(int argc, char **argv){
+
+    int opt, i;
+    int n_windows = 0;
+    int summary = 0;
+    double windows[MAX_WINDOWS];
+    double t0, t1, dur;
+    char infile[MAX_LEN] = {0};
+    char qfile[MAX_LEN] = {0};
+    char *tok;
+    FILE *fp;
+    struct pkx_index *x;
+
+    while((opt = getopt(argc, argv, "hi:q:w:s")) != -1){
+
+        switch(opt){
+            case 'h':
+                printf_help();
+                return 0;
+            case 'i':
+                strcpy(infile, optarg);
+                break;
+            case 'q':
+                strcpy(qfile, optarg);
+                break;
+            case 'w':
+                tok = strtok(optarg, ",");
+                while(tok != NULL && n_windows < MAX_WINDOWS){
+                    windows[n_windows++] = atof(tok);
+                    tok = strtok(NULL, ",");
+                }
+                break;
+            case 's':
+                summary = 1;
+                break;
+        }
+    }
+    if(strcmp(infile,"")==0){
+        fprintf(stderr,"No index file given.\n\n");
+        printf_help();
+        exit(EXIT_FAILURE);
+    }
+    if((argc - optind) % 2 != 0){
+        fprintf(stderr,"Time ranges should be given as t0 t1 pairs.\n");
+        exit(EXIT_FAILURE);
+    }
+    x = pkx_load(infile);
+    if(x == NULL)
+        exit(EXIT_FAILURE);
+    if(summary == 1){
+        dur = x->hdr.datalen / x->hdr.sampling_rate;
+        printf("n_peaks=%u\n",x->hdr.n_peaks);
+        printf("duration=%lf\n",dur);
+        printf("sampling_rate=%lf\n",x->hdr.sampling_rate);
+        printf("peaks_per_min=%lf\n",pkx_rate(x, 0, dur));
+    }
+    for(i=optind; i+1<argc; i+=2)
+        printf_query(x, atof(argv[i]), atof(argv[i+1]));
+    if(strcmp(qfile,"")!=0){
+        fp = (strcmp(qfile,"-")==0) ? stdin : fopen(qfile, "r");
+        if(fp == NULL){
+            perror("fopen");
+            exit(EXIT_FAILURE);
+        }
+        while(fscanf(fp, "%lf %lf", &t0, &t1) == 2)
+            printf_query(x, t0, t1);
+        if(fp != stdin)
+            fclose(fp);
+    }
+    for(i=0; i<n_windows; i++)
+        printf_rollup(x, windows[i]);
+    pkx_free(x);
+    return 0;
+}
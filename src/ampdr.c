@@ -10,6 +10,129 @@
 
 #include "ampdr.h"
 
+/**
+ * Random part of the non-maxima LMS entries, uniform in [0,1]. Computed from
+ * a hash of the LMS position instead of rand(), so every kernel and every
+ * thread sees the same value at the same position, in any evaluation order.
+ */
+static inline float lms_rnd(unsigned int i, unsigned int k){
+
+    uint32_t h = i * 0x9E3779B1u ^ (k + 0x7F4A7C15u) * 0x85EBCA77u;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 12;
+    h *= 0x297A2D39u;
+    h ^= h >> 15;
+    return (float)(h >> 8) / (float)(1 << 24);
+}
+/**
+ * LMS value at a position which is not a local maximum.
+ */
+static inline float lms_val(int i, int k, double rnd_factor, double a){
+
+    return (float)(lms_rnd(i, k) * (float)rnd_factor + a);
+}
+/**
+ * Local maximum condition at LMS column i, row k. Column i corresponds to
+ * data[i-1], compared to its neighbours k samples away. Positions where a
+ * neighbour would fall outside the data are not maxima.
+ */
+static inline int lms_ismax(float *data, int n, int i, int k){
+
+    if(k == 0 || i <= k || i + k > n)
+        return 0;
+    return (data[i-1] > data[i-k-1] && data[i-1] > data[i+k-1]);
+}
+/**
+ * Local minimum condition, same as lms_ismax for the opposite polarity.
+ */
+static inline int lms_ismin(float *data, int n, int i, int k){
+
+    if(k == 0 || i <= k || i + k > n)
+        return 0;
+    return (data[i-1] < data[i-k-1] && data[i-1] < data[i+k-1]);
+}
+/**
+ * Sum of x[0..n-1] in a fixed shape: blocks of AMPD_SUM_BLOCK terms are summed
+ * in order, then the two halves, split at a block boundary, are summed in the
+ * same way and added. The shape depends only on n, so the result stays the
+ * same however the blocks are shared between threads or vector lanes.
+ */
+double pairwise_sum(const double *x, int n){
+
+    int i, h;
+    double s = 0.0;
+    if(n <= AMPD_SUM_BLOCK){
+        for(i=0; i<n; i++)
+            s += x[i];
+        return s;
+    }
+    h = (n / 2 + AMPD_SUM_BLOCK - 1) / AMPD_SUM_BLOCK * AMPD_SUM_BLOCK;
+    return pairwise_sum(x, h) + pairwise_sum(x + h, n - h);
+}
+/**
+ * Column-wise deviation of the rescaled LMS, over rows 1..lambda-1 of col.
+ * Ignoring the 1st row gives better results. With det, the sums are pairwise
+ * and col is overwritten with the deviations.
+ */
+static double column_sigma(double *col, int lambda, int det){
+
+    int k;
+    double sum_m_i = 0.0;
+    double sigma = 0.0;
+    if(det == 1 && lambda > 1){
+        sum_m_i = pairwise_sum(col + 1, lambda - 1) / (double)lambda;
+        for(k=1; k<lambda; k++)
+            col[k] = fabs(col[k] - sum_m_i);
+        return pairwise_sum(col + 1, lambda - 1) / (double)(lambda-1);
+    }
+    for(k=1; k<lambda; k++)
+        sum_m_i += col[k] / (double) lambda;
+    for(k=1; k<lambda; k++)
+        sigma += fabs(col[k] - sum_m_i) / (double)(lambda-1);
+    return sigma;
+}
+/**
+ * Return the row sums for a batch of n samples, either the precomputed ones
+ * from param or newly calculated, in which case *own is set and should be
+ * freed by the caller.
+ */
+static const double *get_rowsum(int n, struct ampd_param *param, double **own){
+
+    *own = NULL;
+    if(param->rowsum != NULL && param->rowsum_n == n)
+        return param->rowsum;
+    *own = lms_rowsum(n, param);
+    return *own;
+}
+/**
+ * Find lambda from gamma, using the manual lambda threshold if it is set.
+ */
+static int find_lambda(double *gamma, int l, struct ampd_param *param){
+
+    int lambda_max = l;
+    if (param->lambda_max != 0)
+        lambda_max = param->lambda_max;
+    param->lambda = more_sophisticated_way_to_lambda(gamma, l, lambda_max);
+    return param->lambda;
+}
+/**
+ * Common end of the kernels: pick peaks from sigma, calculate peak distance
+ * statistics. If lambda was not found return 0 and reset peaks to 0.
+ */
+static int finish_peaks(double *sigma, int n, struct ampd_param *param,
+                        int *pks){
+
+    int n_pks;
+    n_pks = pick_peaks(sigma, n, param, pks);
+    peak_dist_stats(pks, n_pks, param);
+    if(param->lambda == 1){
+        n_pks = 0;
+        memset(pks, 0, sizeof(int) * n);
+    }
+    return n_pks;
+}
+
 /**
  * Main routine for peak detection on a dataseries. 
  * The input data should be preprocessed first. Specifically, a linear
@@ -44,7 +167,6 @@ int ampdcpu(float *data, int n, struct ampd_param *param,
      * lms, gam, sig, pks
      */
     int i, k;
-    int ret;
     int null_inputs[4] = {0,0,0,0}; 
     if(lms == NULL)
         null_inputs[0] = 1;
@@ -56,128 +178,706 @@ int ampdcpu(float *data, int n, struct ampd_param *param,
         null_inputs[3] = 1;
 
     /*
-     * calculating LMS
+     * calculating LMS and gamma in the same pass, row by row
      *
      */
-    int l = (int)ceil(n/2)-1; // rows of LMS
-    float rnd;
+    int l = lms_rows(n, param); // rows of LMS
     double rnd_factor = param->rnd_factor;
     double a = param->a;
+    float *row;
+    const double *rowsum;
+    double *own_rowsum;
+    double m;
     if(null_inputs[0] == 1){ 
         // setup lms struct if nullpointer was given as input
         lms = malloc_fmtx(l, n);
     }
-    for(i=0; i<n; i++){
-        for(k=0; k<l; k++){
-            rnd = (float) rand() / (float)(RAND_MAX-1) * (float)rnd_factor;
-            if(i<k || i>n-k+1){
-                lms->data[k][i] = rnd + a;
-                continue;
-            }
-            if(data[i-1] > data[i-k-1] && data[i-1] > data[i+k-1])
-                lms->data[k][i] = 0.0;
-            else
-                lms->data[k][i] = rnd + a;
-        }
-    }
-    /*
-     * calculating gamma, and find its global minimum, lambda
-     */
-    double min = 0.0;
-    int lambda = 0;
-    int lambda_max = l; //TODO constrain l to lambda_max to reduce computation
     if(null_inputs[1] == 1){
         gamma = malloc(sizeof(double) * l);
     }
-    for(k=0; k<lambda_max; k++){
-        gamma[k] = 0.0;
+    rowsum = get_rowsum(n, param, &own_rowsum);
+    for(k=0; k<l; k++){
+        row = lms->data[k];
+        m = 0.0;
         for(i=0; i<n; i++){
-            gamma[k] += lms->data[k][i];
-        }    
-    }
-    // manually threshold lambda
-    if (param->lambda_max != 0){
-        lambda_max = param->lambda_max;
-    }
-    // TODO dlete, as it is useless?
-    // finding lambda the easy way
-    for(k=0; k<lambda_max; k++){
-        if(k==1)
-            min = gamma[0]; // set first
-        if(gamma[k] < min){
-            min = gamma[k];
-            lambda = k;
+            row[i] = lms_val(i, k, rnd_factor, a);
+            if(lms_ismax(data, n, i, k)){
+                m += row[i];
+                row[i] = 0.0;
+            }
         }
+        gamma[k] = rowsum[k] - m;
     }
-    // more sophisticated way to find lambda, if global minimum is different
-    lambda = more_sophisticated_way_to_lambda(gamma, l, lambda_max);
-    param->lambda = lambda;
+    free(own_rowsum);
+    int lambda = find_lambda(gamma, l, param);
 
     /*
      * calculating sigma and find the peaks
      */
-    double sum_m_i;
-    double sum_outer;
-    double sigma_thresh = param->sigma_thresh;
-    int ind_thresh = (int)(param->peak_thresh * param->sampling_rate);
-    int n_pks = 0; int j=0;
+    int n_pks;
+    double *col = malloc(sizeof(double) * (lambda > 0 ? lambda : 1));
     if(null_inputs[2] == 1)
         sigma = malloc(sizeof(double) * n);
     if(null_inputs[3] == 1)
         pks = malloc(sizeof(int)*n);
 
     for(i=0; i<n; i++){
-        sigma[i] = 0.0;
-        sum_m_i = 0.0;
-        for(k=1; k<lambda; k++) //ignoring the 1st row gives better results
-            sum_m_i += lms->data[k][i] / (double) lambda;
         for(k=1; k<lambda; k++)
-            sigma[i] += sqrt(pow(lms->data[k][i]-sum_m_i,2)) / (double)(lambda-1);
-        // check for peak
-        if(sigma[i] < sigma_thresh){
-            if(i - pks[j-1] > ind_thresh){
-                pks[j] = i;
-                j++;
+            col[k] = lms->data[k][i];
+        sigma[i] = column_sigma(col, lambda, param->deterministic);
+    }
+    free(col);
+    n_pks = finish_peaks(sigma, n, param, pks);
+    // free memory if aux output is not needed
+    if(null_inputs[0] == 1)
+        free_fmtx(lms);
+    if(null_inputs[1] == 1)
+        free(gamma);
+    if(null_inputs[2] == 1)
+        free(sigma);
+    if(null_inputs[3] == 1)
+        free(pks);
+    return n_pks;
+}
+/**
+ * Same as ampdcpu, but the LMS is kept as a bit matrix: only the local
+ * maximum condition is stored, the random part of the non-maxima entries
+ * is regenerated from lms_rnd when needed. Uses 1/32 of the memory of the
+ * dense LMS. Nullpointer inputs are handled the same way as in ampdcpu.
+ */
+int ampdcpu_bp(float *data, int n, struct ampd_param *param,
+            struct bmtx *lms, double *gamma, double *sigma, int *pks){
+
+    int i, k;
+    int null_inputs[4] = {0,0,0,0};
+    if(lms == NULL)
+        null_inputs[0] = 1;
+    if(gamma == NULL)
+        null_inputs[1] = 1;
+    if(sigma == NULL)
+        null_inputs[2] = 1;
+    if(pks == NULL)
+        null_inputs[3] = 1;
+
+    int l = lms_rows(n, param);
+    double rnd_factor = param->rnd_factor;
+    double a = param->a;
+    uint64_t *row;
+    const double *rowsum;
+    double *own_rowsum;
+    double m;
+    if(null_inputs[0] == 1)
+        lms = malloc_bmtx(l, n);
+    if(null_inputs[1] == 1)
+        gamma = malloc(sizeof(double) * l);
+    rowsum = get_rowsum(n, param, &own_rowsum);
+    for(k=0; k<l; k++){
+        row = lms->data + (size_t)k * lms->words;
+        memset(row, 0, sizeof(uint64_t) * lms->words);
+        m = 0.0;
+        for(i=k+1; i<=n-k; i++){
+            if(data[i-1] > data[i-k-1] && data[i-1] > data[i+k-1]){
+                row[i >> 6] |= (uint64_t)1 << (i & 63);
+                m += lms_val(i, k, rnd_factor, a);
             }
+        }
+        gamma[k] = rowsum[k] - m;
+    }
+    free(own_rowsum);
+    int lambda = find_lambda(gamma, l, param);
+
+    int n_pks;
+    double *col = malloc(sizeof(double) * (lambda > 0 ? lambda : 1));
+    if(null_inputs[2] == 1)
+        sigma = malloc(sizeof(double) * n);
+    if(null_inputs[3] == 1)
+        pks = malloc(sizeof(int)*n);
+    for(i=0; i<n; i++){
+        for(k=1; k<lambda; k++){
+            row = lms->data + (size_t)k * lms->words;
+            if(row[i >> 6] & ((uint64_t)1 << (i & 63)))
+                col[k] = 0.0;
             else
+                col[k] = lms_val(i, k, rnd_factor, a);
+        }
+        sigma[i] = column_sigma(col, lambda, param->deterministic);
+    }
+    free(col);
+    n_pks = finish_peaks(sigma, n, param, pks);
+    if(null_inputs[0] == 1)
+        free_bmtx(lms);
+    if(null_inputs[1] == 1)
+        free(gamma);
+    if(null_inputs[2] == 1)
+        free(sigma);
+    if(null_inputs[3] == 1)
+        free(pks);
+    return n_pks;
+}
+/**
+ * Matrix free version of ampdcpu. The LMS is never stored, the local maximum
+ * condition is evaluated once for gamma and once more for sigma, but only
+ * for the rows below lambda. Memory use is linear in n.
+ */
+int ampdcpu_mf(float *data, int n, struct ampd_param *param,
+            double *gamma, double *sigma, int *pks){
+
+    int i, k;
+    int null_inputs[3] = {0,0,0};
+    if(gamma == NULL)
+        null_inputs[0] = 1;
+    if(sigma == NULL)
+        null_inputs[1] = 1;
+    if(pks == NULL)
+        null_inputs[2] = 1;
+
+    int l = lms_rows(n, param);
+    double rnd_factor = param->rnd_factor;
+    double a = param->a;
+    const double *rowsum;
+    double *own_rowsum;
+    double m;
+    if(null_inputs[0] == 1)
+        gamma = malloc(sizeof(double) * l);
+    rowsum = get_rowsum(n, param, &own_rowsum);
+    for(k=0; k<l; k++){
+        m = 0.0;
+        for(i=k+1; i<=n-k; i++){
+            if(data[i-1] > data[i-k-1] && data[i-1] > data[i+k-1])
+                m += lms_val(i, k, rnd_factor, a);
+        }
+        gamma[k] = rowsum[k] - m;
+    }
+    free(own_rowsum);
+    int lambda = find_lambda(gamma, l, param);
+
+    int n_pks;
+    double *col = malloc(sizeof(double) * (lambda > 0 ? lambda : 1));
+    if(null_inputs[1] == 1)
+        sigma = malloc(sizeof(double) * n);
+    if(null_inputs[2] == 1)
+        pks = malloc(sizeof(int)*n);
+    for(i=0; i<n; i++){
+        for(k=1; k<lambda; k++){
+            if(lms_ismax(data, n, i, k))
+                col[k] = 0.0;
+            else
+                col[k] = lms_val(i, k, rnd_factor, a);
+        }
+        sigma[i] = column_sigma(col, lambda, param->deterministic);
+    }
+    free(col);
+    n_pks = finish_peaks(sigma, n, param, pks);
+    if(null_inputs[0] == 1)
+        free(gamma);
+    if(null_inputs[1] == 1)
+        free(sigma);
+    if(null_inputs[2] == 1)
+        free(pks);
+    return n_pks;
+}
+/**
+ * Dual polarity AMPD. The local maximum and local minimum scalograms are
+ * evaluated in the same sweep over (i, k), then lambda, sigma and the events
+ * are found separately for each polarity: index 0 is for peaks with param,
+ * index 1 is for troughs with tparam. Troughs are the same as the peaks of
+ * the negated data.
+ *
+ * If both lms[0] and lms[1] are given, the scalograms are kept bit packed,
+ * otherwise they are evaluated again for sigma, as in ampdcpu_mf. The other
+ * arrays are required. The number of troughs is put into n_trs.
+ *
+ * @return          Number of peaks.
+ */
+int ampdcpu_dual(float *data, int n, struct ampd_param *param,
+            struct ampd_param *tparam, struct bmtx *lms[2], double *gamma[2],
+            double *sigma[2], int *pks[2], int *n_trs){
+
+    int i, k, p;
+    int l = lms_rows(n, param);
+    int packed = (lms != NULL && lms[0] != NULL && lms[1] != NULL);
+    int ismax, ismin;
+    uint64_t *row[2];
+    int lambda[2];
+    int n_ev[2];
+    const double *rowsum;
+    double *own_rowsum;
+    double m[2];
+    struct ampd_param *par[2] = {param, tparam};
+    double rnd_factor = param->rnd_factor;
+    double a = param->a;
+    double *col;
+
+    rowsum = get_rowsum(n, param, &own_rowsum);
+    for(k=0; k<l; k++){
+        m[0] = 0.0;
+        m[1] = 0.0;
+        if(packed){
+            row[0] = lms[0]->data + (size_t)k * lms[0]->words;
+            row[1] = lms[1]->data + (size_t)k * lms[1]->words;
+            memset(row[0], 0, sizeof(uint64_t) * lms[0]->words);
+            memset(row[1], 0, sizeof(uint64_t) * lms[1]->words);
+        }
+        for(i=k+1; i<=n-k; i++){
+            ismax = (data[i-1] > data[i-k-1] && data[i-1] > data[i+k-1]);
+            ismin = (data[i-1] < data[i-k-1] && data[i-1] < data[i+k-1]);
+            if(!(ismax || ismin))
+                continue;
+            // a position is never both
+            p = ismin;
+            m[p] += lms_val(i, k, rnd_factor, a);
+            if(packed)
+                row[p][i >> 6] |= (uint64_t)1 << (i & 63);
+        }
+        gamma[0][k] = rowsum[k] - m[0];
+        gamma[1][k] = rowsum[k] - m[1];
+    }
+    free(own_rowsum);
+    for(p=0; p<2; p++){
+        lambda[p] = find_lambda(gamma[p], l, par[p]);
+        col = malloc(sizeof(double) * (lambda[p] > 0 ? lambda[p] : 1));
+        for(i=0; i<n; i++){
+            for(k=1; k<lambda[p]; k++){
+                if(packed){
+                    row[p] = lms[p]->data + (size_t)k * lms[p]->words;
+                    ismax = (row[p][i >> 6] >> (i & 63)) & 1;
+                }
+                else if(p == 0)
+                    ismax = lms_ismax(data, n, i, k);
+                else
+                    ismax = lms_ismin(data, n, i, k);
+                if(ismax)
+                    col[k] = 0.0;
+                else
+                    col[k] = lms_val(i, k, rnd_factor, a);
+            }
+            sigma[p][i] = column_sigma(col, lambda[p],
+                                        param->deterministic);
+        }
+        free(col);
+        n_ev[p] = finish_peaks(sigma[p], n, par[p], pks[p]);
+    }
+    *n_trs = n_ev[1];
+    return n_ev[0];
+}
+/**
+ * Gamma sweep of ampdcpu_lanes for a fixed number of lanes, so the inner
+ * loops over the lanes can be vectorized. The random part of the LMS only
+ * depends on the position, so it is computed once for all lanes, and only if
+ * any of them has a local maximum there. Adding 0 for the other lanes keeps
+ * the sums the same as in the single window kernels.
+ */
+static inline void lanes_gamma(float *data, int n, int l, const int lanes,
+                    const double *rowsum, double rnd_factor, double a,
+                    double *gamma){
+
+    int i, k, w;
+    int any;
+    float v;
+    float *c, *lo, *hi;
+    int mask[AMPD_MAX_LANES];
+    double m[AMPD_MAX_LANES];
+    for(k=0; k<l; k++){
+        for(w=0; w<lanes; w++)
+            m[w] = 0.0;
+        for(i=k+1; i<=n-k; i++){
+            c = data + (size_t)(i-1) * lanes;
+            lo = data + (size_t)(i-k-1) * lanes;
+            hi = data + (size_t)(i+k-1) * lanes;
+            any = 0;
+            for(w=0; w<lanes; w++){
+                mask[w] = (c[w] > lo[w]) & (c[w] > hi[w]);
+                any |= mask[w];
+            }
+            if(any == 0)
                 continue;
+            v = lms_val(i, k, rnd_factor, a);
+            for(w=0; w<lanes; w++)
+                m[w] += (double)(v * (float)mask[w]);
         }
+        for(w=0; w<lanes; w++)
+            gamma[(size_t)w * l + k] = rowsum[k] - m[w];
+    }
+}
+/**
+ * Matrix free AMPD on several equal length windows at once. The windows are
+ * interleaved sample by sample in data, window w at data[i*lanes+w], so the
+ * local maximum condition is evaluated for all of them in SIMD lanes. Each
+ * window has its own param, lambda, sigma and peaks; the results are the
+ * same as running ampdcpu_mf on each window.
+ *
+ * @param data      Interleaved windows, n * lanes long
+ * @param n         Length of a window
+ * @param lanes     Number of windows, 1 to AMPD_MAX_LANES
+ * @param param     Array of lanes ampd_param structs
+ * @param gamma     Planar, window w at gamma[w*l], l * lanes long
+ * @param sigma     Planar, window w at sigma[w*n], n * lanes long
+ * @param pks       Array of lanes peak index arrays, n long each
+ * @param n_pks     Number of peaks for each window
+ *
+ * @return          0 on success, -1 on invalid lanes.
+ */
+int ampdcpu_lanes(float *data, int n, int lanes, struct ampd_param *param,
+            double *gamma, double *sigma, int **pks, int *n_pks){
 
+    int i, k, w;
+    int l = lms_rows(n, &param[0]);
+    int lambda;
+    int ismax;
+    const double *rowsum;
+    double *own_rowsum;
+    double *col;
+    double rnd_factor = param[0].rnd_factor;
+    double a = param[0].a;
+    float *c;
+
+    if(lanes < 1 || lanes > AMPD_MAX_LANES)
+        return -1;
+    rowsum = get_rowsum(n, &param[0], &own_rowsum);
+    switch(lanes){
+        case 8:
+            lanes_gamma(data, n, l, 8, rowsum, rnd_factor, a, gamma);
+            break;
+        case 16:
+            lanes_gamma(data, n, l, 16, rowsum, rnd_factor, a, gamma);
+            break;
+        default:
+            lanes_gamma(data, n, l, lanes, rowsum, rnd_factor, a, gamma);
     }
-    n_pks = j;
-    // calculate mean peak distance and variance of distance
-    double dist;
-    double dist_var = 0;
-    param->mean_pk_dist = 0;
-    for(i=0; i<n_pks-2; i++){
-        dist = (double)(pks[i+1]-pks[i])/param->sampling_rate;
-        param->mean_pk_dist += dist / (double)(n_pks - 1);
-    }
-    for(i=0; i<n_pks-2; i++){
-        dist = (double)(pks[i+1]-pks[i])/param->sampling_rate;
-        dist_var += pow(dist - param->mean_pk_dist,2)/(double)(n_pks-1);
-         
-    }
-    param->stdev_pk_dist = sqrt(dist_var);
-    // if lambda wqas not found return 0 and reset peaks to 0
-    if(lambda == 1){
-        n_pks = 0;
-        memset(pks, 0, sizeof(pks));
+    free(own_rowsum);
+    col = malloc(sizeof(double) * (l > 0 ? l : 1));
+    for(w=0; w<lanes; w++){
+        lambda = find_lambda(gamma + (size_t)w * l, l, &param[w]);
+        for(i=0; i<n; i++){
+            for(k=1; k<lambda; k++){
+                ismax = 0;
+                if(i > k && i + k <= n){
+                    c = data + (size_t)(i-1) * lanes + w;
+                    ismax = (c[0] > c[-(k * lanes)] && c[0] > c[k * lanes]);
+                }
+                col[k] = ismax ? 0.0 : lms_val(i, k, rnd_factor, a);
+            }
+            sigma[(size_t)w * n + i] = column_sigma(col, lambda,
+                                                    param[0].deterministic);
+        }
+        n_pks[w] = finish_peaks(sigma + (size_t)w * n, n, &param[w], pks[w]);
     }
-    // free memory if aux output is not needed
-    if(null_inputs[0] == 1){
-        for(i=0; i<l; i++)
-            free(lms->data[j]);
-        free(lms);
+    free(col);
+    return 0;
+}
+/**
+ * Map float data to the full int16 range, keeping the order of the samples
+ * except for values closer than 1/65534 of the data range, which become
+ * equal. Return the scale, 0 if the data is constant.
+ */
+double quantize_i16(float *data, int n, int16_t *q){
+
+    int i;
+    float min = data[0];
+    float max = data[0];
+    double scale, mid;
+    for(i=1; i<n; i++){
+        if(data[i] < min)
+            min = data[i];
+        if(data[i] > max)
+            max = data[i];
+    }
+    if(max == min){
+        memset(q, 0, sizeof(int16_t) * n);
+        return 0.0;
+    }
+    scale = 65534.0 / ((double)max - (double)min);
+    mid = ((double)max + (double)min) / 2.0;
+    for(i=0; i<n; i++)
+        q[i] = (int16_t)lrint(((double)data[i] - mid) * scale);
+    return scale;
+}
+/**
+ * Matrix free AMPD on int16 data. Same as ampdcpu_mf, except the local
+ * maximum condition of a row is first evaluated for all columns into a byte
+ * mask, which the compiler vectorizes to 16 (AVX2) or 32 (AVX-512) int16
+ * compares at a time. The mask is then scanned 8 columns at a time for the
+ * few local maxima.
+ */
+int ampdcpu_i16(int16_t *data, int n, struct ampd_param *param,
+            double *gamma, double *sigma, int *pks){
+
+    int i, k;
+    int null_inputs[3] = {0,0,0};
+    if(gamma == NULL)
+        null_inputs[0] = 1;
+    if(sigma == NULL)
+        null_inputs[1] = 1;
+    if(pks == NULL)
+        null_inputs[2] = 1;
+
+    int l = lms_rows(n, param);
+    int hi;
+    double rnd_factor = param->rnd_factor;
+    double a = param->a;
+    const double *rowsum;
+    double *own_rowsum;
+    double m;
+    uint64_t word;
+    uint8_t *mask = malloc(n + 8);
+    if(null_inputs[0] == 1)
+        gamma = malloc(sizeof(double) * l);
+    rowsum = get_rowsum(n, param, &own_rowsum);
+    memset(mask, 0, n + 8);
+    for(k=0; k<l; k++){
+        hi = n - k;
+        for(i=k+1; i<=hi; i++)
+            mask[i] = (data[i-1] > data[i-k-1]) & (data[i-1] > data[i+k-1]);
+        m = 0.0;
+        i = k+1;
+        while(i <= hi){
+            if(i + 8 <= hi + 1){
+                memcpy(&word, mask + i, sizeof(uint64_t));
+                if(word == 0){
+                    i += 8;
+                    continue;
+                }
+            }
+            if(mask[i])
+                m += lms_val(i, k, rnd_factor, a);
+            i++;
+        }
+        gamma[k] = rowsum[k] - m;
     }
+    free(own_rowsum);
+    free(mask);
+    int lambda = find_lambda(gamma, l, param);
+
+    int n_pks;
+    int ismax;
+    double *col = malloc(sizeof(double) * (lambda > 0 ? lambda : 1));
     if(null_inputs[1] == 1)
+        sigma = malloc(sizeof(double) * n);
+    if(null_inputs[2] == 1)
+        pks = malloc(sizeof(int)*n);
+    for(i=0; i<n; i++){
+        for(k=1; k<lambda; k++){
+            ismax = (i > k && i + k <= n &&
+                     data[i-1] > data[i-k-1] && data[i-1] > data[i+k-1]);
+            col[k] = ismax ? 0.0 : lms_val(i, k, rnd_factor, a);
+        }
+        sigma[i] = column_sigma(col, lambda, param->deterministic);
+    }
+    free(col);
+    n_pks = finish_peaks(sigma, n, param, pks);
+    if(null_inputs[0] == 1)
         free(gamma);
+    if(null_inputs[1] == 1)
+        free(sigma);
     if(null_inputs[2] == 1)
+        free(pks);
+    return n_pks;
+}
+/**
+ * Exact gamma of LMS row k, as in ampdcpu_mf.
+ */
+static double row_gamma(float *data, int n, int k, const double *rowsum,
+                        double rnd_factor, double a){
+
+    int i;
+    double m = 0.0;
+    for(i=k+1; i<=n-k; i++){
+        if(data[i-1] > data[i-k-1] && data[i-1] > data[i+k-1])
+            m += lms_val(i, k, rnd_factor, a);
+    }
+    return rowsum[k] - m;
+}
+/**
+ * Approximate matrix free AMPD. Gamma is evaluated exactly on the first
+ * AMPD_APPROX_DENSE rows, then on a geometric subset of rows, each
+ * 1/AMPD_APPROX_STEP further than the previous one, and linearly
+ * interpolated in between. Local minima of the interpolated gamma are on the
+ * evaluated rows, so every row between the neighbours of the chosen lambda
+ * is then evaluated and lambda is found again, up to AMPD_APPROX_REFINE
+ * times while it moves.
+ *
+ * Sigma is only computed for the columns which are local maxima on the
+ * first row, the others cannot get below the sigma threshold for any
+ * practical lambda and get sigma 1.
+ *
+ * The half width of the row gap around lambda is put in param->lambda_err,
+ * 0 if lambda is in the dense part.
+ */
+int ampdcpu_approx(float *data, int n, struct ampd_param *param,
+            double *gamma, double *sigma, int *pks){
+
+    int i, k, j, r;
+    int null_inputs[3] = {0,0,0};
+    if(gamma == NULL)
+        null_inputs[0] = 1;
+    if(sigma == NULL)
+        null_inputs[1] = 1;
+    if(pks == NULL)
+        null_inputs[2] = 1;
+
+    int l = lms_rows(n, param);
+    int lambda, prev, lo, hi;
+    double rnd_factor = param->rnd_factor;
+    double a = param->a;
+    const double *rowsum;
+    double *own_rowsum;
+    char *done = calloc(l > 0 ? l : 1, 1);
+    if(null_inputs[0] == 1)
+        gamma = malloc(sizeof(double) * l);
+    rowsum = get_rowsum(n, param, &own_rowsum);
+    // evaluate subset of rows, interpolate between them
+    prev = -1;
+    k = 0;
+    while(k < l){
+        gamma[k] = row_gamma(data, n, k, rowsum, rnd_factor, a);
+        done[k] = 1;
+        for(j=prev+1; j<k && prev >= 0; j++)
+            gamma[j] = gamma[prev] + (gamma[k] - gamma[prev]) *
+                       (double)(j - prev) / (double)(k - prev);
+        prev = k;
+        if(k < AMPD_APPROX_DENSE || k / AMPD_APPROX_STEP < 1)
+            k++;
+        else if(k + k / AMPD_APPROX_STEP >= l && k != l-1)
+            k = l-1;
+        else
+            k += k / AMPD_APPROX_STEP;
+    }
+    // refine around lambda
+    lambda = find_lambda(gamma, l, param);
+    param->lambda_err = 0;
+    for(r=0; r<AMPD_APPROX_REFINE; r++){
+        lo = lambda - 1;
+        while(lo > 0 && done[lo] == 0)
+            lo--;
+        hi = lambda + 1;
+        while(hi < l-1 && done[hi] == 0)
+            hi++;
+        if(lo < 0 || hi >= l)
+            break;
+        if(r == 0)
+            param->lambda_err = (hi - lo) / 2 > 1 ? (hi - lo) / 2 : 0;
+        for(j=lo+1; j<hi; j++){
+            if(done[j] == 0){
+                gamma[j] = row_gamma(data, n, j, rowsum, rnd_factor, a);
+                done[j] = 1;
+            }
+        }
+        k = lambda;
+        lambda = find_lambda(gamma, l, param);
+        if(lambda == k)
+            break;
+    }
+    free(own_rowsum);
+    free(done);
+
+    int n_pks;
+    double *col = malloc(sizeof(double) * (lambda > 0 ? lambda : 1));
+    if(null_inputs[1] == 1)
+        sigma = malloc(sizeof(double) * n);
+    if(null_inputs[2] == 1)
+        pks = malloc(sizeof(int)*n);
+    for(i=0; i<n; i++){
+        if(lambda > 1 && lms_ismax(data, n, i, 1) == 0){
+            sigma[i] = 1.0;
+            continue;
+        }
+        for(k=1; k<lambda; k++){
+            if(lms_ismax(data, n, i, k))
+                col[k] = 0.0;
+            else
+                col[k] = lms_val(i, k, rnd_factor, a);
+        }
+        sigma[i] = column_sigma(col, lambda, param->deterministic);
+    }
+    free(col);
+    n_pks = finish_peaks(sigma, n, param, pks);
+    if(null_inputs[0] == 1)
+        free(gamma);
+    if(null_inputs[1] == 1)
         free(sigma);
-    if(null_inputs[3] == 1)
+    if(null_inputs[2] == 1)
         free(pks);
     return n_pks;
 }
+/**
+ * Number of LMS rows for a window of n samples, ceil(n/2)-1 unless limited by
+ * param->l_max. Scales above the longest plausible period only add cost.
+ */
+int lms_rows(int n, struct ampd_param *param){
+
+    int l = (int)ceil(n/2)-1;
+    if(param->l_max > 0 && param->l_max < l)
+        l = param->l_max;
+    return l;
+}
+/**
+ * Sum of each LMS row as if there were no local maxima at all. This depends
+ * only on the batch length, so it can be computed once for a run and shared
+ * read-only between threads through param->rowsum. The kernels only visit
+ * the local maxima: gamma[k] = rowsum[k] - (values at the maxima of row k).
+ */
+double *lms_rowsum(int n, struct ampd_param *param){
+
+    int i, k;
+    int l = lms_rows(n, param);
+    double *rowsum = malloc(sizeof(double) * (l > 0 ? l : 1));
+    double *row = NULL;
+    if(param->deterministic == 1)
+        row = malloc(sizeof(double) * (n > 0 ? n : 1));
+    for(k=0; k<l; k++){
+        rowsum[k] = 0.0;
+        if(row != NULL){
+            for(i=0; i<n; i++)
+                row[i] = lms_val(i, k, param->rnd_factor, param->a);
+            rowsum[k] = pairwise_sum(row, n);
+            continue;
+        }
+        for(i=0; i<n; i++)
+            rowsum[k] += lms_val(i, k, param->rnd_factor, param->a);
+    }
+    free(row);
+    return rowsum;
+}
+/**
+ * Find peaks where sigma is below threshold. Peaks closer than peak_thresh
+ * seconds to the previous one are dropped. Return the number of peaks.
+ */
+int pick_peaks(double *sigma, int n, struct ampd_param *param, int *pks){
+
+    int i, j = 0;
+    int prev;
+    double sigma_thresh = param->sigma_thresh;
+    int ind_thresh = (int)(param->peak_thresh * param->sampling_rate);
+    for(i=0; i<n; i++){
+        if(sigma[i] < sigma_thresh){
+            prev = (j > 0) ? pks[j-1] : 0;
+            if(i - prev > ind_thresh){
+                pks[j] = i;
+                j++;
+            }
+        }
+    }
+    return j;
+}
+/**
+ * Calculate mean peak distance and standard deviation of distance, in
+ * seconds, in one pass over all n_pks-1 distances with Welford's update.
+ * Results are saved into the ampd_param struct.
+ */
+void peak_dist_stats(int *pks, int n_pks, struct ampd_param *param){
+
+    int i;
+    double dist, d;
+    double m2 = 0;
+    param->mean_pk_dist = 0;
+    for(i=1; i<n_pks; i++){
+        dist = (double)(pks[i]-pks[i-1])/param->sampling_rate;
+        d = dist - param->mean_pk_dist;
+        param->mean_pk_dist += d / (double)i;
+        m2 += d * (dist - param->mean_pk_dist);
+    }
+    param->stdev_pk_dist = (n_pks > 1) ? sqrt(m2 / (double)(n_pks - 1)) : 0;
+}
 /**
  * Malloc for matrix struct
  */
@@ -185,14 +885,60 @@ struct fmtx *malloc_fmtx(int rows, int cols){
 
     int i;
     struct fmtx *mtx = malloc(sizeof(struct fmtx));
+    if(mtx == NULL)
+        return NULL;
     mtx->rows = rows;
     mtx->cols = cols;
-    mtx->data = malloc((mtx->rows*sizeof(float *)));
+    mtx->data = malloc((size_t)mtx->rows * sizeof(float *));
+    if(mtx->data == NULL){
+        free(mtx);
+        return NULL;
+    }
     for(i=0; i<mtx->rows;i++){
-        mtx->data[i] = malloc(mtx->cols * sizeof(float));
+        mtx->data[i] = malloc((size_t)mtx->cols * sizeof(float));
+        if(mtx->data[i] == NULL){
+            mtx->rows = i;
+            free_fmtx(mtx);
+            return NULL;
+        }
+    }
+    return mtx;
+
+}
+void free_fmtx(struct fmtx *mtx){
+
+    int i;
+    if(mtx == NULL)
+        return;
+    for(i=0; i<mtx->rows; i++)
+        free(mtx->data[i]);
+    free(mtx->data);
+    free(mtx);
+}
+/**
+ * Malloc for bit matrix struct. Rows are padded to 64 bit words.
+ */
+struct bmtx *malloc_bmtx(int rows, int cols){
+
+    struct bmtx *mtx = malloc(sizeof(struct bmtx));
+    if(mtx == NULL)
+        return NULL;
+    mtx->rows = rows;
+    mtx->cols = cols;
+    mtx->words = (cols + 63) / 64;
+    mtx->data = malloc((size_t)rows * mtx->words * sizeof(uint64_t));
+    if(mtx->data == NULL){
+        free(mtx);
+        return NULL;
     }
     return mtx;
+}
+void free_bmtx(struct bmtx *mtx){
 
+    if(mtx == NULL)
+        return;
+    free(mtx->data);
+    free(mtx);
 }
 /**
  * Searches lambda for global minimum.
@@ -240,6 +986,28 @@ int more_sophisticated_way_to_lambda(double *gamma, int l, int lambda_max){
     free(minima);
     return lambda;
 }
+/**
+ * Sums of data[i], i*data[i] and data[i]^2 over i0..i0+n-1 into s, in the same
+ * fixed shape as pairwise_sum.
+ */
+static void fit_sums(float *data, int i0, int n, double *s){
+
+    int i, h;
+    double y, a[3], b[3];
+    if(n <= AMPD_SUM_BLOCK){
+        s[0] = 0.0; s[1] = 0.0; s[2] = 0.0;
+        for(i=i0; i<i0+n; i++){
+            y = (double)data[i];
+            s[0] += y; s[1] += (double)i * y; s[2] += y * y;
+        }
+        return;
+    }
+    h = (n / 2 + AMPD_SUM_BLOCK - 1) / AMPD_SUM_BLOCK * AMPD_SUM_BLOCK;
+    fit_sums(data, i0, h, a);
+    fit_sums(data, i0 + h, n - h, b);
+    for(i=0; i<3; i++)
+        s[i] = a[i] + b[i];
+}
 /**
  * Do simple linear regression on float array. The result fitting
  * parameters are saved in ampd_param struct.
@@ -254,8 +1022,19 @@ int linear_fit(float *data, int n, struct ampd_param *param){
      * y = a * x + b, where x is time in seconds
      */
     double x, sumx, sumx2, sumxy, sumy, sumy2, denom;
+    double s[3];
     x = 0.0; sumx = 0.0; sumx2 = 0.0; sumxy = 0.0; sumy = 0.0; sumy2 = 0.0;
-    for(i=0;i<n;i++){
+    if(param->deterministic == 1){
+        // sums over x in closed form, sums over data pairwise
+        sumx = (double)n * (n - 1) / 2.0 / sampling_rate;
+        sumx2 = (double)n * (n - 1) * (2.0 * n - 1) / 6.0 /
+                (sampling_rate * sampling_rate);
+        fit_sums(data, 0, n, s);
+        sumy = s[0];
+        sumxy = s[1] / sampling_rate;
+        sumy2 = s[2];
+    }
+    for(i=0; i<n && param->deterministic != 1; i++){
         x = (double) i * 1 / sampling_rate;
         sumx += x;  sumx2 += x*x; sumxy += x*data[i];
         sumy += data[i]; sumy2 += data[i]*data[i];     
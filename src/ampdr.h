@@ -18,8 +18,41 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <math.h>
 
+/*
+ * Local maxima scalogram kernels. All of them give the same result, they
+ * differ in how the LMS is kept in memory:
+ *
+ * dense:       full l x n float matrix, needed for --output-lms
+ * bitpack:     l x n bit matrix, only the local maximum condition is stored
+ * matfree:     nothing is stored, the condition is evaluated again for sigma
+ * lanes:       matfree on AMPD_LANES interleaved windows at once, in SIMD lanes
+ * i16:         matfree on data quantized to int16, only the order of the
+ *              samples matters for the LMS
+ * approx:      matfree with gamma on a subset of rows, not exact
+ */
+#define AMPD_KERNEL_DENSE 0
+#define AMPD_KERNEL_BITPACK 1
+#define AMPD_KERNEL_MATFREE 2
+#define AMPD_KERNEL_LANES 3
+#define AMPD_KERNEL_I16 4
+#define AMPD_KERNEL_APPROX 5
+
+/* windows processed together by the lanes kernel, 8 or 16 fills AVX2/512 */
+#define AMPD_LANES 8
+#define AMPD_MAX_LANES 16
+
+/* approx kernel: exact rows, then row step is k/AMPD_APPROX_STEP */
+#define AMPD_APPROX_DENSE 32
+#define AMPD_APPROX_STEP 16
+#define AMPD_APPROX_REFINE 3
+
+/* deterministic mode: sums are taken in blocks of this many terms, then
+ * added pairwise, see pairwise_sum */
+#define AMPD_SUM_BLOCK 32
+
 /* generic matrix of float */
 struct fmtx {
 
@@ -29,6 +62,16 @@ struct fmtx {
 
 };
 
+/* bit matrix, a set bit means local maximum at [row][col] */
+struct bmtx {
+
+    int rows;
+    int cols;
+    int words;          // 64 bit words per row
+    uint64_t *data;
+
+};
+
 struct ampd_param {
 
     double sampling_rate;
@@ -41,25 +84,66 @@ struct ampd_param {
     double fit_b;
     double fit_r;
     int lambda;             // reduced LMS lambda
-    double peak_rate_min;   // TODO UNUSED
+    double peak_rate_min;   // plausible rate bounds per min, 0 is unset
     double peak_rate_max;
     int lambda_max;         // maunally threshold lambda at command line call
+    int l_max;              // LMS rows limit, 0 means ceil(n/2)-1
+    double rows_periods;    // set l_max to this many longest plausible
+                            // periods, from peak_rate_min, 0 is unset
     double sigma_thresh;    // sigma threshold above 0
     double peak_thresh;     // peak minimum distance in seconds
     /* mean and variance of peak distances, helps in sorting bad data */
     double mean_pk_dist;
     double stdev_pk_dist;
+    int kernel;             // LMS kernel, see AMPD_KERNEL_*
+    /* LMS row sums for batch length rowsum_n, shared read-only, optional */
+    double *rowsum;
+    int rowsum_n;
+    int lambda_err;         // approx kernel: estimated lambda uncertainty
+    int deterministic;      // fixed shape sums, see pairwise_sum
 
 };
 /* util */
 struct fmtx *malloc_fmtx(int rows, int cols);
+void free_fmtx(struct fmtx *mtx);
+struct bmtx *malloc_bmtx(int rows, int cols);
+void free_bmtx(struct bmtx *mtx);
 /* main routine */
-int ampdcpu(float *data,int n, struct ampd_param *param, 
+int ampdcpu(float *data,int n, struct ampd_param *param,
             struct fmtx *lms,double *gam, double *sig, int *pks);
+/* same with bit packed and matrix free LMS kernels*/
+int ampdcpu_bp(float *data, int n, struct ampd_param *param,
+            struct bmtx *lms, double *gam, double *sig, int *pks);
+int ampdcpu_mf(float *data, int n, struct ampd_param *param,
+            double *gam, double *sig, int *pks);
+/* peaks and troughs in one LMS sweep, [0] is for peaks, [1] for troughs*/
+int ampdcpu_dual(float *data, int n, struct ampd_param *param,
+            struct ampd_param *tparam, struct bmtx *lms[2], double *gam[2],
+            double *sig[2], int *pks[2], int *n_trs);
+
+/* matrix free on interleaved windows*/
+int ampdcpu_lanes(float *data, int n, int lanes, struct ampd_param *param,
+            double *gam, double *sig, int **pks, int *n_pks);
+
+/* matrix free on int16 data*/
+int ampdcpu_i16(int16_t *data, int n, struct ampd_param *param,
+            double *gam, double *sig, int *pks);
+double quantize_i16(float *data, int n, int16_t *q);
+
+/* matrix free on a subset of LMS rows, approximate*/
+int ampdcpu_approx(float *data, int n, struct ampd_param *param,
+            double *gam, double *sig, int *pks);
 
 /* helper routines */
+double pairwise_sum(const double *x, int n);
+double *lms_rowsum(int n, struct ampd_param *p);
+/* number of LMS rows for n samples, limited by p->l_max*/
+int lms_rows(int n, struct ampd_param *p);
 int linear_fit(float *data, int n, struct ampd_param *p);
 void linear_detrend(float *data, int n, struct ampd_param *p);
 /* find lambda*/
 int more_sophisticated_way_to_lambda(double *gamma, int l, int lambda_max);
+/* find peaks where sigma is below threshold, calc peak distance stats */
+int pick_peaks(double *sigma, int n, struct ampd_param *p, int *pks);
+void peak_dist_stats(int *pks, int n_pks, struct ampd_param *p);
 
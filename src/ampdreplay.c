@@ -0,0 +1,605 @@
+/*
+ * ampdreplay.c
+ *
+ * Utility program for load testing live processing: replays a data file at
+ * its sampling rate, or faster, into the stdin of a command for each
+ * simulated channel, eg: ampd in stream mode, or into FIFOs. Peak indices
+ * printed by the commands are timed against the moment their sample was due,
+ * so the end to end latency of peaks is measured along with samples the
+ * consumers did not take in time and their CPU time.
+ *
+ * Usage from command line:
+ * ampdreplay -f [infile] [options] -- [command] [args]
+ * Optional inputs: -c [col]   : column of a delimited file, eg: SA export
+ *                  -r [fs]    : sampling rate
+ *                  -x [speed] : 1 is real time, 0 is as fast as possible
+ *                  -n [chan]  : number of channels
+ *                  -l [sec]   : replay only this much of the data
+ *                  -b [sec]   : acquisition buffer, later samples are dropped
+ *                  -s         : stagger channels along the data
+ *                  -p [path]  : write channel i to FIFO path, %d is i
+ *                  -h         : print help
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_LEN 1024
+#define MAX_ARGS 64
+#define DEF_SAMPLING_RATE 100
+#define DEF_SPEED 1
+#define DEF_BUFFER 1.0      // seconds an acquisition device keeps samples
+#define OUT_BUF 4096        // bytes written at once, not more than PIPE_BUF
+#define IN_BUF 4096
+#define TICK_MS 1
+
+/* input samples, kept as text lines */
+struct samples{
+
+    char *text;
+    long *off;          // line i is text[off[i]] .. text[off[i+1]]
+    int n;
+
+};
+
+/* one simulated channel */
+struct channel{
+
+    int id;
+    pid_t pid;          // command, 0 if none
+    int fd_out;         // samples to the consumer, -1 when closed
+    int fd_in;          // peaks from the command, -1 if none or closed
+    int start;          // first sample in the data, when staggered
+    int queued;         // samples formatted into buf
+    int delivered;      // samples fully written
+    int dropped;
+    char buf[OUT_BUF];
+    int buf_len;
+    int buf_pos;
+    char line[IN_BUF];  // partial line of peaks
+    int line_len;
+    int peaks;
+    double *lat;        // peak latencies, seconds, at a replay rate
+    int n_lat;
+    int lat_alloc;
+    double cpu;         // user + system seconds of the command
+    double end;         // time the consumer took the last sample
+
+};
+
+/**
+ * Print general description of input options.
+ */
+void printf_help(){
+
+    printf(
+    "ampdreplay\n"
+    "==========\n"
+    "Command line utility to load test live processing. A data file is\n"
+    "replayed at its sampling rate, or faster, into each simulated channel:\n"
+    "the stdin of a command, a FIFO, or stdout for a single channel, the\n"
+    "results then go to stderr.\n"
+    "Peak indices printed by the commands, one per line, are timed against\n"
+    "the moment their sample was due. Results per channel are: channel peaks\n"
+    "lat_p50 lat_p90 lat_p99 lat_max (seconds) dropped cpu_s cpu_pct and\n"
+    "samples_per_s, then the same for all channels. Latencies need a speed.\n"
+    "\n"
+    "Basic usage:\n"
+    "ampdreplay -f [infile] -r [fs] -n [chan] -- ampd -f - -o - -t resp\n"
+    "\n"
+    "Input options:\n"
+    "-h                 print help\n"
+    "-f [infile]        path/to/input/file, one value each line\n"
+    "-c [col]           column index of a delimited file, eg: SA export\n"
+    "-r [fs]            sampling rate in Hz, default is 100\n"
+    "-x [speed]         replay speed, 1 is real time, 10 is 10x faster, 0 is\n"
+    "                   as fast as the consumers take the samples\n"
+    "-n [chan]          number of simulated channels, default is 1\n"
+    "-l [sec]           replay only the first sec seconds of the data\n"
+    "-b [sec]           acquisition buffer, default is 1 s. Samples taken\n"
+    "                   later than this after they were due are counted as\n"
+    "                   dropped\n"
+    "-s                 stagger channels, channel i starts at i/chan of the\n"
+    "                   data, so batches do not end at the same time\n"
+    "-p [path]          write channel i to the FIFO path, %%d is replaced by\n"
+    "                   i, the FIFO is made if needed\n"
+    "-- [command]       run the command for each channel, %%d in the\n"
+    "                   arguments is replaced by the channel\n"
+    );
+}
+
+static double now_s(){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+/**
+ * Find the data delimiter in a line, as colextract does.
+ */
+static char get_delim(char *line){
+
+    char dlist[] = {'\t',' ',','};
+    char d = '\t';
+    int i, count = 0, c;
+    char *p;
+    for(i=0; i<(int)sizeof(dlist); i++){
+        for(c=0, p=line; *p != '\0'; p++)
+            c += (*p == dlist[i]);
+        if(c > count){
+            count = c;
+            d = dlist[i];
+        }
+    }
+    return d;
+}
+/**
+ * Load the samples, column col of a delimited file or the whole lines if col
+ * is negative. Comment and empty lines are skipped. Return 0 on success.
+ */
+int load_samples(char *path, int col, struct samples *s){
+
+    FILE *fp;
+    char *line = NULL;
+    char *tok;
+    char delim[2] = {0};
+    size_t len = 0;
+    long size = 0, alloc = 1 << 20, k;
+    int alloc_n = 1 << 16;
+    int i, ret = 0;
+    void *tmp;
+    fp = fopen(path, "r");
+    if(fp == NULL){
+        fprintf(stderr, "cannot open file %s\n",path);
+        return -1;
+    }
+    s->n = 0;
+    s->text = malloc(alloc);
+    s->off = malloc(sizeof(long) * (alloc_n + 1));
+    if(s->text == NULL || s->off == NULL)
+        ret = -1;
+    while(ret == 0 && getline(&line, &len, fp) != -1){
+        if(line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+            continue;
+        line[strcspn(line, "\r\n")] = '\0';
+        tok = line;
+        if(col >= 0){
+            if(delim[0] == '\0')
+                delim[0] = get_delim(line);
+            tok = strtok(line, delim);
+            for(i=0; i<col && tok != NULL; i++)
+                tok = strtok(NULL, delim);
+            if(tok == NULL)
+                continue;
+        }
+        k = strlen(tok);
+        // a sample is written to the channel in one piece
+        if(k + 1 > OUT_BUF){
+            fprintf(stderr, "ampdreplay: sample %d is longer than %d "
+                    "bytes\n",s->n,OUT_BUF - 1);
+            ret = -2;
+            break;
+        }
+        if(size + k + 2 > alloc){
+            while(size + k + 2 > alloc)
+                alloc *= 2;
+            tmp = realloc(s->text, alloc);
+            if(tmp == NULL){
+                ret = -1;
+                break;
+            }
+            s->text = tmp;
+        }
+        if(s->n == alloc_n){
+            alloc_n *= 2;
+            tmp = realloc(s->off, sizeof(long) * (alloc_n + 1));
+            if(tmp == NULL){
+                ret = -1;
+                break;
+            }
+            s->off = tmp;
+        }
+        s->off[s->n++] = size;
+        memcpy(s->text + size, tok, k);
+        size += k;
+        s->text[size++] = '\n';
+    }
+    free(line);
+    fclose(fp);
+    if(ret != 0){
+        if(ret == -1)
+            fprintf(stderr, "ampdreplay: out of memory\n");
+        free(s->text);
+        free(s->off);
+        s->text = NULL;
+        s->off = NULL;
+        return -1;
+    }
+    s->off[s->n] = size;
+    return 0;
+}
+/**
+ * Start the command of channel c with pipes to its stdin and from its stdout.
+ * %d in the arguments is replaced by the channel. Return 0 on success.
+ */
+int start_command(struct channel *c, char **cmd, int n_cmd){
+
+    int in[2], out[2];
+    int i;
+    char *args[MAX_ARGS+1];
+    char argbuf[MAX_ARGS][MAX_LEN];
+    if(pipe(in) != 0 || pipe(out) != 0){
+        perror("pipe");
+        return -1;
+    }
+    for(i=0; i<n_cmd && i<MAX_ARGS; i++){
+        if(strstr(cmd[i], "%d") != NULL){
+            snprintf(argbuf[i], MAX_LEN, cmd[i], c->id);
+            args[i] = argbuf[i];
+        }
+        else
+            args[i] = cmd[i];
+    }
+    args[i] = NULL;
+    c->pid = fork();
+    if(c->pid < 0){
+        perror("fork");
+        return -1;
+    }
+    if(c->pid == 0){
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+        execvp(args[0], args);
+        perror("execvp");
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    c->fd_out = in[1];
+    c->fd_in = out[0];
+    fcntl(c->fd_out, F_SETFL, fcntl(c->fd_out, F_GETFL) | O_NONBLOCK);
+    fcntl(c->fd_in, F_SETFL, fcntl(c->fd_in, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+/**
+ * Open the FIFO of channel c for writing, make it if needed. Blocks until a
+ * reader opens it. Return 0 on success.
+ */
+int open_fifo(struct channel *c, char *pattern){
+
+    char path[MAX_LEN];
+    struct stat st;
+    snprintf(path, sizeof(path), pattern, c->id);
+    if(stat(path, &st) != 0 && mkfifo(path, 0666) != 0){
+        perror("mkfifo");
+        return -1;
+    }
+    c->fd_out = open(path, O_WRONLY);
+    if(c->fd_out < 0){
+        perror("open");
+        return -1;
+    }
+    fcntl(c->fd_out, F_SETFL, fcntl(c->fd_out, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+/**
+ * Format the samples due by now into the write buffer of c, write what the
+ * consumer takes, and count the samples taken later than buffer seconds
+ * after they were due as dropped. Close the output after the last sample.
+ */
+void feed_channel(struct channel *c, struct samples *s, int total, double t0,
+                  double rate, double buffer){
+
+    int due, len, k;
+    ssize_t w;
+    double t;
+    due = total;
+    if(rate > 0){
+        t = (now_s() - t0) * rate;
+        due = (t < total) ? (int)t + 1 : total;
+    }
+    while(1){
+        // move the rest to the front and refill
+        if(c->buf_pos > 0){
+            memmove(c->buf, c->buf + c->buf_pos, c->buf_len - c->buf_pos);
+            c->buf_len -= c->buf_pos;
+            c->buf_pos = 0;
+        }
+        while(c->queued < due){
+            k = (c->start + c->queued) % s->n;
+            len = (int)(s->off[k+1] - s->off[k]);
+            if(c->buf_len + len > OUT_BUF)
+                break;
+            memcpy(c->buf + c->buf_len, s->text + s->off[k], len);
+            c->buf_len += len;
+            c->queued++;
+        }
+        if(c->buf_len == 0){
+            if(c->delivered == total){
+                close(c->fd_out);
+                c->fd_out = -1;
+            }
+            return;
+        }
+        w = write(c->fd_out, c->buf, c->buf_len);
+        if(w < 0){
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                // consumer is gone, the rest is lost
+                c->dropped += total - c->delivered;
+                c->delivered = total;
+                close(c->fd_out);
+                c->fd_out = -1;
+            }
+            return;
+        }
+        t = now_s();
+        for(k=0; k<w; k++){
+            if(c->buf[k] != '\n')
+                continue;
+            if(rate > 0 && t - t0 - c->delivered / rate > buffer)
+                c->dropped++;
+            c->delivered++;
+        }
+        c->buf_pos = (int)w;
+        c->end = t;
+        // pipe is full, wait for the consumer
+        if(w < c->buf_len)
+            return;
+    }
+}
+/**
+ * Read peak indices printed by the command of c, and time each one against
+ * its sample.
+ */
+void read_peaks(struct channel *c, double t0, double rate){
+
+    ssize_t r;
+    char *p, *nl;
+    long ind;
+    double t;
+    r = read(c->fd_in, c->line + c->line_len, IN_BUF - 1 - c->line_len);
+    if(r <= 0){
+        if(r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+            close(c->fd_in);
+            c->fd_in = -1;
+        }
+        return;
+    }
+    t = now_s();
+    c->line_len += (int)r;
+    c->line[c->line_len] = '\0';
+    p = c->line;
+    while((nl = strchr(p, '\n')) != NULL){
+        *nl = '\0';
+        ind = strtol(p, NULL, 10);
+        p = nl + 1;
+        c->peaks++;
+        if(rate <= 0)
+            continue;
+        if(c->n_lat == c->lat_alloc){
+            c->lat_alloc = (c->lat_alloc == 0) ? 1024 : c->lat_alloc * 2;
+            c->lat = realloc(c->lat, sizeof(double) * c->lat_alloc);
+        }
+        // the peak can be found at the earliest when its sample is due
+        c->lat[c->n_lat++] = t - t0 - (ind + 1) / rate;
+    }
+    c->line_len -= (int)(p - c->line);
+    memmove(c->line, p, c->line_len);
+    if(c->line_len == IN_BUF - 1)
+        c->line_len = 0;
+}
+
+static int cmp_double(const void *a, const void *b){
+
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+/**
+ * Nearest rank percentile q of sorted v.
+ */
+static double percentile(double *v, int n, double q){
+
+    int i;
+    if(n == 0)
+        return 0;
+    i = (int)(q / 100.0 * n + 0.5) - 1;
+    if(i < 0)
+        i = 0;
+    if(i >= n)
+        i = n - 1;
+    return v[i];
+}
+
+void printf_result(FILE *fp, char *name, double *lat, int n_lat, int peaks,
+                   int dropped, double cpu, double wall, double samples){
+
+    qsort(lat, n_lat, sizeof(double), cmp_double);
+    fprintf(fp, "%s\t%d\t%.3lf\t%.3lf\t%.3lf\t%.3lf\t%d\t%.3lf\t%.1lf\t%.0lf\n",
+           name, peaks, percentile(lat, n_lat, 50), percentile(lat, n_lat, 90),
+           percentile(lat, n_lat, 99), (n_lat > 0) ? lat[n_lat-1] : 0.0,
+           dropped, cpu, (wall > 0) ? cpu / wall * 100.0 : 0.0,
+           (wall > 0) ? samples / wall : 0.0);
+}
+
+int main(int argc, char **argv){
+
+    int opt, i, k, n_fds, active;
+    int col = -1;
+    int n_chan = 1;
+    int stagger = 0;
+    int total;
+    int n_cmd = 0;
+    int sum_dropped = 0, sum_peaks = 0, n_all = 0;
+    double fs = DEF_SAMPLING_RATE;
+    double speed = DEF_SPEED;
+    double buffer = DEF_BUFFER;
+    double limit = 0;
+    double rate, t0, t_end, wall, sum_cpu = 0;
+    double *all;
+    char infile[MAX_LEN] = {0};
+    char fifo[MAX_LEN] = {0};
+    char name[32];
+    char **cmd = NULL;
+    FILE *fp_res = stdout;
+    int status;
+    struct rusage ru;
+    struct samples s;
+    struct channel *ch;
+    struct pollfd *fds;
+
+    while((opt = getopt(argc, argv, "hf:c:r:x:n:l:b:sp:")) != -1){
+
+        switch(opt){
+            case 'h':
+                printf_help();
+                return 0;
+            case 'f':
+                strcpy(infile, optarg);
+                break;
+            case 'c':
+                col = atoi(optarg);
+                break;
+            case 'r':
+                fs = atof(optarg);
+                break;
+            case 'x':
+                speed = atof(optarg);
+                break;
+            case 'n':
+                n_chan = atoi(optarg);
+                break;
+            case 'l':
+                limit = atof(optarg);
+                break;
+            case 'b':
+                buffer = atof(optarg);
+                break;
+            case 's':
+                stagger = 1;
+                break;
+            case 'p':
+                strcpy(fifo, optarg);
+                break;
+        }
+    }
+    if(optind < argc){
+        cmd = argv + optind;
+        n_cmd = argc - optind;
+    }
+    if(strcmp(infile,"")==0){
+        fprintf(stderr,"No input file given.\n\n");
+        printf_help();
+        exit(EXIT_FAILURE);
+    }
+    if(n_chan < 1 || fs <= 0 || speed < 0){
+        fprintf(stderr,"Channels, sampling rate and speed should be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    if(cmd == NULL && strcmp(fifo,"")==0 && n_chan > 1){
+        fprintf(stderr,"More channels need a command or FIFOs.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(load_samples(infile, col, &s) != 0 || s.n == 0)
+        exit(EXIT_FAILURE);
+    total = s.n;
+    if(limit > 0 && limit * fs < total)
+        total = (int)(limit * fs);
+    rate = fs * speed;
+    signal(SIGPIPE, SIG_IGN);
+
+    ch = calloc(n_chan, sizeof(struct channel));
+    fds = malloc(sizeof(struct pollfd) * 2 * n_chan);
+    for(i=0; i<n_chan; i++){
+        ch[i].id = i;
+        ch[i].fd_in = -1;
+        ch[i].fd_out = STDOUT_FILENO;
+        ch[i].start = (stagger == 1) ? (int)((long)s.n * i / n_chan) : 0;
+        if(cmd != NULL && start_command(&ch[i], cmd, n_cmd) != 0)
+            exit(EXIT_FAILURE);
+        if(cmd == NULL && strcmp(fifo,"")!=0 && open_fifo(&ch[i], fifo) != 0)
+            exit(EXIT_FAILURE);
+    }
+
+    t0 = now_s();
+    while(1){
+        n_fds = 0;
+        active = 0;
+        for(i=0; i<n_chan; i++){
+            if(ch[i].fd_out >= 0){
+                feed_channel(&ch[i], &s, total, t0, rate, buffer);
+                // wait for room only if there is something to write
+                if(ch[i].fd_out >= 0 && ch[i].buf_len > ch[i].buf_pos){
+                    fds[n_fds].fd = ch[i].fd_out;
+                    fds[n_fds++].events = POLLOUT;
+                }
+            }
+            if(ch[i].fd_in >= 0){
+                fds[n_fds].fd = ch[i].fd_in;
+                fds[n_fds++].events = POLLIN;
+            }
+            active += (ch[i].fd_out >= 0 || ch[i].fd_in >= 0);
+        }
+        if(active == 0)
+            break;
+        // next sample is due within a tick at real time rates
+        poll(fds, n_fds, (rate > 0) ? TICK_MS : -1);
+        for(i=0; i<n_chan; i++){
+            if(ch[i].fd_in >= 0)
+                read_peaks(&ch[i], t0, rate);
+        }
+    }
+    t_end = now_s();
+    wall = t_end - t0;
+
+    // stdout carries the samples of a single channel
+    if(cmd == NULL && strcmp(fifo,"")==0)
+        fp_res = stderr;
+    fprintf(fp_res, "# channels=%d speed=%.2lf sampling_rate=%.2lf "
+            "samples=%d wall=%.3lf\n",n_chan, speed, fs, total, wall);
+    fprintf(fp_res, "# channel\tpeaks\tlat_p50\tlat_p90\tlat_p99\tlat_max"
+            "\tdropped\tcpu_s\tcpu_pct\tsamples_per_s\n");
+    for(i=0; i<n_chan; i++){
+        if(ch[i].pid > 0 && wait4(ch[i].pid, &status, 0, &ru) > 0)
+            ch[i].cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 +
+                        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+        sum_dropped += ch[i].dropped;
+        sum_peaks += ch[i].peaks;
+        sum_cpu += ch[i].cpu;
+        n_all += ch[i].n_lat;
+    }
+    all = malloc(sizeof(double) * (n_all + 1));
+    for(i=0, k=0; i<n_chan; i++){
+        memcpy(all + k, ch[i].lat, sizeof(double) * ch[i].n_lat);
+        k += ch[i].n_lat;
+        snprintf(name, sizeof(name), "%d", i);
+        printf_result(fp_res, name, ch[i].lat, ch[i].n_lat, ch[i].peaks,
+                      ch[i].dropped, ch[i].cpu, ch[i].end - t0, total);
+    }
+    printf_result(fp_res, "all", all, n_all, sum_peaks, sum_dropped, sum_cpu,
+                  wall, (double)total * n_chan);
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(fp_res, "# replay_cpu_s=%.3lf\n",ru.ru_utime.tv_sec +
+           ru.ru_utime.tv_usec * 1e-6 + ru.ru_stime.tv_sec +
+           ru.ru_stime.tv_usec * 1e-6);
+    for(i=0; i<n_chan; i++)
+        free(ch[i].lat);
+    free(all);
+    free(ch);
+    free(fds);
+    free(s.text);
+    free(s.off);
+    return 0;
+}
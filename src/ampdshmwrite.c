@@ -0,0 +1,242 @@
+/*
+ * ampdshmwrite.c
+ *
+ * Reference writer of the shared memory sample ring read by ampd --shm, for
+ * local testing in place of the acquisition process. Data files, one value
+ * each line, are the channels. Frames are written at the sampling rate, or
+ * faster, or as fast as the reader takes them.
+ *
+ * Usage from command line:
+ * ampdshmwrite -f [infile] [-f infile2 ...] [options]
+ * Optional inputs: -t [label] : label of the channels, in order of -f
+ *                  -n [name]  : shared memory object, default is /ampd
+ *                  -r [fs]    : sampling rate
+ *                  -x [speed] : 1 is real time, 0 waits for the reader
+ *                  -q         : int16 samples instead of float32
+ *                  -k [frames]: ring capacity
+ *                  -h         : print help
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <math.h>
+#include "shmring.h"
+
+#define MAX_LEN 1024
+#define FBUF 32
+#define DEF_NAME "/ampd"
+#define DEF_SAMPLING_RATE 100
+#define DEF_SPEED 1
+#define DEF_CAPACITY 65536  // frames, 10 min at 100 Hz
+#define BLOCK_S 0.01        // seconds of data written at once, real time
+
+/**
+ * Print general description of input options.
+ */
+void printf_help(){
+
+    printf(
+    "ampdshmwrite\n"
+    "============\n"
+    "Command line utility to write data files into a shared memory sample\n"
+    "ring, as an acquisition process would, for testing ampd --shm. Each\n"
+    "file is a channel. The ring is removed when all data is written, a\n"
+    "reader attached by then gets the rest.\n"
+    "\n"
+    "Basic usage:\n"
+    "ampdshmwrite -f resp.txt -t resp -f puls.txt -t puls -r 100 &\n"
+    "ampd --shm /ampd --channel puls -t puls -o -\n"
+    "\n"
+    "Input options:\n"
+    "-h                 print help\n"
+    "-f [infile]        path/to/input/file, one value each line, repeat for\n"
+    "                   more channels\n"
+    "-t [label]         channel label, in order of -f, eg: resp\n"
+    "-n [name]          shared memory object name, default is /ampd\n"
+    "-r [fs]            sampling rate in Hz, default is 100\n"
+    "-x [speed]         1 is real time, 10 is 10x faster, 0 waits for room\n"
+    "                   in the ring, so a reader loses nothing\n"
+    "-q                 write int16 samples, scaled to the full range\n"
+    "-k [frames]        ring capacity in frames, default is 65536\n"
+    );
+}
+
+static double now_s(){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+/**
+ * Load one value each line of path, return the count, -1 on error.
+ */
+int load_channel(char *path, float **data){
+
+    FILE *fp;
+    char buf[FBUF];
+    int n = 0, alloc = 1 << 16;
+    float *tmp;
+    fp = fopen(path, "r");
+    if(fp == NULL){
+        fprintf(stderr, "cannot open file %s\n",path);
+        return -1;
+    }
+    *data = malloc(sizeof(float) * alloc);
+    while(*data != NULL && fgets(buf, FBUF, fp) != NULL){
+        if(n == alloc){
+            alloc *= 2;
+            tmp = realloc(*data, sizeof(float) * alloc);
+            if(tmp == NULL)
+                free(*data);
+            *data = tmp;
+            if(tmp == NULL)
+                break;
+        }
+        sscanf(buf, "%f\n",*data + n);
+        n++;
+    }
+    fclose(fp);
+    if(*data == NULL){
+        fprintf(stderr, "ampdshmwrite: out of memory\n");
+        return -1;
+    }
+    return n;
+}
+/**
+ * Interleave frames [i, i+k) of the channels into buf, as float or int16.
+ */
+void fill_frames(struct shm_ring *r, float **ch, long i, int k, void *buf){
+
+    int j, c;
+    int nch = r->hdr->channels;
+    float *f = buf;
+    int16_t *q = buf;
+    for(j=0; j<k; j++){
+        for(c=0; c<nch; c++){
+            if(r->hdr->format == SHM_INT16)
+                q[j*nch+c] = (int16_t)lrint(ch[c][i+j] * r->hdr->scale[c]);
+            else
+                f[j*nch+c] = ch[c][i+j];
+        }
+    }
+}
+
+int main(int argc, char **argv){
+
+    int opt, c, k, block;
+    int n_ch = 0, n_label = 0;
+    int format = SHM_FLOAT32;
+    int capacity = DEF_CAPACITY;
+    long i, n, due;
+    double fs = DEF_SAMPLING_RATE;
+    double speed = DEF_SPEED;
+    double t0, maxabs;
+    char name[MAX_LEN] = DEF_NAME;
+    char *infile[SHM_MAX_CH];
+    char *label[SHM_MAX_CH];
+    float *ch[SHM_MAX_CH];
+    void *buf;
+    struct timespec tick = {0, 1000000};
+    struct shm_ring r;
+
+    while((opt = getopt(argc, argv, "hf:t:n:r:x:qk:")) != -1){
+
+        switch(opt){
+            case 'h':
+                printf_help();
+                return 0;
+            case 'f':
+                if(n_ch < SHM_MAX_CH)
+                    infile[n_ch++] = optarg;
+                break;
+            case 't':
+                if(n_label < SHM_MAX_CH)
+                    label[n_label++] = optarg;
+                break;
+            case 'n':
+                strncpy(name, optarg, sizeof(name) - 1);
+                break;
+            case 'r':
+                fs = atof(optarg);
+                break;
+            case 'x':
+                speed = atof(optarg);
+                break;
+            case 'q':
+                format = SHM_INT16;
+                break;
+            case 'k':
+                capacity = atoi(optarg);
+                break;
+        }
+    }
+    if(n_ch == 0){
+        fprintf(stderr,"No input file given.\n\n");
+        printf_help();
+        exit(EXIT_FAILURE);
+    }
+    if(fs <= 0 || speed < 0 || capacity < 1){
+        fprintf(stderr,"Sampling rate, speed and capacity should be "
+                "positive\n");
+        exit(EXIT_FAILURE);
+    }
+    n = -1;
+    for(c=0; c<n_ch; c++){
+        k = load_channel(infile[c], &ch[c]);
+        if(k < 0)
+            exit(EXIT_FAILURE);
+        if(n < 0 || k < n)
+            n = k;
+    }
+    if(shm_ring_create(&r, name, format, n_ch, capacity, fs) != 0)
+        exit(EXIT_FAILURE);
+    for(c=0; c<n_ch; c++){
+        if(c < n_label)
+            strncpy(r.hdr->label[c], label[c], SHM_LABEL_LEN - 1);
+        // int16 full range
+        for(i=0, maxabs=0; i<n && format == SHM_INT16; i++){
+            if(fabs(ch[c][i]) > maxabs)
+                maxabs = fabs(ch[c][i]);
+        }
+        if(format == SHM_INT16 && maxabs > 0)
+            r.hdr->scale[c] = 32767.0 / maxabs;
+    }
+    block = (int)(BLOCK_S * fs * speed) + 1;
+    if(speed == 0 || block > (int)r.hdr->capacity / 4)
+        block = r.hdr->capacity / 4 + 1;
+    buf = malloc((size_t)block * n_ch * sizeof(float));
+    t0 = now_s();
+    for(i=0; i<n; ){
+        due = n;
+        if(speed > 0){
+            due = (long)((now_s() - t0) * fs * speed) + 1;
+            if(due > n)
+                due = n;
+        }
+        // flow control only when asked, an acquisition never waits
+        if(speed == 0 && due - i > (long)shm_ring_room(&r))
+            due = i + shm_ring_room(&r);
+        if(due <= i){
+            nanosleep(&tick, NULL);
+            continue;
+        }
+        k = (due - i > block) ? block : (int)(due - i);
+        fill_frames(&r, ch, i, k, buf);
+        shm_ring_write(&r, buf, k);
+        i += k;
+    }
+    shm_ring_close(&r);
+    // the reader may not have attached yet
+    while(speed == 0 && shm_ring_room(&r) < r.hdr->capacity)
+        nanosleep(&tick, NULL);
+    printf("frames=%ld channels=%d format=%s\n",n,n_ch,
+           (format == SHM_INT16) ? "int16" : "float32");
+    shm_ring_free(&r);
+    for(c=0; c<n_ch; c++)
+        free(ch[c]);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * ampdstat.c
+ *
+ * Utility program for cohort level queries on the rate store that ampd runs
+ * append to with --store, instead of searching and parsing .rate files.
+ *
+ * Usage from command line:
+ * ampdstat -s [store] [options]
+ * Optional inputs: -t [channel]      : only this datatype, eg: resp
+ *                  --from, --to [id] : study ID range, eg: 20200401
+ *                  --study [id,...]  : only these studies
+ *                  --exclude [id,..] : skip these studies
+ *                  -x [file]         : skip studies listed in file
+ *                  --batches         : print every batch instead of summary
+ *                  --compact         : drop superseded runs from the store
+ *                  -h                : print help
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <float.h>
+
+#include "ratestore.h"
+
+#define MAX_LEN 1024
+#define MAX_IDS 4096
+
+#define ARG_FROM 1
+#define ARG_TO 2
+#define ARG_STUDY 3
+#define ARG_EXCLUDE 4
+#define ARG_BATCHES 5
+#define ARG_COMPACT 6
+
+static struct option long_options[] =
+{
+    {"store", required_argument, NULL, 's'},
+    {"datatype", required_argument, NULL, 't'},
+    {"exclude-file", required_argument, NULL, 'x'},
+    {"help", no_argument, NULL, 'h'},
+    {"from", required_argument, NULL, ARG_FROM},
+    {"to", required_argument, NULL, ARG_TO},
+    {"study", required_argument, NULL, ARG_STUDY},
+    {"exclude", required_argument, NULL, ARG_EXCLUDE},
+    {"batches", no_argument, NULL, ARG_BATCHES},
+    {"compact", no_argument, NULL, ARG_COMPACT},
+    {NULL, 0, NULL, 0}
+};
+
+/* list of study IDs, matched on the end of the ID as in rateplot.py */
+struct id_list{
+
+    int n;
+    char *id[MAX_IDS];
+
+};
+
+/* per study and channel summary */
+struct summary{
+
+    int batches;
+    int valid;          // batches with peaks
+    double sum_rate;
+    double min_rate;
+    double max_rate;
+    double sum_lambda;
+    double sum_mean_dist;
+    double sum_stdev_dist;
+
+};
+
+/**
+ * Print general description of input options.
+ */
+void printf_help(){
+
+    printf(
+    "ampdstat\n"
+    "========\n"
+    "Command line utility to query the cohort rate store written by\n"
+    "ampd --store. Only the newest run of each study and channel is used.\n"
+    "Summary lines are: study channel batches mean_rate min_rate max_rate\n"
+    "mean_lambda mean_pk_dist stdev_pk_dist, followed by the cohort mean.\n"
+    "\n"
+    "Basic usage:\n"
+    "ampdstat -s [store] -t [channel] --from [id] --to [id]\n"
+    "\n"
+    "Input options:\n"
+    "-h                 print help\n"
+    "-s [store]         path/to/cohort/store\n"
+    "-t [channel]       datatype, eg: resp, puls\n"
+    "--from [id]        first study, full ID or leading digits, eg: 20200401\n"
+    "--to [id]          last study, full ID or leading digits\n"
+    "--study [ids]      comma separated studies\n"
+    "--exclude [ids]    comma separated studies to skip\n"
+    "-x [file]          skip studies listed in file, eg: scripts/exclude_id\n"
+    "--batches          print every batch: study channel batch start_s rate\n"
+    "                   lambda mean_pk_dist stdev_pk_dist n_peaks\n"
+    "--compact          rewrite the store without superseded runs\n"
+    );
+}
+
+void add_ids(struct id_list *l, char *arg){
+
+    char *tok;
+    tok = strtok(arg, ",");
+    while(tok != NULL && l->n < MAX_IDS){
+        l->id[l->n++] = strdup(tok);
+        tok = strtok(NULL, ",");
+    }
+}
+/**
+ * Read study IDs from an exclude file, skipping comments and blank lines.
+ */
+int read_exclude_file(char *path, struct id_list *l){
+
+    FILE *fp;
+    char line[MAX_LEN];
+    fp = fopen(path, "r");
+    if(fp == NULL){
+        perror("fopen");
+        return -1;
+    }
+    while(fgets(line, sizeof(line), fp) != NULL && l->n < MAX_IDS){
+        if(strchr("# \t\n", line[0]) != NULL)
+            continue;
+        line[strcspn(line, "\r\n")] = '\0';
+        l->id[l->n++] = strdup(line);
+    }
+    fclose(fp);
+    return 0;
+}
+
+int id_listed(struct id_list *l, char *study){
+
+    int i, ls, lid;
+    ls = strnlen(study, RSTORE_ID_LEN);
+    for(i=0; i<l->n; i++){
+        lid = strlen(l->id[i]);
+        if(lid <= ls && strncmp(study + ls - lid, l->id[i], lid) == 0)
+            return 1;
+    }
+    return 0;
+}
+/**
+ * Compare the digits of a study ID with a bound given by its leading digits.
+ */
+int id_cmp(char *study, char *bound){
+
+    char *c = study;
+    while(*c != '\0' && isdigit(*c) == 0)
+        c++;
+    return strncmp(c, bound, strlen(bound));
+}
+
+void printf_summary(char *study, char *channel, struct summary *s){
+
+    int v = (s->valid > 0) ? s->valid : 1;
+    printf("%s\t%s\t%d\t%.2lf\t%.2lf\t%.2lf\t%.2lf\t%.3lf\t%.3lf\n",
+           study, channel, s->batches, s->sum_rate / v,
+           (s->valid > 0) ? s->min_rate : 0, s->max_rate,
+           s->sum_lambda / v, s->sum_mean_dist / v, s->sum_stdev_dist / v);
+}
+
+int main(int argc, char **argv){
+
+    int opt, i;
+    int batches = 0;
+    int compact = 0;
+    int n_studies = 0;
+    char store[MAX_LEN] = {0};
+    char channel[RSTORE_CH_LEN+1] = {0};
+    char from[MAX_LEN] = {0};
+    char to[MAX_LEN] = {0};
+    char cur_study[RSTORE_ID_LEN+1] = {0};
+    char cur_channel[RSTORE_CH_LEN+1] = {0};
+    char *keep;
+    struct id_list include, exclude;
+    struct summary sum, cohort;
+    struct rstore *s;
+    struct rstore_rec *r;
+
+    memset(&include, 0, sizeof(include));
+    memset(&exclude, 0, sizeof(exclude));
+    while((opt = getopt_long(argc, argv, "hs:t:x:", long_options, NULL)) != -1){
+
+        switch(opt){
+            case 'h':
+                printf_help();
+                return 0;
+            case 's':
+                strcpy(store, optarg);
+                break;
+            case 't':
+                strncpy(channel, optarg, RSTORE_CH_LEN);
+                break;
+            case 'x':
+                if(read_exclude_file(optarg, &exclude) != 0)
+                    exit(EXIT_FAILURE);
+                break;
+            case ARG_FROM:
+                strcpy(from, optarg);
+                break;
+            case ARG_TO:
+                strcpy(to, optarg);
+                break;
+            case ARG_STUDY:
+                add_ids(&include, optarg);
+                break;
+            case ARG_EXCLUDE:
+                add_ids(&exclude, optarg);
+                break;
+            case ARG_BATCHES:
+                batches = 1;
+                break;
+            case ARG_COMPACT:
+                compact = 1;
+                break;
+        }
+    }
+    if(strcmp(store,"")==0){
+        fprintf(stderr,"No store given.\n\n");
+        printf_help();
+        exit(EXIT_FAILURE);
+    }
+    if(compact == 1){
+        if(rstore_compact(store) != 0){
+            fprintf(stderr, "cannot compact %s\n",store);
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+    s = rstore_load(store);
+    if(s == NULL)
+        exit(EXIT_FAILURE);
+    keep = malloc(s->n + 1);
+    rstore_newest(s, keep);
+
+    memset(&sum, 0, sizeof(sum));
+    memset(&cohort, 0, sizeof(cohort));
+    cohort.min_rate = DBL_MAX;
+    for(i=0; i<s->n; i++){
+        r = &s->rec[i];
+        if(keep[i] == 0)
+            continue;
+        if(channel[0] != '\0' &&
+           strncmp(r->channel, channel, RSTORE_CH_LEN) != 0)
+            continue;
+        if(include.n > 0 && id_listed(&include, r->study) == 0)
+            continue;
+        if(id_listed(&exclude, r->study) == 1)
+            continue;
+        if(from[0] != '\0' && id_cmp(r->study, from) < 0)
+            continue;
+        if(to[0] != '\0' && id_cmp(r->study, to) > 0)
+            continue;
+        if(batches == 1){
+            printf("%.*s\t%.*s\t%u\t%.2lf\t%.2f\t%d\t%.3f\t%.3f\t%d\n",
+                   RSTORE_ID_LEN, r->study, RSTORE_CH_LEN, r->channel,
+                   r->batch, r->start / r->sampling_rate, r->rate, r->lambda,
+                   r->mean_pk_dist, r->stdev_pk_dist, r->n_peaks);
+            continue;
+        }
+        // records are sorted by study and channel, flush on change
+        if(strncmp(cur_study, r->study, RSTORE_ID_LEN) != 0 ||
+           strncmp(cur_channel, r->channel, RSTORE_CH_LEN) != 0){
+            if(sum.batches > 0){
+                printf_summary(cur_study, cur_channel, &sum);
+                n_studies++;
+            }
+            memset(&sum, 0, sizeof(sum));
+            sum.min_rate = DBL_MAX;
+            strncpy(cur_study, r->study, RSTORE_ID_LEN);
+            strncpy(cur_channel, r->channel, RSTORE_CH_LEN);
+        }
+        sum.batches++;
+        cohort.batches++;
+        if(r->n_peaks <= 0)
+            continue;
+        sum.valid++;
+        sum.sum_rate += r->rate;
+        sum.min_rate = (r->rate < sum.min_rate) ? r->rate : sum.min_rate;
+        sum.max_rate = (r->rate > sum.max_rate) ? r->rate : sum.max_rate;
+        sum.sum_lambda += r->lambda;
+        sum.sum_mean_dist += r->mean_pk_dist;
+        sum.sum_stdev_dist += r->stdev_pk_dist;
+        cohort.valid++;
+        cohort.sum_rate += r->rate;
+        cohort.min_rate = (r->rate < cohort.min_rate) ? r->rate:cohort.min_rate;
+        cohort.max_rate = (r->rate > cohort.max_rate) ? r->rate:cohort.max_rate;
+        cohort.sum_lambda += r->lambda;
+        cohort.sum_mean_dist += r->mean_pk_dist;
+        cohort.sum_stdev_dist += r->stdev_pk_dist;
+    }
+    if(batches == 0){
+        if(sum.batches > 0){
+            printf_summary(cur_study, cur_channel, &sum);
+            n_studies++;
+        }
+        printf("# series=%d\n",n_studies);
+        printf_summary("all", (channel[0] != '\0') ? channel : "all", &cohort);
+    }
+    free(keep);
+    rstore_free(s);
+    return 0;
+}
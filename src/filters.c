@@ -4,6 +4,7 @@
  *
  */
 
+#include <string.h>
 #include "filters.h"
 
 /**
@@ -17,19 +18,9 @@
  */
 void tdlpfilt(float *data, int n, double sample_rate, double cutoff_freq){
 
-    int i;
-    float rc = 1.0 / (cutoff_freq * 2*3.14);
-    float dt = 1.0 / sample_rate;
-    float alpha = dt / (rc + dt);
-    float *buf = malloc(sizeof(float) * n);
-    
-    for(i=0; i<n; i++){
-        buf[i] = data[i];
-    }
-    for(i=1; i<n; i++){
-        data[i] = data[i-1] + alpha * (buf[i] - data[i-1]);
-    }
-    free(buf);
+    struct rcfilt_state s;
+    tdlpfilt_init(&s, sample_rate, cutoff_freq);
+    tdlpfilt_chunk(&s, data, n);
 }
 
 /**
@@ -43,19 +34,82 @@ void tdlpfilt(float *data, int n, double sample_rate, double cutoff_freq){
  */
 void tdhpfilt(float *data, int n, double sample_rate, double cutoff_freq){
 
-    int i;
+    struct rcfilt_state s;
+    tdhpfilt_init(&s, sample_rate, cutoff_freq);
+    tdhpfilt_chunk(&s, data, n);
+}
+
+void tdlpfilt_init(struct rcfilt_state *s, double sample_rate,
+                   double cutoff_freq){
+
     float rc = 1.0 / (cutoff_freq * 2*3.14);
     float dt = 1.0 / sample_rate;
-    float alpha = rc / (rc + dt);
-    float *buf = malloc(sizeof(float) * n);
-    
-    for(i=0; i<n; i++){
-        buf[i] = data[i];
+    s->alpha = dt / (rc + dt);
+    s->started = 0;
+}
+
+void tdhpfilt_init(struct rcfilt_state *s, double sample_rate,
+                   double cutoff_freq){
+
+    float rc = 1.0 / (cutoff_freq * 2*3.14);
+    float dt = 1.0 / sample_rate;
+    s->alpha = rc / (rc + dt);
+    s->started = 0;
+}
+/**
+ * Low pass filter the next chunk in place. The first sample of the data is
+ * passed through.
+ */
+void tdlpfilt_chunk(struct rcfilt_state *s, float *data, int n){
+
+    int i = 0;
+    float alpha = s->alpha;
+    if(n <= 0)
+        return;
+    if(s->started == 0){
+        s->prev_out = data[0];
+        s->started = 1;
+        i = 1;
     }
-    for(i=1; i<n; i++){
-        data[i] = alpha * (data[i-1] + buf[i] - buf[i-1]);
+    for(; i<n; i++){
+        data[i] = s->prev_out + alpha * (data[i] - s->prev_out);
+        s->prev_out = data[i];
+    }
+}
+/**
+ * High pass filter the next chunk in place. The first sample of the data is
+ * passed through.
+ */
+void tdhpfilt_chunk(struct rcfilt_state *s, float *data, int n){
+
+    int i = 0;
+    float in;
+    float alpha = s->alpha;
+    if(n <= 0)
+        return;
+    if(s->started == 0){
+        s->prev_in = data[0];
+        s->prev_out = data[0];
+        s->started = 1;
+        i = 1;
+    }
+    for(; i<n; i++){
+        in = data[i];
+        data[i] = alpha * (s->prev_out + in - s->prev_in);
+        s->prev_in = in;
+        s->prev_out = data[i];
     }
-    free(buf);
+}
+/**
+ * Mean of x[0] ... x[2*w], summed in order.
+ */
+static inline float mavg_sum(const float *x, int w){
+
+    int j;
+    float sum = 0.0;
+    for(j=0; j<w*2+1; j++)
+        sum += x[j]/(2*w+1);
+    return sum;
 }
 /**
  * Apply moving average smoothing to floating point uniformly sampled data.
@@ -69,10 +123,10 @@ void tdhpfilt(float *data, int n, double sample_rate, double cutoff_freq){
 void movingavg(float *data, int n, int w){
 
     float *buf;
-    int i, j;
+    int i;
     /* from data x0 x1 x2 x3 x4 x5 ...
-     * make buffer of n+2*w length
-     * xw x(w-1) ... x1 x0 x1 x2 x3 ...
+     * make buffer of n+2*w length, mirrored at both ends
+     * xw x(w-1) ... x1 x0 x1 x2 x3 ... x(n-1) x(n-2) ... x(n-1-w)
      *
      */
     buf = malloc(sizeof(float)*(n+2*w));
@@ -81,20 +135,71 @@ void movingavg(float *data, int n, int w){
     // fill  end points for buffer
     for(i=0; i<w; i++){
         buf[i] = data[w-i]; // start
-        buf[n+i] = data[n-i];  // end
-    }
-    for(i=0; i<n; i++){
-        data[i] = 0.0;
-        for(j=0; j<w*2+1; j++){
-            data[i] += buf[i+j]/(2*w+1);
-        }
-    }
-    for(i=0; i<n; i++){
-        //printf("%lf\n",buf[i]);
+        buf[n+w+i] = data[n-2-i];  // end
     }
+    for(i=0; i<n; i++)
+        data[i] = mavg_sum(buf + i, w);
     free(buf);
 }
 
+int movingavg_init(struct mavg_state *s, int w, int max_chunk){
+
+    s->w = w;
+    s->started = 0;
+    s->len = 0;
+    s->buf = malloc(sizeof(float) * (3*w + max_chunk));
+    return (s->buf == NULL) ? -1 : 0;
+}
+/**
+ * Smooth the next chunk of in, same as movingavg. The average around a sample
+ * needs the next w samples, so out gets n outputs lagging by w, except the
+ * first chunk which has w less.
+ */
+int movingavg_chunk(struct mavg_state *s, float *in, int n, float *out){
+
+    int i, m;
+    int w = s->w;
+    if(s->started == 0){
+        if(n <= w)
+            return -1;
+        for(i=0; i<w; i++)
+            s->buf[i] = in[w-i];
+        s->len = w;
+        s->started = 1;
+    }
+    memcpy(s->buf + s->len, in, sizeof(float) * n);
+    s->len += n;
+    m = s->len - 2*w;
+    if(m <= 0)
+        return 0;
+    for(i=0; i<m; i++)
+        out[i] = mavg_sum(s->buf + i, w);
+    memmove(s->buf, s->buf + m, sizeof(float) * 2*w);
+    s->len = 2*w;
+    return m;
+}
+/**
+ * Last w outputs, with the end of data mirrored as in movingavg.
+ */
+int movingavg_flush(struct mavg_state *s, float *out){
+
+    int i;
+    int w = s->w;
+    if(s->started == 0)
+        return 0;
+    for(i=0; i<w; i++)
+        s->buf[s->len + i] = s->buf[s->len - 2 - i];
+    for(i=0; i<w; i++)
+        out[i] = mavg_sum(s->buf + i + s->len - 2*w, w);
+    return w;
+}
+
+void movingavg_free(struct mavg_state *s){
+
+    free(s->buf);
+    s->buf = NULL;
+}
+
 /**
  * Apply Savicky-Golay filter to uniformly sampled input data of length n,
  * by use of Gram-polynomials. End points are treated without truncation. 
@@ -13,4 +13,41 @@ void movingavg(float *data, int n, int w);
 void tdlpfilt(float *data, int n, double sample_rate, double cutoff_freq);
 void tdhpfilt(float *data, int n, double sample_rate, double cutoff_freq);
 
+/*
+ * Streaming versions: the data is given in consecutive chunks, the state is
+ * carried across chunk boundaries, so the result is the same as filtering
+ * the whole data at once.
+ */
+struct rcfilt_state{
+
+    float alpha;
+    float prev_in;
+    float prev_out;
+    int started;
+
+};
+
+struct mavg_state{
+
+    int w;
+    int started;
+    int len;        // samples in buf
+    float *buf;     // last 2*w samples, followed by the next chunk
+
+};
+
+void tdlpfilt_init(struct rcfilt_state *s, double sample_rate,
+                   double cutoff_freq);
+void tdhpfilt_init(struct rcfilt_state *s, double sample_rate,
+                   double cutoff_freq);
+void tdlpfilt_chunk(struct rcfilt_state *s, float *data, int n);
+void tdhpfilt_chunk(struct rcfilt_state *s, float *data, int n);
+/* chunks are at most max_chunk long, the first one longer than w */
+int movingavg_init(struct mavg_state *s, int w, int max_chunk);
+/* output lags the input by w samples, return the number of outputs */
+int movingavg_chunk(struct mavg_state *s, float *in, int n, float *out);
+/* last w outputs at the end of data */
+int movingavg_flush(struct mavg_state *s, float *out);
+void movingavg_free(struct mavg_state *s);
+
 void sgfilt(float *data, int n, int w, int p);
@@ -0,0 +1,100 @@
+/*
+ * lod.c
+ *
+ * Min/max level of detail pyramid, see lod.h.
+ */
+#include <string.h>
+#include "lod.h"
+
+/**
+ * Reduce src of n min/max pairs to ceil(n/LOD_FACTOR) pairs in dst.
+ */
+static uint64_t reduce_level(float *src, uint64_t n, float *dst){
+
+    uint64_t i, j, m;
+    float mn, mx;
+    m = (n + LOD_FACTOR - 1) / LOD_FACTOR;
+    for(i=0; i<m; i++){
+        mn = src[2*i*LOD_FACTOR];
+        mx = src[2*i*LOD_FACTOR+1];
+        for(j=i*LOD_FACTOR+1; j<(i+1)*LOD_FACTOR && j<n; j++){
+            mn = (src[2*j] < mn) ? src[2*j] : mn;
+            mx = (src[2*j+1] > mx) ? src[2*j+1] : mx;
+        }
+        dst[2*i] = mn;
+        dst[2*i+1] = mx;
+    }
+    return m;
+}
+/**
+ * Build all levels and write them to path. The first level is made from the
+ * samples, each further one from the previous level. Return 0 on success.
+ */
+int save_lod(char *path, float *data, int16_t *q, double q_scale, int datalen,
+             double sampling_rate){
+
+    FILE *fp;
+    struct lod_header hdr;
+    float *lv[LOD_MAX_LEVELS];
+    float v, mn, mx;
+    uint64_t i, j, n, off;
+    uint32_t k;
+    int ret = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memset(lv, 0, sizeof(lv));
+    memcpy(hdr.magic, LOD_MAGIC, sizeof(hdr.magic));
+    hdr.factor = LOD_FACTOR;
+    hdr.datalen = datalen;
+    hdr.sampling_rate = sampling_rate;
+    if(datalen <= 0)
+        return -1;
+    // level 0 from samples
+    n = (datalen + LOD_FACTOR - 1) / LOD_FACTOR;
+    lv[0] = malloc(sizeof(float) * 2 * n);
+    if(lv[0] == NULL)
+        return -1;
+    for(i=0; i<n; i++){
+        mn = 0; mx = 0;
+        for(j=i*LOD_FACTOR; j<(i+1)*LOD_FACTOR && j<(uint64_t)datalen; j++){
+            v = (q != NULL) ? (float)(q[j] / q_scale) : data[j];
+            if(j == i*LOD_FACTOR || v < mn)
+                mn = v;
+            if(j == i*LOD_FACTOR || v > mx)
+                mx = v;
+        }
+        lv[0][2*i] = mn;
+        lv[0][2*i+1] = mx;
+    }
+    hdr.count[0] = n;
+    hdr.levels = 1;
+    for(k=1; k<LOD_MAX_LEVELS && hdr.count[k-1] > LOD_MIN_BINS; k++){
+        lv[k] = malloc(sizeof(float) * 2 * (hdr.count[k-1] / LOD_FACTOR + 1));
+        if(lv[k] == NULL){
+            ret = -1;
+            break;
+        }
+        hdr.count[k] = reduce_level(lv[k-1], hdr.count[k-1], lv[k]);
+        hdr.levels++;
+    }
+    off = sizeof(hdr);
+    for(k=0; k<hdr.levels; k++){
+        hdr.offset[k] = off;
+        off += hdr.count[k] * 2 * sizeof(float);
+    }
+    fp = (ret == 0) ? fopen(path, "wb") : NULL;
+    if(fp == NULL){
+        ret = -1;
+    } else {
+        if(fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+            ret = -1;
+        for(k=0; k<hdr.levels && ret == 0; k++){
+            if(fwrite(lv[k], sizeof(float)*2, hdr.count[k], fp)!=hdr.count[k])
+                ret = -1;
+        }
+        fclose(fp);
+    }
+    for(k=0; k<LOD_MAX_LEVELS; k++)
+        free(lv[k]);
+    return ret;
+}
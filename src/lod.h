@@ -0,0 +1,38 @@
+/*
+ * lod.h
+ *
+ * Level of detail pyramid of the raw data, for plotting whole recordings.
+ * Level k holds the minimum and maximum of every LOD_FACTOR^(k+1) samples,
+ * so a plot of any time range reads only the level with about as many bins
+ * as pixels. Levels are added until a level has at most LOD_MIN_BINS bins.
+ *
+ * File layout, little endian, made for memory mapping (numpy.memmap):
+ *
+ * header:  struct lod_header
+ * levels:  count[k] x {float min, float max} at byte offset[k]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define LOD_MAGIC "AMPDLOD1"
+#define LOD_FACTOR 4
+#define LOD_MAX_LEVELS 16
+#define LOD_MIN_BINS 256
+
+struct lod_header{
+
+    char magic[8];
+    uint32_t factor;
+    uint32_t levels;
+    uint32_t datalen;
+    uint32_t reserved;
+    double sampling_rate;
+    uint64_t count[LOD_MAX_LEVELS];     // bins in level
+    uint64_t offset[LOD_MAX_LEVELS];    // byte offset of level in file
+
+};
+
+/* build the pyramid from float data, or int16 data q scaled by q_scale*/
+int save_lod(char *path, float *data, int16_t *q, double q_scale, int datalen,
+             double sampling_rate);
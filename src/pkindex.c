@@ -0,0 +1,229 @@
+/*
+ * pkindex.c
+ *
+ * Binary peak index writer and queries, see pkindex.h for the layout.
+ */
+#include <string.h>
+#include <math.h>
+#include "pkindex.h"
+
+/**
+ * Append v to the stream as a LEB128 varint, growing the stream if needed.
+ */
+static int put_varint(struct pkx_writer *w, uint32_t v){
+
+    uint8_t *tmp;
+    size_t len = w->hdr.stream_len;
+    if(len + 5 > w->stream_alloc){
+        w->stream_alloc = (w->stream_alloc == 0) ? 4096 : w->stream_alloc * 2;
+        tmp = realloc(w->stream, w->stream_alloc);
+        if(tmp == NULL)
+            return -1;
+        w->stream = tmp;
+    }
+    while(v >= 0x80){
+        w->stream[len++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    w->stream[len++] = (uint8_t)v;
+    w->hdr.stream_len = len;
+    return 0;
+}
+/**
+ * Decode a varint at *p and advance *p.
+ */
+static inline uint32_t get_varint(uint8_t **p){
+
+    uint32_t v = 0;
+    int shift = 0;
+    uint8_t b;
+    do{
+        b = *(*p)++;
+        v |= (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while(b & 0x80);
+    return v;
+}
+/**
+ * Start a new index at path. Nothing is written until pkx_close.
+ */
+struct pkx_writer *pkx_open(char *path, double sampling_rate, int datalen){
+
+    struct pkx_writer *w;
+    w = calloc(1, sizeof(struct pkx_writer));
+    if(w == NULL)
+        return NULL;
+    w->path = strdup(path);
+    memcpy(w->hdr.magic, PKX_MAGIC, sizeof(w->hdr.magic));
+    w->hdr.stride = PKX_STRIDE;
+    w->hdr.datalen = (uint32_t)datalen;
+    w->hdr.sampling_rate = sampling_rate;
+    return w;
+}
+/**
+ * Add the next peak index. Indices must be increasing, a peak found again in
+ * the next batch is skipped, as are indices out of the recording if its
+ * length is known. Return 0 on success, -1 on malloc failure.
+ */
+int pkx_add(struct pkx_writer *w, int ind){
+
+    struct pkx_block *tmp;
+    uint32_t n = w->hdr.n_peaks;
+    if(ind < 0 || (n > 0 && (uint32_t)ind <= w->last) ||
+       (w->hdr.datalen > 0 && (uint32_t)ind >= w->hdr.datalen))
+        return 0;
+    if(n % w->hdr.stride == 0){
+        if(w->hdr.n_blocks == w->blocks_alloc){
+            w->blocks_alloc = (w->blocks_alloc == 0) ? 64 : w->blocks_alloc*2;
+            tmp = realloc(w->blocks, sizeof(struct pkx_block)*w->blocks_alloc);
+            if(tmp == NULL)
+                return -1;
+            w->blocks = tmp;
+        }
+        w->blocks[w->hdr.n_blocks].first = (uint32_t)ind;
+        w->blocks[w->hdr.n_blocks].offset = (uint32_t)w->hdr.stream_len;
+        w->hdr.n_blocks++;
+    } else {
+        if(put_varint(w, (uint32_t)ind - w->last) != 0)
+            return -1;
+    }
+    w->last = (uint32_t)ind;
+    w->hdr.n_peaks++;
+    return 0;
+}
+/**
+ * Write the index to file and free the writer. Return 0 on success.
+ */
+int pkx_close(struct pkx_writer *w){
+
+    FILE *fp;
+    int ret = 0;
+    fp = fopen(w->path, "wb");
+    if(fp == NULL){
+        fprintf(stderr, "cannot open file for writing %s\n",w->path);
+        ret = -1;
+    } else {
+        if(fwrite(&w->hdr, sizeof(w->hdr), 1, fp) != 1 ||
+           fwrite(w->blocks, sizeof(struct pkx_block), w->hdr.n_blocks, fp)
+                != w->hdr.n_blocks ||
+           fwrite(w->stream, 1, w->hdr.stream_len, fp) != w->hdr.stream_len)
+            ret = -1;
+        fclose(fp);
+    }
+    free(w->blocks);
+    free(w->stream);
+    free(w->path);
+    free(w);
+    return ret;
+}
+/**
+ * Load an index from file, return NULL if it cannot be read.
+ */
+struct pkx_index *pkx_load(char *path){
+
+    FILE *fp;
+    struct pkx_index *x;
+    fp = fopen(path, "rb");
+    if(fp == NULL){
+        fprintf(stderr, "cannot open file %s\n",path);
+        return NULL;
+    }
+    x = calloc(1, sizeof(struct pkx_index));
+    if(fread(&x->hdr, sizeof(x->hdr), 1, fp) != 1 ||
+       memcmp(x->hdr.magic, PKX_MAGIC, sizeof(x->hdr.magic)) != 0 ||
+       x->hdr.stride == 0){
+        fprintf(stderr, "%s is not a peak index\n",path);
+        fclose(fp);
+        free(x);
+        return NULL;
+    }
+    x->blocks = malloc(sizeof(struct pkx_block) * (x->hdr.n_blocks + 1));
+    x->stream = malloc(x->hdr.stream_len + 1);
+    if(fread(x->blocks, sizeof(struct pkx_block), x->hdr.n_blocks, fp)
+            != x->hdr.n_blocks ||
+       fread(x->stream, 1, x->hdr.stream_len, fp) != x->hdr.stream_len){
+        fprintf(stderr, "%s is truncated\n",path);
+        fclose(fp);
+        pkx_free(x);
+        return NULL;
+    }
+    fclose(fp);
+    return x;
+}
+
+void pkx_free(struct pkx_index *x){
+
+    if(x == NULL)
+        return;
+    free(x->blocks);
+    free(x->stream);
+    free(x);
+}
+/**
+ * Number of peaks at sample indices below s. Binary search for the last block
+ * starting below s, then decode the rest within that block.
+ */
+int pkx_rank(struct pkx_index *x, long s){
+
+    int lo, hi, mid, j, size;
+    long cur;
+    uint8_t *p;
+    int n_blocks = (int)x->hdr.n_blocks;
+    int stride = (int)x->hdr.stride;
+    if(n_blocks == 0 || s <= (long)x->blocks[0].first)
+        return 0;
+    lo = 0;
+    hi = n_blocks - 1;
+    while(lo < hi){
+        mid = (lo + hi + 1) / 2;
+        if((long)x->blocks[mid].first < s)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    size = (int)x->hdr.n_peaks - lo * stride;
+    if(size > stride)
+        size = stride;
+    cur = x->blocks[lo].first;
+    p = x->stream + x->blocks[lo].offset;
+    for(j=1; j<size; j++){
+        cur += get_varint(&p);
+        if(cur >= s)
+            break;
+    }
+    return lo * stride + j;
+}
+
+int pkx_count(struct pkx_index *x, double t0, double t1){
+
+    double fs = x->hdr.sampling_rate;
+    if(t1 <= t0)
+        return 0;
+    return pkx_rank(x, (long)ceil(t1 * fs)) - pkx_rank(x, (long)ceil(t0 * fs));
+}
+
+double pkx_rate(struct pkx_index *x, double t0, double t1){
+
+    if(t1 <= t0)
+        return 0;
+    return (double)pkx_count(x, t0, t1) / (t1 - t0) * 60.0;
+}
+/**
+ * Fill counts with the peaks in windows [i*w, (i+1)*w) seconds. Return the
+ * number of windows covering the recording, at most n_windows are filled.
+ */
+int pkx_rollup(struct pkx_index *x, double w, int *counts, int n_windows){
+
+    int i, n, r0, r1;
+    double dur = x->hdr.datalen / x->hdr.sampling_rate;
+    if(w <= 0)
+        return 0;
+    n = (int)ceil(dur / w);
+    r0 = 0;
+    for(i=0; i<n && i<n_windows; i++){
+        r1 = pkx_rank(x, (long)ceil((i+1) * w * x->hdr.sampling_rate));
+        counts[i] = r1 - r0;
+        r0 = r1;
+    }
+    return n;
+}
@@ -0,0 +1,78 @@
+/*
+ * pkindex.h
+ *
+ * Binary peak index, written by ampd next to the .peaks file. Peak indices
+ * are delta encoded as varints in blocks of PKX_STRIDE peaks, and a block
+ * table keeps the first peak index and stream offset of each block. The
+ * number of peaks before any sample is then found by a binary search on the
+ * block table and decoding at most one block, so counts and rates over
+ * arbitrary time ranges need neither the .peaks text nor reprocessing.
+ *
+ * File layout, little endian:
+ *
+ * header:      struct pkx_header
+ * block table: n_blocks x {uint32 first peak index, uint32 stream offset}
+ * stream:      for each block, varint deltas of the peaks after the first
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define PKX_MAGIC "AMPDPKX1"
+#define PKX_STRIDE 64       // peaks per block, prefix count is block*stride
+
+struct pkx_header{
+
+    char magic[8];
+    uint32_t stride;
+    uint32_t n_peaks;
+    uint32_t n_blocks;
+    uint32_t datalen;       // samples in the recording
+    double sampling_rate;
+    uint64_t stream_len;    // bytes
+
+};
+
+struct pkx_block{
+
+    uint32_t first;         // absolute sample index of the first peak
+    uint32_t offset;        // byte offset of the block deltas in the stream
+
+};
+
+/* index being written, peaks are added in increasing order */
+struct pkx_writer{
+
+    FILE *fp;
+    char *path;
+    struct pkx_header hdr;
+    struct pkx_block *blocks;
+    uint32_t blocks_alloc;
+    uint8_t *stream;
+    size_t stream_alloc;
+    uint32_t last;
+
+};
+
+/* index loaded for queries */
+struct pkx_index{
+
+    struct pkx_header hdr;
+    struct pkx_block *blocks;
+    uint8_t *stream;
+
+};
+
+struct pkx_writer *pkx_open(char *path, double sampling_rate, int datalen);
+int pkx_add(struct pkx_writer *w, int ind);
+int pkx_close(struct pkx_writer *w);
+
+struct pkx_index *pkx_load(char *path);
+void pkx_free(struct pkx_index *x);
+/* number of peaks at sample indices below s */
+int pkx_rank(struct pkx_index *x, long s);
+/* peaks between t0 and t1 seconds, t1 exclusive; rate in peaks per min */
+int pkx_count(struct pkx_index *x, double t0, double t1);
+double pkx_rate(struct pkx_index *x, double t0, double t1);
+/* peak counts in consecutive windows of w seconds over the recording */
+int pkx_rollup(struct pkx_index *x, double w, int *counts, int n_windows);
@@ -0,0 +1,110 @@
+/*
+ * pkstats.c
+ *
+ * Running inter-peak interval statistics, see pkstats.h.
+ */
+#include <string.h>
+#include <math.h>
+#include "pkstats.h"
+
+static const double quantiles[PKS_NQ] = {0.05, 0.25, 0.5, 0.75, 0.95};
+
+/* log of the bucket growth factor (1+a)/(1-a)*/
+static double log_gamma(){
+
+    return log((1.0 + PKS_ALPHA) / (1.0 - PKS_ALPHA));
+}
+
+void pks_init(struct pk_stats *s){
+
+    memset(s, 0, sizeof(struct pk_stats));
+}
+
+void pks_add(struct pk_stats *s, double x){
+
+    int i;
+    double d;
+    s->n++;
+    d = x - s->mean;
+    s->mean += d / (double)s->n;
+    s->m2 += d * (x - s->mean);
+    if(s->n == 1 || x < s->min)
+        s->min = x;
+    if(s->n == 1 || x > s->max)
+        s->max = x;
+    i = (x > PKS_MIN) ? (int)ceil(log(x / PKS_MIN) / log_gamma()) - 1 : 0;
+    if(i < 0)
+        i = 0;
+    if(i >= PKS_BINS)
+        i = PKS_BINS - 1;
+    s->bin[i]++;
+}
+
+void pks_add_peaks(struct pk_stats *s, int *pks, int n, double fs){
+
+    int i;
+    for(i=1; i<n; i++)
+        pks_add(s, (double)(pks[i] - pks[i-1]) / fs);
+}
+
+void pks_merge(struct pk_stats *s, const struct pk_stats *o){
+
+    int i;
+    long n;
+    double d;
+    if(o->n == 0)
+        return;
+    if(s->n == 0){
+        memcpy(s, o, sizeof(struct pk_stats));
+        return;
+    }
+    n = s->n + o->n;
+    d = o->mean - s->mean;
+    s->mean += d * (double)o->n / (double)n;
+    s->m2 += o->m2 + d * d * (double)s->n * (double)o->n / (double)n;
+    s->n = n;
+    if(o->min < s->min)
+        s->min = o->min;
+    if(o->max > s->max)
+        s->max = o->max;
+    for(i=0; i<PKS_BINS; i++)
+        s->bin[i] += o->bin[i];
+}
+
+double pks_stdev(const struct pk_stats *s){
+
+    return (s->n > 0) ? sqrt(s->m2 / (double)s->n) : 0.0;
+}
+/**
+ * Nearest rank quantile. The bucket of the rank is found by a prefix sum, its
+ * value is the point within relative error a of both bucket edges, limited by
+ * the smallest and largest interval seen.
+ */
+double pks_quantile(const struct pk_stats *s, double q){
+
+    int i;
+    long rank, count = 0;
+    double g, v;
+    if(s->n == 0)
+        return 0.0;
+    rank = (long)(q * (double)(s->n - 1));
+    for(i=0; i<PKS_BINS-1; i++){
+        count += s->bin[i];
+        if(count > rank)
+            break;
+    }
+    g = exp(log_gamma());
+    v = PKS_MIN * exp(log_gamma() * (double)(i + 1)) * 2.0 / (1.0 + g);
+    if(v < s->min)
+        v = s->min;
+    if(v > s->max)
+        v = s->max;
+    return v;
+}
+
+void pks_summary(const struct pk_stats *s, double *q){
+
+    int i;
+    for(i=0; i<PKS_NQ; i++)
+        q[i] = pks_quantile(s, quantiles[i]);
+}
@@ -0,0 +1,43 @@
+/*
+ * pkstats.h
+ *
+ * Running statistics of inter-peak intervals in constant memory. Moments are
+ * kept with Welford's update, quantiles with a log bucketed sketch: bucket i
+ * counts intervals in (PKS_MIN * g^i, PKS_MIN * g^(i+1)], g = (1+a)/(1-a), so
+ * any quantile is within relative error a (PKS_ALPHA) of the true one. Adding
+ * an interval is O(1). Two sketches are merged by adding the bucket counts and
+ * combining the moments, so windows computed on separate threads add up to
+ * the statistics of the whole recording without keeping the peaks.
+ */
+#include <stdlib.h>
+
+#define PKS_ALPHA 0.01      // relative error of quantiles
+#define PKS_MIN 1e-3        // seconds, shorter intervals go to the first
+#define PKS_BINS 691        // up to 1000 s, longer ones go to the last
+
+/* quantiles saved for each window and the recording: p05 p25 median p75 p95*/
+#define PKS_NQ 5
+
+struct pk_stats{
+
+    long n;
+    double mean;
+    double m2;              // sum of squared differences from the mean
+    double min;
+    double max;
+    unsigned int bin[PKS_BINS];
+
+};
+
+void pks_init(struct pk_stats *s);
+/* add one interval, in seconds */
+void pks_add(struct pk_stats *s, double x);
+/* add the intervals between n sorted peak indices at sampling rate fs */
+void pks_add_peaks(struct pk_stats *s, int *pks, int n, double fs);
+/* s = s + o*/
+void pks_merge(struct pk_stats *s, const struct pk_stats *o);
+double pks_stdev(const struct pk_stats *s);
+/* quantile q in [0,1], 0 if there are no intervals*/
+double pks_quantile(const struct pk_stats *s, double q);
+/* the PKS_NQ quantiles into q*/
+void pks_summary(const struct pk_stats *s, double *q);
@@ -0,0 +1,214 @@
+/*
+ * plan.c
+ *
+ * Execution planner for ampd, see plan.h
+ *
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include "ampdr.h"
+#include "plan.h"
+
+/**
+ * Estimate memory needed by one worker thread for a batch of n samples,
+ * in bytes: batch data, sigma, peaks, gamma and the LMS itself.
+ */
+double plan_worker_mem(int n, int kernel){
+
+    double l = (double)(n/2 - 1);
+    double mem;
+    mem = (double)n * (sizeof(float) + sizeof(double) + sizeof(int));
+    mem += l * 2 * sizeof(double);
+    if(kernel == AMPD_KERNEL_LANES)
+        mem += (double)n * sizeof(float);   // interleaved copy
+    else if(kernel == AMPD_KERNEL_I16)
+        mem += (double)n * sizeof(int16_t); // quantized copy
+    else if(kernel == AMPD_KERNEL_DENSE)
+        mem += l * (double)n * sizeof(float) + l * sizeof(float *);
+    else if(kernel == AMPD_KERNEL_BITPACK)
+        mem += l * (double)((n + 63) / 64) * sizeof(uint64_t);
+    return mem;
+}
+
+const char *plan_kernel_name(int kernel){
+
+    switch(kernel){
+        case AMPD_KERNEL_DENSE:
+            return "dense";
+        case AMPD_KERNEL_BITPACK:
+            return "bitpack";
+        case AMPD_KERNEL_MATFREE:
+            return "matfree";
+        case AMPD_KERNEL_LANES:
+            return "lanes";
+        case AMPD_KERNEL_I16:
+            return "i16";
+        case AMPD_KERNEL_APPROX:
+            return "approx";
+    }
+    return "unknown";
+}
+/**
+ * Choose the LMS kernel, batch length and thread count.
+ *
+ * The kernels only visit the local maxima for gamma, so the matrix free one
+ * is the fastest single window kernel. If there are enough batches to give
+ * every thread full groups of p->lanes windows, these are run together with
+ * the lanes kernel, the rest with matfree. The dense LMS is used for
+ * --output-lms, or any kernel can be requested with kernel_req. With int16
+ * requested the int16 kernel is used instead of matfree and lanes, the same
+ * goes for approx. Dual polarity runs keep two scalograms and have no dense,
+ * lanes, int16 or approx kernel. Adaptive windows vary in length, so they
+ * only have the matrix free, int16 and approx kernels, sized for the batch
+ * length.
+ *
+ * Threads are reduced until the budget is met, then the batch length is
+ * halved down to PLAN_MIN_BATCH_LENGTH. A batch longer than the data is
+ * shortened to the data length.
+ *
+ * Return 0 on success, -1 if there is no configuration within the budget.
+ */
+int make_plan(struct ampd_plan *p){
+
+    double pol = 1.0;       // number of polarities
+    int min_n;
+    long ncpu, pages, page_size;
+
+    p->adjusted = 0;
+    if(p->max_mem <= 0){
+        pages = sysconf(_SC_PHYS_PAGES);
+        page_size = sysconf(_SC_PAGE_SIZE);
+        p->max_mem = (double)pages * (double)page_size * PLAN_DEF_MEM_FRACTION;
+    }
+    p->threads = p->threads_req;
+    if(p->threads <= 0){
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        p->threads = (ncpu > 0) ? (int)ncpu : 1;
+    }
+    if(p->kernel_req >= 0)
+        p->kernel = p->kernel_req;
+    else if(p->approx == 1 && p->force_dense == 0 && p->dual == 0)
+        p->kernel = AMPD_KERNEL_APPROX;
+    else if(p->int16 == 1 && p->force_dense == 0 && p->dual == 0)
+        p->kernel = AMPD_KERNEL_I16;
+    else if(p->force_dense == 1)
+        p->kernel = AMPD_KERNEL_DENSE;
+    else
+        p->kernel = AMPD_KERNEL_MATFREE;
+    if(p->force_dense == 1 && p->kernel != AMPD_KERNEL_DENSE){
+        fprintf(stderr, "make_plan: LMS output needs the dense kernel\n");
+        return -1;
+    }
+    if(p->dual == 1){
+        if(p->kernel == AMPD_KERNEL_DENSE || p->kernel == AMPD_KERNEL_LANES ||
+           p->kernel == AMPD_KERNEL_I16 || p->kernel == AMPD_KERNEL_APPROX){
+            fprintf(stderr, "make_plan: %s kernel is not available for "
+                    "peaks and troughs\n",plan_kernel_name(p->kernel));
+            return -1;
+        }
+        pol = 2.0;
+    }
+    if(p->adaptive == 1){
+        if(p->kernel == AMPD_KERNEL_DENSE || p->kernel == AMPD_KERNEL_BITPACK ||
+           p->kernel == AMPD_KERNEL_LANES || p->dual == 1){
+            fprintf(stderr, "make_plan: %s kernel is not available for "
+                    "adaptive windows\n",plan_kernel_name(p->kernel));
+            return -1;
+        }
+    }
+    if(p->lanes < 1 || p->lanes > AMPD_MAX_LANES){
+        fprintf(stderr, "make_plan: lanes should be 1 to %d\n",AMPD_MAX_LANES);
+        return -1;
+    }
+    p->scalar_kernel = p->kernel;
+    if(p->kernel == AMPD_KERNEL_LANES)
+        p->scalar_kernel = AMPD_KERNEL_MATFREE;
+    p->batch_length = p->batch_length_req;
+    // compared before the cast, a long batch may not fit into int
+    if(p->batch_length * p->sampling_rate > p->datalen){
+        p->n = p->datalen;
+        p->batch_length = (double)p->n / p->sampling_rate;
+    }
+    else
+        p->n = (int)(p->batch_length * p->sampling_rate);
+    min_n = (int)(PLAN_MIN_BATCH_LENGTH * p->sampling_rate);
+    if(min_n > p->n)
+        min_n = p->n;
+    if(p->n < 8){
+        fprintf(stderr, "make_plan: batch of %d samples is too short\n",p->n);
+        return -1;
+    }
+    while(1){
+        p->l = p->n/2 - 1;
+        p->cycles = (int)ceil(p->datalen / (double)p->n);
+        if(p->threads > p->cycles)
+            p->threads = p->cycles;
+        if(p->kernel_req < 0 && p->force_dense == 0 && p->dual == 0 &&
+           p->int16 == 0 && p->approx == 0 && p->adaptive == 0){
+            if(p->cycles >= p->threads * p->lanes && p->lanes > 1){
+                p->kernel = AMPD_KERNEL_LANES;
+                p->scalar_kernel = AMPD_KERNEL_MATFREE;
+            }
+            else
+                p->kernel = AMPD_KERNEL_MATFREE;
+        }
+        // LMS row sums are shared by all threads
+        p->mem_shared = (double)p->datalen *
+                        (p->int16_input ? sizeof(int16_t) : sizeof(float)) +
+                        (double)p->l * sizeof(double);
+        p->mem_worker = pol * plan_worker_mem(p->n, p->kernel);
+        if(p->kernel == AMPD_KERNEL_LANES)
+            p->mem_worker *= p->lanes;
+        while(p->threads > 1 &&
+              p->mem_shared + p->threads * p->mem_worker > p->max_mem){
+            p->threads--;
+            p->adjusted = 1;
+        }
+        p->mem_total = p->mem_shared + p->threads * p->mem_worker;
+        if(p->mem_total <= p->max_mem)
+            return 0;
+        if(p->n / 2 < min_n)
+            break;
+        p->n = p->n / 2;
+        p->batch_length = (double)p->n / p->sampling_rate;
+        p->adjusted = 1;
+    }
+    fprintf(stderr, "make_plan: cannot fit into %.1lf MB, need at least "
+            "%.1lf MB\nTry lower --batch-length or --sampling-rate, or higher "
+            "--max-mem\n",p->max_mem / 1e6, p->mem_total / 1e6);
+    return -1;
+}
+
+int plan_kernel_from_name(const char *name){
+
+    if(strcmp(name, "dense") == 0)
+        return AMPD_KERNEL_DENSE;
+    if(strcmp(name, "bitpack") == 0)
+        return AMPD_KERNEL_BITPACK;
+    if(strcmp(name, "matfree") == 0)
+        return AMPD_KERNEL_MATFREE;
+    if(strcmp(name, "lanes") == 0)
+        return AMPD_KERNEL_LANES;
+    if(strcmp(name, "i16") == 0)
+        return AMPD_KERNEL_I16;
+    if(strcmp(name, "approx") == 0)
+        return AMPD_KERNEL_APPROX;
+    return -1;
+}
+
+void fprintf_plan(FILE *fp, struct ampd_plan *p){
+
+    fprintf(fp,"plan_kernel=%s\n",plan_kernel_name(p->kernel));
+    if(p->kernel == AMPD_KERNEL_LANES)
+        fprintf(fp,"plan_lanes=%d\n",p->lanes);
+    fprintf(fp,"plan_threads=%d\n",p->threads);
+    fprintf(fp,"plan_int16_input=%d\n",p->int16_input);
+    fprintf(fp,"plan_adaptive=%d\n",p->adaptive);
+    fprintf(fp,"plan_batch_length=%lf\n",p->batch_length);
+    fprintf(fp,"plan_adjusted=%d\n",p->adjusted);
+    fprintf(fp,"plan_max_mem_mb=%.1lf\n",p->max_mem / 1e6);
+    fprintf(fp,"plan_mem_total_mb=%.1lf\n",p->mem_total / 1e6);
+    fprintf(fp,"plan_mem_worker_mb=%.1lf\n",p->mem_worker / 1e6);
+}
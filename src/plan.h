@@ -0,0 +1,56 @@
+/*
+ * plan.h
+ *
+ * Execution planner for ampd. The dense local maxima scalogram of a batch is
+ * l x n floats with l = n/2, so batch length and sampling rate control a
+ * quadratic memory footprint. The planner picks the LMS kernel, the batch
+ * length and the number of worker threads so the whole run fits in a memory
+ * budget, before anything is allocated. Automatically it picks matfree or
+ * lanes, which keep no scalogram, dense is used for LMS output and bitpack
+ * only on request. Cache sizes are not taken into account.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+// shortest batch the planner is allowed to shrink to, in seconds
+#define PLAN_MIN_BATCH_LENGTH 5
+// fraction of physical memory used as budget if --max-mem is not given
+#define PLAN_DEF_MEM_FRACTION 0.5
+
+struct ampd_plan{
+
+    /* inputs */
+    double max_mem;         // memory budget in bytes, 0 means auto
+    int threads_req;        // requested threads, 0 means auto
+    int force_dense;        // dense LMS is needed, eg for --output-lms
+    int kernel_req;         // requested kernel, -1 means auto
+    int lanes;              // windows per lanes kernel call
+    int int16;              // int16 kernel requested
+    int int16_input;        // full data is kept as int16
+    int approx;             // approximate kernel requested
+    int dual;               // peaks and troughs, two scalograms per batch
+    int adaptive;           // window length varies up to the batch length
+    int datalen;            // full data length
+    double sampling_rate;
+    double batch_length_req;
+    /* outputs */
+    int kernel;             // AMPD_KERNEL_*
+    int scalar_kernel;      // for batches left over from lane groups
+    int threads;
+    double batch_length;
+    int n;                  // samples per batch
+    int l;                  // LMS rows
+    int cycles;
+    double mem_shared;      // full data array, in bytes
+    double mem_worker;      // per thread workspace, in bytes
+    double mem_total;
+    int adjusted;           // 1 if batch length or threads were reduced
+};
+
+double plan_worker_mem(int n, int kernel);
+/* fill outputs of plan; return 0 on success, -1 if it cannot fit the budget*/
+int make_plan(struct ampd_plan *p);
+const char *plan_kernel_name(int kernel);
+int plan_kernel_from_name(const char *name);
+void fprintf_plan(FILE *fp, struct ampd_plan *p);
@@ -0,0 +1,213 @@
+/*
+ * ratestore.c
+ *
+ * Cohort rate store, see ratestore.h.
+ */
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "ratestore.h"
+
+uint64_t rstore_run_stamp(){
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+/**
+ * Write all of buf to fd. Return 0 on success.
+ */
+static int write_all(int fd, const void *buf, size_t len){
+
+    const char *p = buf;
+    ssize_t w;
+    while(len > 0){
+        w = write(fd, p, len);
+        if(w <= 0)
+            return -1;
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+/**
+ * Append records to the store, holding an exclusive lock so concurrent runs
+ * do not interleave. The header is written if the store is new. If the store
+ * was replaced by rstore_compact while waiting for the lock, open it again.
+ */
+int rstore_append(char *path, struct rstore_rec *rec, int n){
+
+    int fd, ret = 0;
+    struct stat st, st_path;
+    struct rstore_header hdr;
+    while(1){
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if(fd < 0){
+            perror("rstore_append: open");
+            return -1;
+        }
+        flock(fd, LOCK_EX);
+        if(fstat(fd, &st) == 0 && stat(path, &st_path) == 0 &&
+           st.st_ino == st_path.st_ino)
+            break;
+        close(fd);
+    }
+    if(st.st_size == 0){
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, RSTORE_MAGIC, sizeof(hdr.magic));
+        hdr.rec_size = sizeof(struct rstore_rec);
+        ret = write_all(fd, &hdr, sizeof(hdr));
+    }
+    if(ret == 0)
+        ret = write_all(fd, rec, sizeof(struct rstore_rec) * n);
+    flock(fd, LOCK_UN);
+    close(fd);
+    return ret;
+}
+/**
+ * Read all records from an open, locked store.
+ */
+static struct rstore *load_locked(FILE *fp, char *path){
+
+    long size;
+    struct rstore_header hdr;
+    struct rstore *s;
+    if(fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+       memcmp(hdr.magic, RSTORE_MAGIC, sizeof(hdr.magic)) != 0 ||
+       hdr.rec_size != sizeof(struct rstore_rec)){
+        fprintf(stderr, "%s is not a rate store\n",path);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp) - sizeof(hdr);
+    fseek(fp, sizeof(hdr), SEEK_SET);
+    s = malloc(sizeof(struct rstore));
+    s->n = size / sizeof(struct rstore_rec);
+    s->rec = malloc(sizeof(struct rstore_rec) * (s->n + 1));
+    s->n = fread(s->rec, sizeof(struct rstore_rec), s->n, fp);
+    return s;
+}
+/**
+ * Load all records of the store, return NULL if it cannot be read.
+ */
+struct rstore *rstore_load(char *path){
+
+    FILE *fp;
+    struct rstore *s;
+    fp = fopen(path, "rb");
+    if(fp == NULL){
+        fprintf(stderr, "cannot open file %s\n",path);
+        return NULL;
+    }
+    flock(fileno(fp), LOCK_SH);
+    s = load_locked(fp, path);
+    flock(fileno(fp), LOCK_UN);
+    fclose(fp);
+    return s;
+}
+
+void rstore_free(struct rstore *s){
+
+    if(s == NULL)
+        return;
+    free(s->rec);
+    free(s);
+}
+
+static int cmp_rec(const void *a, const void *b){
+
+    const struct rstore_rec *ra = a;
+    const struct rstore_rec *rb = b;
+    int c;
+    c = strncmp(ra->study, rb->study, RSTORE_ID_LEN);
+    if(c != 0)
+        return c;
+    c = strncmp(ra->channel, rb->channel, RSTORE_CH_LEN);
+    if(c != 0)
+        return c;
+    if(ra->run != rb->run)
+        return (ra->run > rb->run) ? -1 : 1;   // newest run first
+    return (ra->batch > rb->batch) - (ra->batch < rb->batch);
+}
+/**
+ * Sort records by study, channel, newest run and batch, then mark the
+ * records belonging to the newest run of each study and channel.
+ */
+void rstore_newest(struct rstore *s, char *keep){
+
+    int i;
+    struct rstore_rec *r, *prev = NULL;
+    qsort(s->rec, s->n, sizeof(struct rstore_rec), cmp_rec);
+    for(i=0; i<s->n; i++){
+        r = &s->rec[i];
+        if(prev == NULL || strncmp(r->study, prev->study, RSTORE_ID_LEN) != 0
+           || strncmp(r->channel, prev->channel, RSTORE_CH_LEN) != 0)
+            prev = r;
+        keep[i] = (r->run == prev->run);
+    }
+}
+/**
+ * Drop superseded runs and rewrite the store sorted by study. The store stays
+ * locked until the new file replaces it. As in rstore_append, the store is
+ * opened again if another compaction replaced it while waiting for the lock.
+ */
+int rstore_compact(char *path){
+
+    int i, j, fd, ret;
+    char *keep;
+    char tmp[1024];
+    FILE *fp;
+    struct rstore *s;
+    struct rstore_header hdr;
+    struct stat st, st_path;
+    while(1){
+        fp = fopen(path, "rb");
+        if(fp == NULL){
+            fprintf(stderr, "cannot open file %s\n",path);
+            return -1;
+        }
+        flock(fileno(fp), LOCK_EX);
+        if(fstat(fileno(fp), &st) == 0 && stat(path, &st_path) == 0 &&
+           st.st_ino == st_path.st_ino)
+            break;
+        fclose(fp);
+    }
+    s = load_locked(fp, path);
+    if(s == NULL){
+        fclose(fp);
+        return -1;
+    }
+    keep = malloc(s->n + 1);
+    rstore_newest(s, keep);
+    for(i=0, j=0; i<s->n; i++){
+        if(keep[i])
+            s->rec[j++] = s->rec[i];
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0){
+        perror("rstore_compact: open");
+        free(keep);
+        rstore_free(s);
+        fclose(fp);
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RSTORE_MAGIC, sizeof(hdr.magic));
+    hdr.rec_size = sizeof(struct rstore_rec);
+    ret = write_all(fd, &hdr, sizeof(hdr));
+    if(ret == 0)
+        ret = write_all(fd, s->rec, sizeof(struct rstore_rec) * j);
+    close(fd);
+    if(ret == 0)
+        ret = rename(tmp, path);
+    if(ret != 0)
+        unlink(tmp);
+    fclose(fp);
+    free(keep);
+    rstore_free(s);
+    return ret;
+}
@@ -0,0 +1,62 @@
+/*
+ * ratestore.h
+ *
+ * Cohort rate store: a single file collecting the per batch results of every
+ * ampd run of a cohort, instead of one small .rate file per study and
+ * channel. Runs append fixed size records under an exclusive lock, so
+ * parallel saiproc jobs can share the store. A study and channel processed
+ * again gets a newer run stamp, and queries only see the newest run of each.
+ *
+ * File layout: struct rstore_header, then struct rstore_rec records.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define RSTORE_MAGIC "AMPDRST1"
+#define RSTORE_ID_LEN 24
+#define RSTORE_CH_LEN 8
+
+struct rstore_header{
+
+    char magic[8];
+    uint32_t rec_size;      // sizeof(struct rstore_rec), layout check
+    uint32_t reserved;
+
+};
+
+struct rstore_rec{
+
+    char study[RSTORE_ID_LEN];  // eg: s_2020040501
+    char channel[RSTORE_CH_LEN];// datatype, eg: resp
+    uint64_t run;           // run stamp, microseconds since epoch
+    uint32_t batch;         // batch number within the run
+    uint32_t start;         // first sample of the batch
+    float batch_length;     // seconds
+    float sampling_rate;
+    float rate;             // peaks per min
+    int32_t lambda;
+    float mean_pk_dist;     // seconds
+    float stdev_pk_dist;
+    int32_t n_peaks;
+    uint32_t reserved;
+
+};
+
+/* records of a store loaded for queries */
+struct rstore{
+
+    struct rstore_rec *rec;
+    int n;
+
+};
+
+uint64_t rstore_run_stamp();
+/* append n records to the store at path, create it if needed*/
+int rstore_append(char *path, struct rstore_rec *rec, int n);
+struct rstore *rstore_load(char *path);
+void rstore_free(struct rstore *s);
+/* mark superseded runs: keep[i] is 1 if rec[i] is from the newest run */
+void rstore_newest(struct rstore *s, char *keep);
+/* rewrite the store with only the newest runs, sorted by study */
+int rstore_compact(char *path);
@@ -15,6 +15,7 @@
  *              -h  --help                          print help
  *              -v  --verbose                       verbose
  *              --sampling_rate=[sampling_rate]     in Hz, defaults to 100
+ *              --cache                             seek with the cache
  */
 
 #include <stdio.h>
@@ -22,6 +23,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include "txtcache.h"
 
 // default sampling rate in Hz in case not given as input argument.
 // change this if needed, then recompile.
@@ -40,9 +42,10 @@ static struct option long_options[]=
     {"sampling-rate",required_argument,NULL,'r'},
     {"verbose",no_argument,NULL,'v'},
     {"help",no_argument, NULL,'h'},
+    {"cache",no_argument, NULL,'c'},
     {0,0,0,0},
 };
-static char optstring[] = "hvf:o:s:l:r:";
+static char optstring[] = "hvcf:o:s:l:r:";
 void printf_help(){
 
     printf(
@@ -66,6 +69,11 @@ void printf_help(){
      "-h    --help                      print help\n"
      "-v    --verbose                   verbose\n"
      "--sampling-rate=[sampling_rate]   in Hz, defaults to 100\n"
+     "-c    --cache                     keep the parsed input in [infile].ampdc\n"
+     "                                  and seek to the start row with it on\n"
+     "                                  later runs, made again if the input\n"
+     "                                  changed. Files with comments after\n"
+     "                                  the first row are read from the start\n"
      
     );
 }
@@ -89,6 +97,9 @@ int main(int argc, char **argv){
     int count = 0;
     int minind, maxind; // indices of first and last line
     int opt;
+    int cache = 0;
+    struct txc txc = {0};
+    long k;
     while((opt = getopt_long(argc, argv, optstring, long_options, NULL)) != -1){
         switch(opt){
             case 'v':
@@ -97,6 +108,9 @@ int main(int argc, char **argv){
             case 'h':
                 printf_help();
                 return 0;
+            case 'c':
+                cache = 1;
+                break;
             case 's':
                 start_time = atof(optarg);
                 break;
@@ -153,8 +167,29 @@ int main(int argc, char **argv){
         printf("time interval: %lf sec, sampling rate: %lf\n",length,sampling_rate);
         printf("Copying rows %d - %d to file %s\n",minind, maxind,outfile);
     }
+    // copy the header, then start from the saved row offset before minind.
+    // Comments further in are copied too, the text is read from the start
+    // if there are any
+    if(cache == 1 && txc_open(infile, &txc) == 0 &&
+       (copy_header == 0 || txc.hdr->comments == 0)){
+        while(ftell(fp_in) < (long)txc.hdr->header_len &&
+              (read = getline(&line, &len, fp_in)) != -1){
+            if(copy_header == 1 && line[0] == '#')
+                fprintf(fp_out,"%s",line);
+        }
+        k = minind / TXC_ROW_STRIDE;
+        if(minind < 0)
+            k = 0;
+        if((uint64_t)k * TXC_ROW_STRIDE < txc.hdr->rows){
+            fseek(fp_in, (long)txc_rows(&txc)[k], SEEK_SET);
+            count = (int)(k * TXC_ROW_STRIDE);
+        }
+        else
+            fseek(fp_in, 0, SEEK_END);
+    }
+    txc_close(&txc);
     while((read = getline(&line,  &len, fp_in)) != -1){
-        if(line[0] == '#' || line[0] == '\n'){
+        if(txc_is_row(line) == 0){
             if(copy_header == 1 && line[0] == '#'){
                 fprintf(fp_out,"%s",line);
             }
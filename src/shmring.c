@@ -0,0 +1,262 @@
+/*
+ * shmring.c
+ *
+ * Shared memory sample ring, see shmring.h.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "shmring.h"
+
+static size_t frame_size(struct shm_header *h){
+
+    return h->channels * ((h->format == SHM_INT16) ? sizeof(int16_t) :
+                          sizeof(float));
+}
+
+static size_t data_offset(){
+
+    return (sizeof(struct shm_header) + 63) / 64 * 64;
+}
+/**
+ * Sleep until seq is no longer val, or SHM_WAIT_MS. The object is shared
+ * between processes, so the futex is not the private kind.
+ */
+static void wait_seq(struct shm_header *h, uint32_t val){
+
+    struct timespec ts = {0, SHM_WAIT_MS * 1000000L};
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *)&h->seq, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+    (void)val;
+    ts.tv_nsec = 1000000L;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static void wake_seq(struct shm_header *h){
+
+    atomic_fetch_add_explicit(&h->seq, 1, memory_order_release);
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *)&h->seq, FUTEX_WAKE, INT_MAX, NULL, NULL,
+            0);
+#endif
+}
+
+int shm_ring_create(struct shm_ring *r, const char *name, int format,
+                    int channels, int capacity, double sampling_rate){
+
+    int fd, i;
+    uint32_t cap = 1;
+    struct shm_header *h;
+    if(channels < 1 || channels > SHM_MAX_CH)
+        return -1;
+    while(cap < (uint32_t)capacity)
+        cap <<= 1;
+    memset(r, 0, sizeof(struct shm_ring));
+    strncpy(r->name, name, sizeof(r->name) - 1);
+    r->writer = 1;
+    r->size = data_offset() + (size_t)cap * channels *
+              ((format == SHM_INT16) ? sizeof(int16_t) : sizeof(float));
+    shm_unlink(name);
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0){
+        perror("shm_open");
+        return -1;
+    }
+    if(ftruncate(fd, r->size) != 0){
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    r->hdr = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(r->hdr == MAP_FAILED){
+        perror("mmap");
+        return -1;
+    }
+    h = r->hdr;
+    h->hdr_size = sizeof(struct shm_header);
+    h->format = format;
+    h->channels = channels;
+    h->capacity = cap;
+    h->sampling_rate = sampling_rate;
+    for(i=0; i<SHM_MAX_CH; i++)
+        h->scale[i] = 1.0;
+    atomic_init(&h->write_index, 0);
+    atomic_init(&h->read_index, 0);
+    atomic_init(&h->seq, 0);
+    atomic_init(&h->closed, 0);
+    r->data = (char *)r->hdr + data_offset();
+    // readers check the magic last
+    atomic_thread_fence(memory_order_release);
+    memcpy(h->magic, SHM_MAGIC, 8);
+    return 0;
+}
+
+void shm_ring_write(struct shm_ring *r, const void *frames, int n){
+
+    struct shm_header *h = r->hdr;
+    size_t fs = frame_size(h);
+    uint64_t w = atomic_load_explicit(&h->write_index, memory_order_relaxed);
+    uint32_t slot = (uint32_t)(w & (h->capacity - 1));
+    uint32_t first;
+    while(n > 0){
+        first = h->capacity - slot;
+        if(first > (uint32_t)n)
+            first = n;
+        memcpy((char *)r->data + slot * fs, frames, first * fs);
+        frames = (const char *)frames + first * fs;
+        n -= first;
+        w += first;
+        slot = 0;
+    }
+    atomic_store_explicit(&h->write_index, w, memory_order_release);
+    wake_seq(h);
+}
+
+uint64_t shm_ring_room(struct shm_ring *r){
+
+    struct shm_header *h = r->hdr;
+    uint64_t w = atomic_load_explicit(&h->write_index, memory_order_relaxed);
+    uint64_t rd = atomic_load_explicit(&h->read_index, memory_order_acquire);
+    return h->capacity - (w - rd);
+}
+
+void shm_ring_close(struct shm_ring *r){
+
+    atomic_store_explicit(&r->hdr->closed, 1, memory_order_release);
+    wake_seq(r->hdr);
+}
+
+int shm_ring_attach(struct shm_ring *r, const char *name){
+
+    int fd, magic;
+    struct stat st;
+    struct shm_header *h;
+    uint64_t w;
+    memset(r, 0, sizeof(struct shm_ring));
+    strncpy(r->name, name, sizeof(r->name) - 1);
+    fd = shm_open(name, O_RDWR, 0);
+    if(fd < 0){
+        perror("shm_open");
+        return -1;
+    }
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < data_offset()){
+        fprintf(stderr, "%s: not a sample ring\n",name);
+        close(fd);
+        return -1;
+    }
+    r->size = st.st_size;
+    r->hdr = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(r->hdr == MAP_FAILED){
+        perror("mmap");
+        return -1;
+    }
+    h = r->hdr;
+    // the writer sets the magic last, the rest of the header is read after it
+    magic = (memcmp(h->magic, SHM_MAGIC, 8) == 0);
+    atomic_thread_fence(memory_order_acquire);
+    if(magic == 0 ||
+       h->hdr_size != sizeof(struct shm_header) ||
+       h->channels < 1 || h->channels > SHM_MAX_CH ||
+       r->size < data_offset() + (size_t)h->capacity * frame_size(h)){
+        fprintf(stderr, "%s: not a sample ring or different version\n",name);
+        munmap(r->hdr, r->size);
+        return -1;
+    }
+    r->data = (char *)r->hdr + data_offset();
+    w = atomic_load_explicit(&h->write_index, memory_order_acquire);
+    r->next = (w > h->capacity) ? w - h->capacity : 0;
+    atomic_store_explicit(&h->read_index, r->next, memory_order_release);
+    return 0;
+}
+
+int shm_ring_channel(struct shm_ring *r, const char *ch){
+
+    int i;
+    char *end;
+    for(i=0; i<(int)r->hdr->channels; i++){
+        if(strncmp(r->hdr->label[i], ch, SHM_LABEL_LEN) == 0)
+            return i;
+    }
+    i = (int)strtol(ch, &end, 10);
+    if(*ch == '\0' || *end != '\0' || i < 0 || i >= (int)r->hdr->channels)
+        return -1;
+    return i;
+}
+/**
+ * Samples are converted straight from the ring, there is no text and no
+ * intermediate buffer. Frames overwritten while they were copied may mix old
+ * and new values, they are counted as lost and skipped, so is a copy that was
+ * overwritten as a whole.
+ */
+int shm_ring_read(struct shm_ring *r, int ch, float *dst, int max){
+
+    struct shm_header *h = r->hdr;
+    uint64_t w, k, i, torn;
+    uint32_t s, mask = h->capacity - 1;
+    int nch = h->channels;
+    float *f = r->data;
+    int16_t *q = r->data;
+    double scale = h->scale[ch];
+    while(1){
+        s = atomic_load_explicit(&h->seq, memory_order_acquire);
+        w = atomic_load_explicit(&h->write_index, memory_order_acquire);
+        if(w == r->next){
+            if(atomic_load_explicit(&h->closed, memory_order_acquire) == 1 &&
+               atomic_load_explicit(&h->write_index, memory_order_acquire)
+               == w)
+                return 0;
+            wait_seq(h, s);
+            continue;
+        }
+        if(w - r->next > h->capacity){
+            r->lost += w - r->next - h->capacity;
+            r->next = w - h->capacity;
+        }
+        k = w - r->next;
+        if(k > (uint64_t)max)
+            k = max;
+        if(h->format == SHM_INT16){
+            for(i=0; i<k; i++)
+                dst[i] = (float)(q[((r->next + i) & mask) * nch + ch] / scale);
+        }
+        else{
+            for(i=0; i<k; i++)
+                dst[i] = f[((r->next + i) & mask) * nch + ch];
+        }
+        // the oldest frames are overwritten first
+        w = atomic_load_explicit(&h->write_index, memory_order_acquire);
+        torn = (w - r->next > h->capacity) ? w - h->capacity - r->next : 0;
+        if(torn > k)
+            torn = k;
+        r->lost += torn;
+        r->next += k;
+        atomic_store_explicit(&h->read_index, r->next, memory_order_release);
+        if(torn < k){
+            if(torn > 0)
+                memmove(dst, dst + torn, sizeof(float) * (k - torn));
+            return (int)(k - torn);
+        }
+    }
+}
+
+void shm_ring_free(struct shm_ring *r){
+
+    if(r->hdr != NULL)
+        munmap(r->hdr, r->size);
+    if(r->writer == 1)
+        shm_unlink(r->name);
+    r->hdr = NULL;
+}
@@ -0,0 +1,72 @@
+/*
+ * shmring.h
+ *
+ * Shared memory sample ring, written by an acquisition process and read by
+ * ampd --shm. The POSIX shared memory object (shm_open name, eg: /ampd) holds
+ * a header, then a ring of capacity frames. A frame is one sample of every
+ * channel, float32 or int16, interleaved. The writer stores the frames, then
+ * moves write_index with a release store and bumps seq, which a waiting reader
+ * sleeps on with a futex. Frame i is at slot i % capacity, so a reader more
+ * than capacity frames behind has lost samples, it can tell from the indices.
+ * int16 samples are value / scale[channel].
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SHM_MAGIC "AMPDSHM1"
+#define SHM_MAX_CH 16
+#define SHM_LABEL_LEN 16
+#define SHM_FLOAT32 0
+#define SHM_INT16 1
+/* reader wait before checking the writer is still there, ms */
+#define SHM_WAIT_MS 100
+
+struct shm_header{
+
+    char magic[8];
+    uint32_t hdr_size;      // sizeof(struct shm_header), data follows
+    uint32_t format;        // SHM_FLOAT32 or SHM_INT16
+    uint32_t channels;
+    uint32_t capacity;      // frames, power of 2
+    double sampling_rate;
+    double scale[SHM_MAX_CH];
+    char label[SHM_MAX_CH][SHM_LABEL_LEN];  // eg: resp, puls
+    _Atomic uint64_t write_index;   // frames written since the start
+    _Atomic uint64_t read_index;    // frames taken by the reader, optional
+    _Atomic uint32_t seq;           // futex word, bumped after each write
+    _Atomic uint32_t closed;        // writer finished, nothing more comes
+    char pad[40];
+
+};
+
+struct shm_ring{
+
+    char name[256];
+    struct shm_header *hdr;
+    void *data;
+    size_t size;            // mapped bytes
+    int writer;
+    uint64_t next;          // reader: next frame to take
+    uint64_t lost;          // reader: frames overwritten before taken
+
+};
+
+/* writer, create or replace the object, return 0 on success*/
+int shm_ring_create(struct shm_ring *r, const char *name, int format,
+                    int channels, int capacity, double sampling_rate);
+/* store n frames of interleaved samples (float or int16 as the format) */
+void shm_ring_write(struct shm_ring *r, const void *frames, int n);
+/* frames the writer can store before the reader loses any*/
+uint64_t shm_ring_room(struct shm_ring *r);
+/* writer is done, readers get the rest, then end of data*/
+void shm_ring_close(struct shm_ring *r);
+/* reader, from the oldest frame still in the ring, return 0 on success*/
+int shm_ring_attach(struct shm_ring *r, const char *name);
+/* channel index of a label or a number, -1 if none*/
+int shm_ring_channel(struct shm_ring *r, const char *ch);
+/* up to max samples of channel ch as float, waiting for at least one,
+ * return the count, 0 at end of data*/
+int shm_ring_read(struct shm_ring *r, int ch, float *dst, int max);
+/* unmap, the writer also unlinks the object*/
+void shm_ring_free(struct shm_ring *r);
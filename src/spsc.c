@@ -0,0 +1,80 @@
+/*
+ * spsc.c
+ *
+ * Single producer, single consumer ring, see spsc.h.
+ */
+#include <sched.h>
+#include <time.h>
+#include "spsc.h"
+
+int spsc_init(struct spsc_ring *r, int size){
+
+    unsigned int s = 1;
+    while(s < (unsigned int)size)
+        s <<= 1;
+    r->size = s;
+    r->slot = malloc(sizeof(int) * s);
+    if(r->slot == NULL)
+        return -1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return 0;
+}
+
+void spsc_free(struct spsc_ring *r){
+
+    free(r->slot);
+    r->slot = NULL;
+}
+
+int spsc_push(struct spsc_ring *r, int v){
+
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if(tail - head == r->size)
+        return -1;
+    r->slot[tail & (r->size - 1)] = v;
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+int spsc_pop(struct spsc_ring *r, int *v){
+
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if(tail == head)
+        return -1;
+    *v = r->slot[head & (r->size - 1)];
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return 0;
+}
+/**
+ * Back off while the other side catches up: yield a few times, then sleep,
+ * so a waiting stage does not take a core from the compute stage.
+ */
+static void backoff(int *spins){
+
+    struct timespec ts = {0, SPSC_SLEEP_NS};
+    if(*spins < SPSC_SPIN){
+        (*spins)++;
+        sched_yield();
+    }
+    else
+        nanosleep(&ts, NULL);
+}
+
+void spsc_push_wait(struct spsc_ring *r, int v){
+
+    int spins = 0;
+    while(spsc_push(r, v) != 0)
+        backoff(&spins);
+}
+
+int spsc_pop_wait(struct spsc_ring *r){
+
+    int v;
+    int spins = 0;
+    while(spsc_pop(r, &v) != 0)
+        backoff(&spins);
+    return v;
+}
@@ -0,0 +1,35 @@
+/*
+ * spsc.h
+ *
+ * Lock-free single producer, single consumer ring of ints, used to pass batch
+ * numbers between the pipeline stages of ampd. Only the producer moves the
+ * tail and only the consumer moves the head. The producer publishes with a
+ * release store after writing the slot, the consumer reads the tail with an
+ * acquire load, so everything written before a push is seen after the pop.
+ */
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/* spins before a waiting stage starts to sleep, and sleep time in ns */
+#define SPSC_SPIN 64
+#define SPSC_SLEEP_NS 100000
+
+struct spsc_ring{
+
+    unsigned int size;          // power of 2
+    int *slot;
+    _Atomic unsigned int head;  // next slot to pop, moved by the consumer
+    char pad[64];               // head and tail on separate cache lines
+    _Atomic unsigned int tail;  // next slot to push, moved by the producer
+
+};
+
+/* room for at least size values, return 0 on success*/
+int spsc_init(struct spsc_ring *r, int size);
+void spsc_free(struct spsc_ring *r);
+/* return 0 on success, -1 if the ring is full or empty*/
+int spsc_push(struct spsc_ring *r, int v);
+int spsc_pop(struct spsc_ring *r, int *v);
+/* same, waiting for room or a value: back-pressure between stages*/
+void spsc_push_wait(struct spsc_ring *r, int v);
+int spsc_pop_wait(struct spsc_ring *r);
@@ -0,0 +1,324 @@
+/*
+ * txtcache.c
+ *
+ * Parsed binary cache of text data files, see txtcache.h.
+ */
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "txtcache.h"
+
+#define TXC_ALIGN 64
+
+static uint64_t fnv1a(uint64_t h, const unsigned char *p, size_t n){
+
+    size_t i;
+    for(i=0; i<n; i++){
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+/**
+ * Size, modification time and hash of the source into key. Only both ends
+ * are hashed, so checking the key does not cost a read of the file.
+ */
+static int source_key(const char *path, struct txc_header *key){
+
+    FILE *fp;
+    struct stat st;
+    unsigned char *buf;
+    size_t n;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    if(stat(path, &st) != 0)
+        return -1;
+    memset(key, 0, sizeof(struct txc_header));
+    key->src_size = st.st_size;
+    key->src_mtime = st.st_mtim.tv_sec;
+    key->src_mtime_ns = st.st_mtim.tv_nsec;
+    fp = fopen(path, "rb");
+    buf = malloc(TXC_HASH_BYTES);
+    if(fp == NULL || buf == NULL){
+        if(fp != NULL)
+            fclose(fp);
+        free(buf);
+        return -1;
+    }
+    n = fread(buf, 1, TXC_HASH_BYTES, fp);
+    h = fnv1a(h, buf, n);
+    if(st.st_size > TXC_HASH_BYTES &&
+       fseek(fp, -(long)TXC_HASH_BYTES, SEEK_END) == 0){
+        n = fread(buf, 1, TXC_HASH_BYTES, fp);
+        h = fnv1a(h, buf, n);
+    }
+    key->src_hash = h;
+    fclose(fp);
+    free(buf);
+    return 0;
+}
+
+static int same_source(const struct txc_header *a, const struct txc_header *b){
+
+    return a->src_size == b->src_size && a->src_mtime == b->src_mtime &&
+           a->src_mtime_ns == b->src_mtime_ns && a->src_hash == b->src_hash;
+}
+/**
+ * Map the cache file if it belongs to the source in key.
+ */
+static int map_cache(const char *cpath, const struct txc_header *key,
+                     struct txc *c){
+
+    int fd;
+    struct stat st;
+    struct txc_header *h;
+    fd = open(cpath, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct txc_header)){
+        close(fd);
+        return -1;
+    }
+    c->size = st.st_size;
+    c->map = mmap(NULL, c->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(c->map == MAP_FAILED)
+        return -1;
+    h = c->map;
+    if(memcmp(h->magic, TXC_MAGIC, 8) != 0 ||
+       h->hdr_size != sizeof(struct txc_header) || !same_source(h, key) ||
+       h->rows == 0 ||
+       h->col_offset + h->columns * h->rows * sizeof(float) > c->size ||
+       h->row_offset + ((h->rows - 1) / TXC_ROW_STRIDE + 1) *
+       sizeof(uint64_t) > c->size){
+        munmap(c->map, c->size);
+        return -1;
+    }
+    c->hdr = h;
+    return 0;
+}
+/**
+ * Find the data delimiter in a line, as colextract does.
+ */
+static char get_delim(char *line){
+
+    char dlist[] = {'\t',' ',','};
+    char d = '\t';
+    int i, count = 0, c;
+    char *p;
+    for(i=0; i<(int)sizeof(dlist); i++){
+        for(c=0, p=line; *p != '\0'; p++)
+            c += (*p == dlist[i]);
+        if(c > count){
+            count = c;
+            d = dlist[i];
+        }
+    }
+    return d;
+}
+
+static int count_tokens(char *line, const char *delim){
+
+    int n = 0;
+    char *save, *tok;
+    char *tmp = strdup(line);
+    if(tmp == NULL)
+        return 0;
+    for(tok = strtok_r(tmp, delim, &save); tok != NULL;
+        tok = strtok_r(NULL, delim, &save))
+        n++;
+    free(tmp);
+    return n;
+}
+/**
+ * Write the columns and row offsets after the header at the aligned offsets,
+ * to a temporary file renamed to cpath.
+ */
+static int write_cache(const char *cpath, struct txc_header *h, float **col,
+                       uint64_t *off){
+
+    FILE *fp;
+    char tmp[4096];
+    char zero[TXC_ALIGN] = {0};
+    size_t pad, n;
+    uint32_t i;
+    int ok;
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", cpath, (int)getpid());
+    fp = fopen(tmp, "wb");
+    if(fp == NULL)
+        return -1;
+    ok = fwrite(h, sizeof(struct txc_header), 1, fp) == 1;
+    pad = h->col_offset - sizeof(struct txc_header);
+    ok = ok && fwrite(zero, 1, pad, fp) == pad;
+    for(i=0; i<h->columns && ok; i++)
+        ok = fwrite(col[i], sizeof(float), h->rows, fp) == h->rows;
+    pad = h->row_offset - h->col_offset - h->columns * h->rows * sizeof(float);
+    ok = ok && fwrite(zero, 1, pad, fp) == pad;
+    n = (h->rows - 1) / TXC_ROW_STRIDE + 1;
+    ok = ok && fwrite(off, sizeof(uint64_t), n, fp) == n;
+    ok = (fclose(fp) == 0) && ok;
+    if(ok == 0 || rename(tmp, cpath) != 0){
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+/**
+ * Parse the source into columns and row offsets and write the cache. The key
+ * is taken again after parsing, a file changed meanwhile is not cached.
+ */
+static int build_cache(const char *path, const char *cpath,
+                       struct txc_header *key){
+
+    FILE *fp;
+    char *line = NULL;
+    char delim[4] = {'\t','\r','\n','\0'};
+    char *tok, *save;
+    size_t len = 0;
+    ssize_t read;
+    uint64_t pos = 0, alloc = 0, rows = 0;
+    uint64_t *off = NULL;
+    float **col = NULL;
+    void *tmp;
+    uint32_t i, ncol = 0;
+    int ret = -1;
+    struct txc_header h, after;
+    memcpy(&h, key, sizeof(struct txc_header));
+    fp = fopen(path, "r");
+    if(fp == NULL)
+        return -1;
+    while((read = getline(&line, &len, fp)) != -1){
+        if(txc_is_row(line) == 0){
+            if(rows == 0)
+                h.header_len = pos + read;
+            else if(line[0] == '#')
+                h.comments++;
+            pos += read;
+            continue;
+        }
+        if(rows == 0){
+            delim[0] = get_delim(line);
+            ncol = count_tokens(line, delim);
+            if(ncol == 0)
+                break;
+            col = calloc(ncol, sizeof(float *));
+            if(col == NULL)
+                break;
+        }
+        if(rows == alloc){
+            alloc = (alloc == 0) ? 65536 : alloc * 2;
+            tmp = realloc(off, sizeof(uint64_t) * (alloc / TXC_ROW_STRIDE));
+            if(tmp == NULL)
+                break;
+            off = tmp;
+            for(i=0; i<ncol; i++){
+                tmp = realloc(col[i], sizeof(float) * alloc);
+                if(tmp == NULL)
+                    break;
+                col[i] = tmp;
+            }
+            if(i < ncol)
+                break;
+        }
+        if(rows % TXC_ROW_STRIDE == 0)
+            off[rows / TXC_ROW_STRIDE] = pos;
+        tok = strtok_r(line, delim, &save);
+        for(i=0; i<ncol; i++){
+            col[i][rows] = (tok != NULL) ? strtof(tok, NULL) : 0.0f;
+            if(tok != NULL)
+                tok = strtok_r(NULL, delim, &save);
+        }
+        rows++;
+        pos += read;
+    }
+    fclose(fp);
+    free(line);
+    if(read == -1 && rows > 0 && source_key(path, &after) == 0 &&
+       same_source(&after, key)){
+        memcpy(h.magic, TXC_MAGIC, 8);
+        h.hdr_size = sizeof(struct txc_header);
+        h.columns = ncol;
+        h.rows = rows;
+        h.col_offset = (sizeof(struct txc_header) + TXC_ALIGN - 1) /
+                       TXC_ALIGN * TXC_ALIGN;
+        h.row_offset = (h.col_offset + ncol * rows * sizeof(float) +
+                        TXC_ALIGN - 1) / TXC_ALIGN * TXC_ALIGN;
+        ret = write_cache(cpath, &h, col, off);
+    }
+    for(i=0; i<ncol && col != NULL; i++)
+        free(col[i]);
+    free(col);
+    free(off);
+    return ret;
+}
+
+int txc_open(const char *path, struct txc *c){
+
+    char cpath[4096];
+    struct txc_header key;
+    memset(c, 0, sizeof(struct txc));
+    snprintf(cpath, sizeof(cpath), "%s%s", path, TXC_EXT);
+    if(source_key(path, &key) != 0)
+        return -1;
+    if(map_cache(cpath, &key, c) == 0)
+        return 0;
+    if(build_cache(path, cpath, &key) != 0 || map_cache(cpath, &key, c) != 0){
+        fprintf(stderr, "cannot cache %s in %s, reading text\n",path,cpath);
+        memset(c, 0, sizeof(struct txc));
+        return -1;
+    }
+    return 0;
+}
+
+float *txc_column(struct txc *c, int col){
+
+    if(col < 0 || (uint32_t)col >= c->hdr->columns)
+        return NULL;
+    return (float *)((char *)c->map + c->hdr->col_offset) + col * c->hdr->rows;
+}
+
+const uint64_t *txc_rows(struct txc *c){
+
+    return (const uint64_t *)((char *)c->map + c->hdr->row_offset);
+}
+
+void txc_close(struct txc *c){
+
+    if(c->map != NULL)
+        munmap(c->map, c->size);
+    memset(c, 0, sizeof(struct txc));
+}
+
+int txc_is_row(const char *line){
+
+    return line[0] != '#' && line[0] != '\n' && line[0] != '\r' &&
+           line[0] != '\0';
+}
+
+char *txc_next_row(char *buf, int size, FILE *fp){
+
+    int skip = 0;       // in the rest of a long line that is not a row
+    while(fgets(buf, size, fp) != NULL){
+        if(skip == 0 && txc_is_row(buf))
+            return buf;
+        skip = (strchr(buf, '\n') == NULL);
+    }
+    return NULL;
+}
+
+int txc_count_rows(const char *path){
+
+    FILE *fp;
+    char *line = NULL;
+    size_t len = 0;
+    int n = 0;
+    fp = fopen(path, "r");
+    if(fp == NULL)
+        return -1;
+    while(getline(&line, &len, fp) != -1)
+        n += txc_is_row(line);
+    free(line);
+    fclose(fp);
+    return n;
+}
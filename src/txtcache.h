@@ -0,0 +1,72 @@
+/*
+ * txtcache.h
+ *
+ * Parsed binary cache of a text data file, in a sidecar next to it
+ * ([infile].ampdc). The first read of a file with --cache parses every column
+ * into float32 and writes the sidecar, later runs of ampd, ampdpreproc and
+ * rowextract map it instead of parsing the text again. The sidecar is keyed
+ * by the size, modification time and a hash of the source, and built again
+ * if any of them changed. It is written to a temporary file and renamed, so
+ * parallel runs never see half of it.
+ *
+ * Rows are the lines not starting with '#' and not empty, columns are split
+ * at the delimiter of the first row (tab, space or comma), as in colextract.
+ * The text readers of ampd, ampdpreproc and rowextract skip the same lines
+ * with txc_is_row, so row numbers do not depend on the cache.
+ *
+ * File layout, native byte order:
+ *
+ * header:      struct txc_header
+ * columns:     at col_offset, columns x rows float, one column after another
+ * rows:        at row_offset, byte offsets in the source of every
+ *              TXC_ROW_STRIDE-th row, (rows-1)/TXC_ROW_STRIDE+1 uint64
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define TXC_MAGIC "AMPDTXC1"
+#define TXC_EXT ".ampdc"
+#define TXC_HASH_BYTES 65536    // hashed from both ends of the source
+#define TXC_ROW_STRIDE 64       // rows between saved row offsets
+
+struct txc_header{
+
+    char magic[8];
+    uint32_t hdr_size;      // sizeof(struct txc_header), layout check
+    uint32_t columns;
+    uint64_t rows;
+    uint64_t src_size;
+    int64_t src_mtime;      // seconds
+    int64_t src_mtime_ns;
+    uint64_t src_hash;      // FNV-1a of the first and last TXC_HASH_BYTES
+    uint64_t header_len;    // bytes of the comment lines before the first row
+    uint64_t comments;      // '#' lines after the first row
+    uint64_t col_offset;
+    uint64_t row_offset;
+
+};
+
+/* mapped cache */
+struct txc{
+
+    void *map;
+    size_t size;
+    struct txc_header *hdr;
+
+};
+
+/* map the cache of path, made or made again if needed. Return 0 on success,
+ * -1 if the text has to be read instead */
+int txc_open(const char *path, struct txc *c);
+/* column col, read only, NULL if there is no such column*/
+float *txc_column(struct txc *c, int col);
+/* byte offset in the source of row i*TXC_ROW_STRIDE is [i]*/
+const uint64_t *txc_rows(struct txc *c);
+void txc_close(struct txc *c);
+/* 1 if the line is a data row, 0 for comment and empty lines*/
+int txc_is_row(const char *line);
+/* fgets of the next data row, lines that are not rows are skipped whole*/
+char *txc_next_row(char *buf, int size, FILE *fp);
+/* number of data rows in path, -1 if it cannot be read*/
+int txc_count_rows(const char *path);
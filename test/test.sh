@@ -4,15 +4,21 @@
 
 datatype=$1
 sr=100
-testdatadir="/home/david/dev/ampd/test/data"
-ampdroot="/home/david/dev/ampd"
+# paths from the location of this script, build with make first
+ampdroot=$(cd "$(dirname "$0")/.." && pwd)
+testdatadir="$ampdroot/test/data"
 testaux="$ampdroot/test/out/ampd.aux"
 testout="$ampdroot/test/out/ampd.out"
+ampd="$ampdroot/bin/ampd"
+bin="$ampdroot/bin"
 echo ""
 echo "Testing AMPD"
 echo "---------------------------------------"
 if [ -z "$1" ]; then
-    echo "Argument needed. Try: 'resp', 'puls', 'robustness', 'resp_flip'"
+    echo "Argument needed. Try: 'resp', 'puls', 'robustness', 'resp_flip',"
+    echo "'determinism', 'query', 'store', 'lod', 'stream', 'cache', 'shm'"
+    echo "or 'all' for every test that checks its results, these exit with"
+    echo "1 on failure"
     echo "See script code for more details"
 fi
 # Test respiration peak counting
@@ -30,7 +36,7 @@ fi
 # Test pulsoxy peak counting
 if [ "$datatype" = "puls" ]; then 
     $ampdroot/bin/ampd -f $testdatadir/pulsoxy_raw.txt -v -l 60 \
-        --output-all -r $sr --preproc -t puls -a $testoux -o $testout
+        --output-all -r $sr --preproc -t puls -a $testaux -o $testout
     $ampdroot/scripts/ampdcheck.py $testaux/batch_0
 fi
 # test time and stability of peak count for different batch lengths
@@ -67,3 +73,230 @@ if [ "$datatype" = "robustness" ]; then
         printf "elapsed time: $SECONDS sec\n"
     done
 fi
+# md5 of the outputs of $ampd with the given options
+run_sum(){
+    rm -rf $testout
+    $ampd -f $testdatadir/pulsoxy_raw.txt -l 10 -r $sr --preproc -t puls \
+        --deterministic $1 -o $testout > /dev/null
+    cat $testout/*.peaks $testout/*.rate $testout/*.pkx | md5sum
+}
+# outputs should be bitwise the same for any thread count and kernel,
+# return 1 if they are not
+compare_runs(){
+    sum_ref=""
+    ret=0
+    for args in "$@"
+    do
+        sum=$(run_sum "$args")
+        if [ -z "$sum_ref" ]; then
+            sum_ref=$sum
+        fi
+        if [ "$sum" = "$sum_ref" ]; then
+            echo "same: $args"
+        else
+            echo "DIFFERENT: $args"
+            ret=1
+        fi
+    done
+    return $ret
+}
+# and for the SIMD width of the build, ampd is built without SIMD flags and
+# with -march=native into a temporary directory, bin/ is left as it is
+compare_simd(){
+    builddir=$(mktemp -d)
+    ret=0
+    for simd in "" "-march=native"
+    do
+        dir=$builddir/simd${simd:-none}
+        make -C $ampdroot -B -s OBJ=$dir/obj BIN=$dir/bin SIMD="$simd" \
+            dir ampd > /dev/null || ret=1
+    done
+    for args in "$@"
+    do
+        ampd=$builddir/simdnone/bin/ampd
+        sum_ref=$(run_sum "$args")
+        ampd=$builddir/simd-march=native/bin/ampd
+        sum=$(run_sum "$args")
+        if [ "$sum" = "$sum_ref" ]; then
+            echo "same: -march=native $args"
+        else
+            echo "DIFFERENT: -march=native $args"
+            ret=1
+        fi
+    done
+    ampd=$ampdroot/bin/ampd
+    rm -rf $builddir
+    return $ret
+}
+if [ "$datatype" = "determinism" ]; then
+    status=0
+    compare_runs "--threads 1 --kernel matfree" "--threads 4 --kernel matfree" \
+        "--threads 1 --kernel lanes" "--threads 3 --kernel lanes" \
+        "--threads 2 --kernel bitpack" "--threads 2 --kernel dense" || status=1
+    compare_runs "--threads 1 --adaptive" "--threads 2 --adaptive" \
+        "--threads 4 --adaptive" || status=1
+    compare_simd "--kernel matfree" "--threads 2 --kernel lanes" \
+        "--threads 2 --adaptive" || status=1
+    exit $status
+fi
+
+# self-checking tests on 10 minutes of the test data, in $testout
+status=0
+# print and count a failed check if the first two arguments differ
+check(){
+    if [ "$1" = "$2" ]; then
+        echo "ok: $3"
+    else
+        echo "FAILED: $3, got '$1', expected '$2'"
+        status=1
+    fi
+}
+new_testout(){
+    rm -rf $testout
+    mkdir -p $testout
+    head -60000 $testdatadir/resp_raw.txt > $testout/resp.txt
+}
+# peak index queries against counts of the .peaks file
+if [ "$datatype" = "query" ]; then
+    new_testout
+    $ampd -f $testout/resp.txt -t resp -r $sr -o $testout > /dev/null
+    peaks=$testout/resp.peaks
+    pkx=$testout/resp.pkx
+    total=$(wc -l < $peaks)
+    check "$($bin/ampdquery -i $pkx -s | grep n_peaks=)" "n_peaks=$total" \
+        "summary peak count"
+    for range in "0 600" "12.5 70.25" "299.99 300.01" "590 600"
+    do
+        set -- $range
+        expect=$(awk -v a=$1 -v b=$2 -v fs=$sr \
+            '$1 >= a * fs && $1 < b * fs' $peaks | wc -l)
+        check "$($bin/ampdquery -i $pkx $1 $2 | cut -f 3)" "$expect" \
+            "peaks in $1 $2"
+    done
+    for w in 60 300
+    do
+        expect=$(awk -v n=$((w * sr)) '{c[int($1 / n)]++}
+            END{for(i=0; i<600*'$sr'/n; i++) print c[i]+0}' $peaks)
+        got=$($bin/ampdquery -i $pkx -w $w | grep -v "^#" | cut -f 2)
+        check "$(echo $got)" "$(echo $expect)" "rollup of ${w}s windows"
+    done
+    exit $status
+fi
+# cohort store: a rerun supersedes the run before, excluded studies are
+# left out
+if [ "$datatype" = "store" ]; then
+    new_testout
+    store=$testout/cohort.ars
+    for run in "s_2020060501 60" "s_2020060501 120" "s_2020060502 60"
+    do
+        set -- $run
+        $ampd -f $testout/resp.txt -t resp -r $sr -l $2 -o $testout \
+            --store $store --study $1 > /dev/null
+    done
+    check "$($bin/ampdstat -s $store -t resp --study 2020060501 --batches \
+        | wc -l)" 5 "rerun with 120s batches supersedes 60s batches"
+    check "$($bin/ampdstat -s $store -t resp | grep -c ^s_)" 2 \
+        "studies in store"
+    echo "s_2020060502" > $testout/exclude_id
+    check "$($bin/ampdstat -s $store -t resp -x $testout/exclude_id \
+        | cut -f 1 | tr '\n' ' ')" "s_2020060501 # series=1 all " \
+        "exclude file"
+    check "$($bin/ampdstat -s $store -t resp --exclude 0501 | cut -f 1 \
+        | tr '\n' ' ')" "s_2020060502 # series=1 all " "--exclude"
+    $bin/ampdstat -s $store --compact
+    check "$($bin/ampdstat -s $store -t resp --batches | wc -l)" 15 \
+        "batches after compaction"
+    exit $status
+fi
+# level of detail pyramid: every level is 1/factor of the one below, until
+# at most 256 bins, see src/lod.h
+if [ "$datatype" = "lod" ]; then
+    new_testout
+    $ampd -f $testout/resp.txt -t resp -r $sr -o $testout --output-lod \
+        > /dev/null
+    lod=$testout/resp.lod
+    factor=$(od -An -t u4 -j 8 -N 4 $lod | tr -d ' ')
+    levels=$(od -An -t u4 -j 12 -N 4 $lod | tr -d ' ')
+    datalen=$(od -An -t u4 -j 16 -N 4 $lod | tr -d ' ')
+    check "$factor $datalen" "4 60000" "factor and data length"
+    expect=""
+    count=$datalen
+    while [ -z "$expect" ] || [ $count -gt 256 ]
+    do
+        count=$(( (count + factor - 1) / factor ))
+        expect="$expect $count"
+    done
+    check "$(echo $(od -An -t u8 -j 32 -N $((8 * levels)) $lod))" \
+        "$(echo $expect)" "level bin counts"
+    exit $status
+fi
+# stream processing should give the same output as whole files
+if [ "$datatype" = "stream" ]; then
+    new_testout
+    $bin/ampdpreproc -f $testout/resp.txt -o $testout/whole.txt -s $sr \
+        -h 0.2 -l 3 > /dev/null
+    $bin/ampdpreproc -f $testout/resp.txt -o $testout/stream.txt -s $sr \
+        -h 0.2 -l 3 --stream --chunk 4096 > /dev/null
+    check "$(cmp $testout/whole.txt $testout/stream.txt && echo same)" same \
+        "ampdpreproc --stream"
+    $ampd -f $testout/resp.txt -t resp -r $sr -o $testout > /dev/null
+    $ampd -f - -t resp -r $sr -o - < $testout/resp.txt 2> /dev/null \
+        > $testout/stream.peaks
+    check "$(cmp $testout/resp.peaks $testout/stream.peaks && echo same)" \
+        same "ampd --stream"
+    exit $status
+fi
+# parsed input cache: used while the source is the same, built again when
+# it changes, even if only the hash of its contents tells
+if [ "$datatype" = "cache" ]; then
+    new_testout
+    src=$testout/resp.txt
+    $ampd -f $src -t resp -r $sr -o $testout/nocache > /dev/null
+    $ampd -f $src -t resp -r $sr -o $testout/cache --cache > /dev/null
+    check "$(head -c 8 $src.ampdc)" AMPDTXC1 "sidecar written"
+    check "$(cmp $testout/nocache/resp.peaks $testout/cache/resp.peaks \
+        && echo same)" same "peaks with cache"
+    inode=$(stat -c %i $src.ampdc)
+    $ampd -f $src -t resp -r $sr -o $testout/cache --cache > /dev/null
+    check "$(stat -c %i $src.ampdc)" "$inode" "sidecar reused"
+    # same size and modification time, other first value
+    touch -r $src $testout/stamp
+    sed -i '1s/.*/ 9.999/' $src
+    touch -r $testout/stamp $src
+    $ampd -f $src -t resp -r $sr -o $testout/nocache > /dev/null
+    $ampd -f $src -t resp -r $sr -o $testout/cache --cache > /dev/null
+    check "$([ "$(stat -c %i $src.ampdc)" != "$inode" ] && echo rebuilt)" \
+        rebuilt "stale sidecar rebuilt"
+    check "$(cmp $testout/nocache/resp.peaks $testout/cache/resp.peaks \
+        && echo same)" same "peaks with rebuilt cache"
+    exit $status
+fi
+# shared memory ring: a reader that loses nothing gets the same peaks as
+# a stream from the file
+if [ "$datatype" = "shm" ]; then
+    new_testout
+    ring=/ampdtest$$
+    $ampd -f - -t resp -r $sr -o - < $testout/resp.txt 2> /dev/null \
+        > $testout/stream.peaks
+    $bin/ampdshmwrite -f $testout/resp.txt -t resp -n $ring -r $sr -x 0 \
+        > /dev/null &
+    writer=$!
+    for i in $(seq 100)
+    do
+        [ -e /dev/shm$ring ] && break
+        sleep 0.1
+    done
+    $ampd --shm $ring --channel resp -t resp -r $sr -o - 2> /dev/null \
+        > $testout/shm.peaks
+    wait $writer
+    check "$(cmp $testout/stream.peaks $testout/shm.peaks && echo same)" \
+        same "ampd --shm"
+    exit $status
+fi
+if [ "$datatype" = "all" ]; then
+    for t in query store lod stream cache shm determinism
+    do
+        $0 $t || status=1
+    done
+    exit $status
+fi